@@ -0,0 +1,142 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "arena.h"
+
+#define ARENA_BLOCK_SIZE 1024
+#define ARENA_ALIGNMENT 16
+
+/*
+ * Rounds a size up to the arena's alignment
+ * size - The size to round
+ * Returns the rounded size
+ */
+static size_t align_size(size_t size) {
+    return (size + ARENA_ALIGNMENT - 1) & ~((size_t) ARENA_ALIGNMENT - 1);
+}
+
+/*
+ * Adds a block with room for at least the given number of bytes to the
+ * front of an arena. Must be called while holding the arena's guard,
+ * unless the arena is still being created.
+ * blocks - The arena's list of blocks
+ * size - The number of bytes needed
+ * Returns the new block
+ */
+static ArenaBlock* add_block(ArenaBlock** blocks, size_t size) {
+    size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    ArenaBlock* block = malloc(sizeof(ArenaBlock) + blockSize);
+    block->next = *blocks;
+    block->size = blockSize;
+    block->used = 0;
+    *blocks = block;
+    return block;
+}
+
+/*
+ * Creates an empty arena
+ * Returns a pointer to the new arena
+ */
+Arena* arena_create(void) {
+    ArenaBlock* blocks = NULL;
+    ArenaBlock* block = add_block(&blocks, 0);
+    Arena* arena = (Arena*) block->data;
+    block->used = align_size(sizeof(Arena));
+    pthread_mutex_init(&arena->guard, NULL);
+    arena->blocks = blocks;
+    return arena;
+}
+
+/*
+ * Allocates memory from an arena. Must be called while holding the arena's
+ * guard.
+ * arena - The arena to allocate from
+ * size - The number of bytes to allocate
+ * Returns a pointer to the memory
+ */
+static void* allocate(Arena* arena, size_t size) {
+    size = align_size(size);
+    ArenaBlock* block = arena->blocks;
+    if (block->size - block->used < size) {
+        block = add_block(&arena->blocks, size);
+    }
+    void* pointer = block->data + block->used;
+    block->used += size;
+    return pointer;
+}
+
+/*
+ * Allocates memory that lives until its arena is destroyed
+ * arena - The arena to allocate from
+ * size - The number of bytes to allocate
+ * Returns a pointer to the memory
+ */
+void* arena_alloc(Arena* arena, size_t size) {
+    pthread_mutex_lock(&arena->guard);
+    void* pointer = allocate(arena, size);
+    pthread_mutex_unlock(&arena->guard);
+    return pointer;
+}
+
+/*
+ * Copies a string into an arena
+ * arena - The arena to copy into
+ * string - The string to copy
+ * Returns the copy
+ */
+char* arena_strdup(Arena* arena, char* string) {
+    int length = strlen(string) + 1;
+    char* copy = arena_alloc(arena, length);
+    memcpy(copy, string, length);
+    return copy;
+}
+
+/*
+ * Splits a string into an arena, as split_string does. Delimiters before
+ * the first character of text are skipped, and every delimiter after it
+ * starts a new, possibly empty, substring.
+ * arena - The arena to split into
+ * line - The line to split
+ * length - Set to the number of substrings
+ * delimiter - The delimiter to split the line by
+ * Returns the array of substrings
+ */
+char** arena_split_string(Arena* arena, char* line, int* length,
+        char delimiter) {
+    while (*line == delimiter) {
+        line++;
+    }
+    int segments = *line != '\0';
+    for (char* next = line; *next != '\0'; next++) {
+        segments += *next == delimiter;
+    }
+    int lineLength = strlen(line);
+    char** parsedLine = arena_alloc(arena, sizeof(char*) * (segments + 1) +
+            lineLength + 1);
+    char* copy = (char*) (parsedLine + segments + 1);
+    memcpy(copy, line, lineLength + 1);
+    for (int i = 0; i < segments; i++) {
+        parsedLine[i] = copy;
+        copy = strchr(copy, delimiter);
+        if (copy != NULL) {
+            *copy++ = '\0';
+        }
+    }
+    parsedLine[segments] = NULL;
+    *length = segments;
+    return parsedLine;
+}
+
+/*
+ * Releases every allocation made from an arena, including the arena itself
+ * arena - The arena to destroy
+ */
+void arena_destroy(Arena* arena) {
+    ArenaBlock* block = arena->blocks;
+    pthread_mutex_destroy(&arena->guard);
+    while (block != NULL) {
+        ArenaBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+// Represents a block of memory that an arena carves allocations from
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+// Represents a set of allocations that are all released together. The
+// arena lives in its own first block, and allocation is guarded, as both
+// agents of a match may allocate from its arena at once.
+typedef struct {
+    pthread_mutex_t guard;
+    ArenaBlock* blocks;
+} Arena;
+
+Arena* arena_create(void);
+
+void* arena_alloc(Arena* arena, size_t size);
+
+char* arena_strdup(Arena* arena, char* string);
+
+char** arena_split_string(Arena* arena, char* line, int* length,
+        char delimiter);
+
+void arena_destroy(Arena* arena);
+#endif
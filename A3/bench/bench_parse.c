@@ -0,0 +1,120 @@
+// The server is built with its main renamed, so that the parsers it uses
+// can be linked into this benchmark
+#undef main
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../server.h"
+#include "../frame.h"
+
+#define DEFAULT_ITERATIONS 1000000
+#define RESULTS_PER_MATCH 1024
+#define NAME "bench"
+#define RIVAL "rival"
+#define PORT "12345"
+#define MATCH_ID 1
+
+/*
+ * Returns the current monotonic time in seconds
+ */
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/*
+ * Parses the same match request repeatedly, as the server does when one
+ * arrives
+ * message - The request, as a line or a frame
+ * length - The length of the request
+ * iterations - The number of times to parse it
+ * Returns the nanoseconds taken per parse
+ */
+static double time_mr(char* message, int length, int iterations) {
+    MatchRequest request;
+    double start = now();
+    for (int i = 0; i < iterations; i++) {
+        if (parse_match_request(message, length, &request)) {
+            fprintf(stderr, "Invalid match request\n");
+            exit(1);
+        }
+        free_match_request(&request);
+    }
+    return (now() - start) * 1e9 / iterations;
+}
+
+/*
+ * Works out the outcome of the same result repeatedly, as the server does
+ * for each agent's result. Text results are split into the match's arena,
+ * so a fresh match is started every RESULTS_PER_MATCH results.
+ * server - The server holding the registry of both agents
+ * message - The result, as a line or a frame
+ * length - The length of the result
+ * iterations - The number of times to work out the outcome
+ * Returns the nanoseconds taken per result
+ */
+static double time_result(ServerState* server, char* message, int length,
+        int iterations) {
+    int agent1Id = registry_lookup(&server->registry, NAME);
+    int agent2Id = registry_lookup(&server->registry, RIVAL);
+    int binary = is_frame(message, length);
+    Match* match = NULL;
+    double start = now();
+    for (int i = 0; i < iterations; i++) {
+        if (i % RESULTS_PER_MATCH == 0) {
+            if (match != NULL) {
+                free_match(match);
+            }
+            match = new_match(MATCH_ID, agent1Id, PORT);
+            match->agent2Id = agent2Id;
+        }
+        Outcome claim = binary ?
+                frame_claim(message, length, MATCH_ID, agent1Id, agent2Id) :
+                result_claim(server, match, message);
+        if (claim != FIRST_WON) {
+            fprintf(stderr, "Invalid result\n");
+            exit(1);
+        }
+    }
+    double elapsed = now() - start;
+    free_match(match);
+    return elapsed * 1e9 / iterations;
+}
+
+/*
+ * Measures how long the server takes to parse match requests and results
+ * in the text and binary encodings
+ * Usage: bench_parse [iterations]
+ */
+int main(int argc, char** argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+    ServerState server;
+    registry_init(&server.registry);
+    int agent1Id = registry_intern(&server.registry, NAME);
+    registry_intern(&server.registry, RIVAL);
+
+    char mrLine[] = "MR:" NAME ":" PORT;
+    char mrFrame[FRAME_HEADER_LENGTH + sizeof(NAME) + sizeof(PORT) + 1];
+    int mrFrameLength = frame_mr(mrFrame, NAME, PORT);
+    char resultLine[64];
+    snprintf(resultLine, sizeof(resultLine), "RESULT:%d:%s", MATCH_ID,
+            NAME);
+    char resultFrame[FRAME_HEADER_LENGTH + 8];
+    int resultFrameLength = frame_result(resultFrame, MATCH_ID, agent1Id);
+
+    double mrText = time_mr(mrLine, strlen(mrLine), iterations);
+    double mrBinary = time_mr(mrFrame, mrFrameLength, iterations);
+    double resultText = time_result(&server, resultLine, strlen(resultLine),
+            iterations);
+    double resultBinary = time_result(&server, resultFrame,
+            resultFrameLength, iterations);
+    printf("%-8s %12s %12s %8s\n", "message", "text_ns", "frame_ns",
+            "speedup");
+    printf("%-8s %12.1f %12.1f %7.1fx\n", "MR", mrText, mrBinary,
+            mrText / mrBinary);
+    printf("%-8s %12.1f %12.1f %7.1fx\n", "RESULT", resultText,
+            resultBinary, resultText / resultBinary);
+    return 0;
+}
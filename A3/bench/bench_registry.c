@@ -0,0 +1,60 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../registry.h"
+
+#define DEFAULT_REGISTRATIONS (1 << 20)
+#define FIRST_BAND (1 << 10)
+#define NAME_LENGTH 32
+
+/*
+ * Returns the current monotonic time in seconds
+ */
+static double now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/*
+ * Registers the names numbered from first up to but not including last,
+ * as a connecting client does
+ * registry - The registry to register in
+ * first - The number of the first name
+ * last - The number after the last name
+ * Returns the number of registrations per second
+ */
+static double register_names(Registry* registry, int first, int last) {
+    char name[NAME_LENGTH];
+    double start = now();
+    for (int i = first; i < last; i++) {
+        snprintf(name, NAME_LENGTH, "agent%d", i);
+        registry_intern(registry, name);
+    }
+    return (last - first) / (now() - start);
+}
+
+/*
+ * Measures registration throughput as the registry grows. The registry is
+ * filled in bands that double in size, and for each band reports the rate
+ * at which its new names are registered and then the rate at which the
+ * same names are registered again, which finds each existing agent.
+ * Usage: bench_registry [registrations]
+ */
+int main(int argc, char** argv) {
+    int registrations = argc > 1 ? atoi(argv[1]) : DEFAULT_REGISTRATIONS;
+    Registry registry;
+    registry_init(&registry);
+    printf("%10s %14s %14s\n", "agents", "new/s", "existing/s");
+    int first = 0;
+    for (int last = FIRST_BAND; first < registrations; last *= 2) {
+        if (last > registrations) {
+            last = registrations;
+        }
+        double added = register_names(&registry, first, last);
+        double found = register_names(&registry, first, last);
+        printf("%10d %14.0f %14.0f\n", last, added, found);
+        first = last;
+    }
+    return 0;
+}
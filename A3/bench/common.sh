@@ -0,0 +1,65 @@
+# Helpers shared by the benchmark scripts, which source this file and are
+# run from A3 after "make && make bench"
+
+# start_server command... - starts a server in the background with its
+# metrics page on a free port, and waits for it to report its ports. Sets
+# SERVER, PORT and METRICS_PORT.
+start_server() {
+    SERVER_OUTPUT=$(mktemp)
+    "$@" -m 0 > "$SERVER_OUTPUT" 2> "$SERVER_OUTPUT.err" &
+    SERVER=$!
+    while [ ! -s "$SERVER_OUTPUT" ] ||
+            ! grep -q '^metrics ' "$SERVER_OUTPUT.err"; do
+        sleep 0.05
+    done
+    PORT=$(head -1 "$SERVER_OUTPUT")
+    METRICS_PORT=$(awk '$1 == "metrics" {print $2}' "$SERVER_OUTPUT.err")
+}
+
+# stop_server - stops the server and waits for it to exit, leaving what it
+# wrote to stderr in SERVER_ERRORS
+stop_server() {
+    kill "$SERVER"
+    wait "$SERVER" 2> /dev/null
+    SERVER_ERRORS=$(cat "$SERVER_OUTPUT.err")
+    rm -f "$SERVER_OUTPUT" "$SERVER_OUTPUT.err"
+}
+
+# metric name - prints a value from the server's metrics page
+metric() {
+    exec 3<> "/dev/tcp/127.0.0.1/$METRICS_PORT"
+    printf 'GET / HTTP/1.0\r\n\r\n' >&3
+    awk -v name="$1" '$1 == name {print $2}' <&3 2> /dev/null
+    exec 3<&-
+}
+
+# start_clients count matches [flags...] - starts clients that each play
+# the given number of matches against the server. Sets CLIENT_PIDS.
+start_clients() {
+    local count=$1 matches=$2
+    shift 2
+    CLIENT_PIDS=()
+    for i in $(seq 1 "$count"); do
+        ./rpsclient "bench$i" "$matches" "$PORT" "$@" > /dev/null 2>&1 &
+        CLIENT_PIDS+=($!)
+    done
+}
+
+# stop_clients - stops every client still playing
+stop_clients() {
+    kill "${CLIENT_PIDS[@]}" 2> /dev/null
+    wait "${CLIENT_PIDS[@]}" 2> /dev/null
+}
+
+# throughput seconds - prints the matches per second the server records
+# over the given number of seconds
+throughput() {
+    local startMatches startTime endMatches endTime
+    startMatches=$(metric rps_matches_total)
+    startTime=$(date +%s.%N)
+    sleep "$1"
+    endMatches=$(metric rps_matches_total)
+    endTime=$(date +%s.%N)
+    awk -v matches=$((endMatches - startMatches)) -v start="$startTime" \
+            -v end="$endTime" 'BEGIN {printf "%.1f", matches / (end - start)}'
+}
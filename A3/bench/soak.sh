@@ -0,0 +1,24 @@
+#!/bin/bash
+# Records the server's resident set size over time while clients play
+# continuously, to show that the heap stays flat as matches are freed.
+# Usage: bench/soak.sh [seconds] [clients] [-- server flags]
+DURATION=${1:-20}
+CLIENTS=${2:-8}
+shift 2
+[ "$1" = "--" ] && shift
+source "$(dirname "$0")/common.sh"
+
+# rss - prints the server's resident set size in kB
+rss() {
+    awk '$1 == "VmRSS:" {print $2}' "/proc/$SERVER/status"
+}
+
+start_server ./rpsserver "$@"
+start_clients "$CLIENTS" 1000000
+printf "%8s %10s %10s\n" "seconds" "matches" "rss_kb"
+for SECOND in $(seq 1 "$DURATION"); do
+    sleep 1
+    printf "%8d %10d %10d\n" "$SECOND" "$(metric rps_matches_total)" "$(rss)"
+done
+stop_clients
+stop_server
@@ -0,0 +1,33 @@
+#!/bin/bash
+# Compares the io_uring server with a single epoll thread. Throughput is the
+# matches per second recorded while clients play continuously; system calls
+# per match are counted by running a fixed number of matches with the
+# server under bench/syscount. Unpaired clients give up after a second, so
+# the run always ends.
+# Usage: bench/syscalls.sh [clients] [matches per client] [seconds]
+CLIENTS=${1:-32}
+MATCHES=${2:-50}
+DURATION=${3:-3}
+source "$(dirname "$0")/common.sh"
+
+for MODE in "-e 1" "-u"; do
+    start_server ./rpsserver $MODE
+    start_clients "$CLIENTS" 1000000
+    sleep 0.5
+    RATE=$(throughput "$DURATION")
+    stop_clients
+    stop_server
+
+    start_server bench/syscount ./rpsserver $MODE -t 30:1:30
+    start_clients "$CLIENTS" "$MATCHES"
+    wait "${CLIENT_PIDS[@]}"
+    PLAYED=$(metric rps_matches_total)
+    stop_server
+    SYSCALLS=$(awk '$1 == "syscalls" {print $2}' <<< "$SERVER_ERRORS")
+
+    awk -v mode="$MODE" -v rate="$RATE" -v played="$PLAYED" \
+            -v syscalls="$SYSCALLS" 'BEGIN {
+        printf "%-5s %10.1f matches/s %8.1f syscalls/match\n", mode, rate,
+                syscalls / played
+    }'
+done
@@ -0,0 +1,95 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/ptrace.h>
+
+#define TRACE_OPTIONS (PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACECLONE | \
+        PTRACE_O_EXITKILL)
+
+static pid_t traced;
+
+/*
+ * Passes a signal asking the tracer to stop on to the traced program, so
+ * it can shut down and its system calls are reported
+ * signal - The signal received
+ */
+static void forward_signal(int signal) {
+    kill(traced, signal);
+}
+
+/*
+ * Starts the given program stopped under ptrace
+ * arguments - The program and its arguments
+ */
+static void start_traced(char** arguments) {
+    traced = fork();
+    if (traced == 0) {
+        ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+        raise(SIGSTOP);
+        execvp(arguments[0], arguments);
+        perror(arguments[0]);
+        exit(1);
+    }
+}
+
+/*
+ * Works out whether a ptrace stop is the entry to a system call
+ * thread - The stopped thread
+ * Returns 1 if the thread is entering a system call, else returns 0
+ */
+static int entering_syscall(pid_t thread) {
+    struct __ptrace_syscall_info info;
+    return ptrace(PTRACE_GET_SYSCALL_INFO, thread, sizeof(info), &info) > 0
+            && info.op == PTRACE_SYSCALL_INFO_ENTRY;
+}
+
+/*
+ * Runs a program, counting the system calls made by every one of its
+ * threads, and reports the count on stderr once it exits. SIGINT and SIGTERM
+ * are passed on to the program.
+ * Usage: syscount program [arguments...]
+ */
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: syscount program [arguments...]\n");
+        return 1;
+    }
+    start_traced(argv + 1);
+    signal(SIGINT, forward_signal);
+    signal(SIGTERM, forward_signal);
+    int status;
+    waitpid(traced, &status, 0);
+    ptrace(PTRACE_SETOPTIONS, traced, NULL, TRACE_OPTIONS);
+    ptrace(PTRACE_SYSCALL, traced, NULL, NULL);
+    unsigned long syscalls = 0;
+    while (1) {
+        pid_t thread = waitpid(-1, &status, __WALL);
+        if (thread < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            if (thread == traced) {
+                break;
+            }
+            continue;
+        }
+        int signal = WSTOPSIG(status);
+        if (signal == (SIGTRAP | 0x80)) {
+            syscalls += entering_syscall(thread);
+            signal = 0;
+        } else if (signal == SIGTRAP || signal == SIGSTOP) {
+            // Clone events and the stops new threads start with
+            signal = 0;
+        }
+        ptrace(PTRACE_SYSCALL, thread, NULL, signal);
+    }
+    fprintf(stderr, "syscalls %lu\n", syscalls);
+    return 0;
+}
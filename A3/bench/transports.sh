@@ -0,0 +1,30 @@
+#!/bin/bash
+# Compares TCP loopback with Unix domain sockets. Clients play
+# continuously against the server and connect to each other over the same
+# transport as they do to it. Reports the matches per second recorded and
+# the play phase latency, from MATCH being sent to both results arriving.
+# Usage: bench/transports.sh [seconds] [clients] [-- server flags]
+DURATION=${1:-3}
+CLIENTS=${2:-2}
+shift 2
+[ "$1" = "--" ] && shift
+[ $# -gt 0 ] || set -- -e 1
+source "$(dirname "$0")/common.sh"
+
+DIRECTORY=$(mktemp -d)
+printf "%-6s %12s %12s %12s\n" "" "matches/s" "play_p50_ms" "play_p99_ms"
+for TRANSPORT in tcp unix; do
+    if [ "$TRANSPORT" = unix ]; then
+        start_server ./rpsserver -p "$DIRECTORY/server" "$@"
+    else
+        start_server ./rpsserver "$@"
+    fi
+    start_clients "$CLIENTS" 1000000
+    sleep 0.5
+    RATE=$(throughput "$DURATION")
+    printf "%-6s %12s %12s %12s\n" "$TRANSPORT" "$RATE" \
+            "$(metric rps_phase_play_p50_ms)" "$(metric rps_phase_play_p99_ms)"
+    stop_clients
+    stop_server
+done
+rm -rf "$DIRECTORY"
@@ -0,0 +1,56 @@
+#!/bin/bash
+# Records the server's CPU use as the number of waiting clients grows.
+# Each waiting client sends its match request and then goes quiet, so one
+# is left waiting for a partner and every other sits paired, waiting for
+# its result to be sent. A server that parks its waiting clients should
+# stay near zero CPU however many there are.
+# Usage: bench/waiters.sh [seconds] [waiting clients...] [-- server flags]
+DURATION=${1:-2}
+shift
+COUNTS=()
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do
+    COUNTS+=("$1")
+    shift
+done
+shift
+[ ${#COUNTS[@]} -gt 0 ] || COUNTS=(1 16 64 256)
+source "$(dirname "$0")/common.sh"
+
+# cpu_ticks - prints the clock ticks of CPU the server has used so far
+cpu_ticks() {
+    awk '{print $14 + $15}' "/proc/$SERVER/stat"
+}
+
+# park_clients count - connects clients that send a match request and then
+# wait without ever sending a result. Sets CLIENT_PIDS.
+park_clients() {
+    CLIENT_PIDS=()
+    for i in $(seq 1 "$1"); do
+        (
+            exec 3<> "/dev/tcp/127.0.0.1/$PORT"
+            printf 'MR:wait%d:%d\n' "$i" "$((40000 + i))" >&3
+            exec sleep 3600
+        ) &
+        CLIENT_PIDS+=($!)
+    done
+}
+
+TICKS_PER_SECOND=$(getconf CLK_TCK)
+printf "%8s %8s\n" "waiting" "cpu%"
+for COUNT in "${COUNTS[@]}"; do
+    start_server ./rpsserver -t 3600:3600:3600 "$@"
+    park_clients "$COUNT"
+    while [ "$(metric rps_accepted_total)" -lt "$COUNT" ]; do
+        sleep 0.1
+    done
+    sleep 0.5
+    START=$(cpu_ticks)
+    sleep "$DURATION"
+    END=$(cpu_ticks)
+    stop_clients
+    stop_server
+    awk -v count="$COUNT" -v ticks=$((END - START)) \
+            -v rate="$TICKS_PER_SECOND" -v duration="$DURATION" 'BEGIN {
+        printf "%8d %8.1f\n", count, 100 * ticks / rate / duration
+    }'
+done
@@ -0,0 +1,587 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include "util.h"
+#include "server.h"
+#include "session.h"
+
+#define MAX_EVENTS 256
+#define STACK_SIZE (32 * 1024)
+#define INITIAL_INPUT 128
+
+// The states a coroutine passes through between being resumed
+typedef enum {
+    READY, WAITING, PARKING, PARKED, FINISHED
+} CoroutineState;
+
+struct Scheduler;
+
+// Represents a single client session running as a coroutine on a small
+// stack of its own, so that it can block without holding an OS thread
+typedef struct Coroutine {
+    ucontext_t context;
+    char* stack;
+    struct Scheduler* scheduler;
+    CoroutineState state;
+    int woken;
+    int fd;
+    Timer timer;
+    unsigned long acceptedAt;
+
+    char* input;
+    int inputLength;
+    int inputBuffer;
+
+    struct Coroutine* next;
+} Coroutine;
+
+// Represents an OS thread running coroutines. Coroutines are only ever
+// resumed by the scheduler that accepted them; other schedulers may only
+// make them ready again, through the guarded run queue.
+typedef struct Scheduler {
+    ServerState* server;
+    ucontext_t context;
+    int epollFd;
+    int wakeFd;
+    int listenFd;
+    pthread_t threadId;
+
+    pthread_mutex_t guard;
+    Coroutine* readyHead;
+    Coroutine* readyTail;
+} Scheduler;
+
+// The coroutine currently running on this thread
+static __thread Coroutine* current;
+
+/*
+ * Adds a coroutine to the end of its scheduler's run queue. Must be called
+ * while holding the scheduler's guard.
+ * coroutine - The coroutine that is ready to run
+ */
+static void make_ready(Coroutine* coroutine) {
+    Scheduler* scheduler = coroutine->scheduler;
+    coroutine->state = READY;
+    coroutine->next = NULL;
+    if (scheduler->readyTail != NULL) {
+        scheduler->readyTail->next = coroutine;
+    } else {
+        scheduler->readyHead = coroutine;
+    }
+    scheduler->readyTail = coroutine;
+}
+
+/*
+ * Switches from the running coroutine back to its scheduler
+ * state - What the scheduler should do with the coroutine
+ */
+static void yield(CoroutineState state) {
+    Coroutine* coroutine = current;
+    coroutine->state = state;
+    swapcontext(&coroutine->context, &coroutine->scheduler->context);
+}
+
+/*
+ * Suspends the running coroutine until its socket has the given events
+ * events - The epoll events to wait for
+ */
+static void wait_for(unsigned int events) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = events | EPOLLONESHOT;
+    event.data.ptr = current;
+    epoll_ctl(current->scheduler->epollFd, EPOLL_CTL_MOD, current->fd,
+            &event);
+    yield(WAITING);
+}
+
+/*
+ * Makes a parked coroutine ready to run again, from any thread. A wake that
+ * arrives before the coroutine has finished parking is remembered, so it
+ * is never lost. The scheduler's eventfd only fails to count a wake once
+ * its counter is about to overflow, when it is already readable anyway.
+ * coroutine - The coroutine to wake
+ */
+static void wake(Coroutine* coroutine) {
+    Scheduler* scheduler = coroutine->scheduler;
+    pthread_mutex_lock(&scheduler->guard);
+    if (coroutine->state == PARKED) {
+        make_ready(coroutine);
+        eventfd_write(scheduler->wakeFd, 1);
+    } else {
+        coroutine->woken = 1;
+    }
+    pthread_mutex_unlock(&scheduler->guard);
+}
+
+/*
+ * Reads a line or frame from the running coroutine's client, suspending it
+ * until the message has arrived. An unterminated final line is treated as
+ * a complete one, while a partial frame is discarded.
+ * length - Set to the length of the message
+ * Returns the message, which is zero terminated without its newline if it
+ * is a line, or NULL if the client closed its connection or sent a message
+ * that was too long or invalid
+ */
+static char* receive_message(int* length) {
+    Coroutine* coroutine = current;
+    int complete;
+    while (1) {
+        complete = frame_message_length(coroutine->input,
+                coroutine->inputLength);
+        if (complete != 0 || coroutine->inputLength > MAX_LINE_LENGTH) {
+            break;
+        }
+        if (coroutine->inputBuffer - coroutine->inputLength <
+                INITIAL_INPUT) {
+            coroutine->inputBuffer = coroutine->inputBuffer * 2 +
+                    INITIAL_INPUT;
+            coroutine->input = realloc(coroutine->input,
+                    coroutine->inputBuffer);
+        }
+        int received = recv(coroutine->fd,
+                coroutine->input + coroutine->inputLength,
+                coroutine->inputBuffer - coroutine->inputLength - 1,
+                MSG_DONTWAIT);
+        if (received < 0 && (errno == EAGAIN || errno == EINTR)) {
+            wait_for(EPOLLIN);
+        } else if (received <= 0) {
+            break;
+        } else {
+            coroutine->inputLength += received;
+        }
+    }
+    int frame = is_frame(coroutine->input, coroutine->inputLength);
+    int consumed = complete > 0 ? complete : coroutine->inputLength;
+    *length = complete > 0 && !frame ? consumed - 1 : consumed;
+    if (complete < 0 || *length > MAX_LINE_LENGTH ||
+            (complete == 0 && (frame || consumed == 0))) {
+        return NULL;
+    }
+    char* message = malloc(*length + 1);
+    memcpy(message, coroutine->input, *length);
+    message[*length] = '\0';
+    coroutine->inputLength -= consumed;
+    memmove(coroutine->input, coroutine->input + consumed,
+            coroutine->inputLength);
+    return message;
+}
+
+/*
+ * Sends a line or frame to the running coroutine's client, suspending it
+ * while the socket is full
+ * data - The line or frame to send
+ * length - The length of the data
+ */
+static void send_message(char* data, int length) {
+    int sent = 0;
+    while (sent < length) {
+        int written = send(current->fd, data + sent, length - sent,
+                MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (written < 0 && (errno == EAGAIN || errno == EINTR)) {
+            wait_for(EPOLLOUT);
+        } else if (written < 0) {
+            return;
+        } else {
+            sent += written;
+        }
+    }
+}
+
+/*
+ * Reclaims a coroutine whose deadline has passed while it waits on its
+ * client, by shutting the connection down so that the wait ends
+ * timer - The timer of the coroutine
+ * Returns 1, as the coroutine is always reclaimed
+ */
+static int expire_connection(Timer* timer) {
+    shutdown(((Coroutine*) timer->data)->fd, SHUT_RDWR);
+    return 1;
+}
+
+/*
+ * Reclaims a coroutine that has waited too long for a partner by
+ * withdrawing its ticket and waking it
+ * timer - The timer of the coroutine
+ * Returns 1 if the coroutine was still waiting, else returns 0
+ */
+static int expire_ticket(Timer* timer) {
+    PairingTicket* ticket = (PairingTicket*) timer->data;
+    if (!pairing_expire(ticket)) {
+        return 0;
+    }
+    wake(ticket->coroutine);
+    return 1;
+}
+
+/*
+ * Reads a line or frame from the running coroutine's client within the
+ * deadline of the given phase
+ * server - The current state of the server
+ * phase - The phase the message is awaited in
+ * length - Set to the length of the message
+ * Returns the message, or NULL if none arrived in time
+ */
+static char* receive_message_by(ServerState* server, TimerPhase phase,
+        int* length) {
+    init_timer(&current->timer, expire_connection, (void*) current);
+    timer_arm(&server->timers, &current->timer, phase);
+    char* message = receive_message(length);
+    timer_cancel(&server->timers, &current->timer);
+    return message;
+}
+
+/*
+ * Sends a line or frame to another coroutine's client without suspending.
+ * Only used to relay a match, where each client has at most one unread
+ * message outstanding, so the socket never fills and the send never
+ * blocks. A client that cannot be sent to has its connection shut down,
+ * so its coroutine leaves the match at once and its opponent is sent an
+ * error rather than waiting for a move that will never come.
+ * peer - The coroutine whose client to send to
+ * data - The line or frame to send
+ * length - The length of the data
+ */
+static void send_to_peer(Coroutine* peer, char* data, int length) {
+    if (send(peer->fd, data, length, MSG_NOSIGNAL | MSG_DONTWAIT) !=
+            length) {
+        shutdown(peer->fd, SHUT_RDWR);
+    }
+}
+
+/*
+ * Relays a line to another coroutine's client, as send_to_peer does
+ * peer - The coroutine whose client to send to
+ * line - The line to send
+ */
+static void send_to_coroutine(void* peer, char* line) {
+    send_to_peer((Coroutine*) peer, line, strlen(line));
+}
+
+/*
+ * Relays the running coroutine's moves to its opponent until its client
+ * sends anything else, which is taken as its result. Each move must arrive
+ * within the deadline for a result.
+ * server - The current state of the server
+ * match - The relayed match
+ * agentNumber - The client's position in the match
+ * length - Set to the length of the result
+ * Returns the client's result, or NULL if none arrived in time
+ */
+static char* relay_moves(ServerState* server, Match* match,
+        int agentNumber, int* length) {
+    Coroutine* opponent = agentNumber == 1 ? match->agent2Coroutine :
+            match->agent1Coroutine;
+    char* line;
+    while ((line = receive_message_by(server, TIMER_RESULT, length)) != NULL) {
+        if (is_frame(line, *length)) {
+            break;
+        }
+        strtrim(line);
+        if (!relay_is_move(line)) {
+            break;
+        }
+        relay_forward(match->relay, agentNumber, line, send_to_coroutine,
+                opponent);
+        free(line);
+    }
+    relay_leave(match->relay, agentNumber, send_to_coroutine, opponent);
+    return line;
+}
+
+/*
+ * Waits for a partner, or pairs with the client that has waited longest,
+ * exactly as a pool worker does but parking the coroutine rather than its
+ * thread
+ * server - The current state of the server
+ * agentId - The id of the agent the client plays as
+ * request - The match request the client sent
+ * agentNumber - Set to the client's position in the match
+ * Returns the match the client was paired into, or NULL if it waited too
+ * long
+ */
+static Match* find_partner(ServerState* server, int agentId,
+        MatchRequest* request, int* agentNumber) {
+    PairingTicket ticket;
+    Match* match = NULL;
+    init_ticket(&ticket, agentId, request->port);
+    ticket.binary = request->binary;
+    ticket.coroutine = current;
+    PairingTicket* partner = pairing_join(server->shards,
+            server->numberOfShards, 0, &ticket);
+    if (partner != NULL) {
+        match = pair_tickets(server, partner, &ticket);
+    }
+    if (partner != NULL) {
+        *agentNumber = 2;
+        if (match->relay != NULL) {
+            int length;
+            char* message = format_match(server, match, 1, &length);
+            send_to_peer(partner->coroutine, message, length);
+            match_sent(match, 1);
+            message = format_match(server, match, 2, &length);
+            send_message(message, length);
+            match_sent(match, 2);
+        }
+        pairing_complete(partner, match);
+        wake(partner->coroutine);
+    } else {
+        *agentNumber = 1;
+        init_timer(&current->timer, expire_ticket, (void*) &ticket);
+        timer_arm(&server->timers, &current->timer, TIMER_PAIRING);
+        yield(PARKING);
+        timer_cancel(&server->timers, &current->timer);
+        match = pairing_wait(&ticket);
+    }
+    destroy_ticket(&ticket);
+    return match;
+}
+
+/*
+ * Serves one client from match request to result. This reads exactly like
+ * the blocking version run by pool workers; every wait simply suspends the
+ * coroutine instead.
+ * server - The current state of the server
+ */
+static void serve_client(ServerState* server) {
+    int length, agentNumber, replyLength;
+    char* message, * reply;
+    while ((message = receive_message_by(server, TIMER_MR, &length)) != NULL
+            && (reply = answer_query(server, message, length,
+            &replyLength)) != NULL) {
+        send_message(reply, replyLength);
+        free(reply);
+        free(message);
+    }
+    if (message == NULL) {
+        return;
+    }
+    metrics_record_phase(PHASE_MR, metrics_now() - current->acceptedAt);
+    MatchRequest request;
+    Match* match = NULL;
+    if (!parse_match_request(message, length, &request)) {
+        int agentId = registry_intern(&server->registry, request.name);
+        if (agentId != NO_AGENT) {
+            match = find_partner(server, agentId, &request, &agentNumber);
+        }
+    }
+    int binary = request.binary;
+    free_match_request(&request);
+    free(message);
+    if (match == NULL) {
+        if (binary) {
+            char refusal[FRAME_HEADER_LENGTH];
+            send_message(refusal, frame_refused(refusal));
+        }
+        return;
+    }
+    char* result;
+    if (match->relay != NULL) {
+        result = relay_moves(server, match, agentNumber, &length);
+    } else {
+        message = format_match(server, match, agentNumber, &length);
+        send_message(message, length);
+        match_sent(match, agentNumber);
+        result = receive_message_by(server, TIMER_RESULT, &length);
+    }
+    store_result(match, agentNumber, result != NULL ? result : "",
+            result != NULL ? length : 0);
+    free(result);
+    if (__atomic_add_fetch(&match->resultsReported, 1,
+            __ATOMIC_ACQ_REL) == 2) {
+        submit_results(server, match);
+    }
+}
+
+/*
+ * Entry point of every coroutine
+ */
+static void run_coroutine(void) {
+    serve_client(current->scheduler->server);
+    metrics_count(METRIC_CLOSED);
+    current->state = FINISHED;
+}
+
+/*
+ * Creates a coroutine for a newly accepted client and queues it to run
+ * scheduler - The scheduler that accepted the client
+ * fd - The client's socket
+ */
+static void spawn(Scheduler* scheduler, int fd) {
+    metrics_count(METRIC_ACCEPTED);
+    Coroutine* coroutine = calloc(1, sizeof(Coroutine));
+    coroutine->scheduler = scheduler;
+    coroutine->fd = fd;
+    coroutine->acceptedAt = metrics_now();
+    coroutine->stack = malloc(STACK_SIZE);
+    getcontext(&coroutine->context);
+    coroutine->context.uc_stack.ss_sp = coroutine->stack;
+    coroutine->context.uc_stack.ss_size = STACK_SIZE;
+    coroutine->context.uc_link = &scheduler->context;
+    makecontext(&coroutine->context, run_coroutine, 0);
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = EPOLLONESHOT;
+    event.data.ptr = coroutine;
+    epoll_ctl(scheduler->epollFd, EPOLL_CTL_ADD, fd, &event);
+    pthread_mutex_lock(&scheduler->guard);
+    make_ready(coroutine);
+    pthread_mutex_unlock(&scheduler->guard);
+}
+
+/*
+ * Frees a coroutine whose client has been served, closing its connection
+ * coroutine - The finished coroutine
+ */
+static void reap(Coroutine* coroutine) {
+    epoll_ctl(coroutine->scheduler->epollFd, EPOLL_CTL_DEL, coroutine->fd,
+            NULL);
+    close(coroutine->fd);
+    free(coroutine->stack);
+    free(coroutine->input);
+    free(coroutine);
+}
+
+/*
+ * Resumes a ready coroutine until it next waits, then files it according
+ * to why it stopped
+ * coroutine - The coroutine to resume
+ */
+static void resume(Coroutine* coroutine) {
+    Scheduler* scheduler = coroutine->scheduler;
+    current = coroutine;
+    swapcontext(&scheduler->context, &coroutine->context);
+    current = NULL;
+    if (coroutine->state == FINISHED) {
+        reap(coroutine);
+    } else if (coroutine->state == PARKING) {
+        pthread_mutex_lock(&scheduler->guard);
+        if (coroutine->woken) {
+            coroutine->woken = 0;
+            make_ready(coroutine);
+        } else {
+            coroutine->state = PARKED;
+        }
+        pthread_mutex_unlock(&scheduler->guard);
+    }
+}
+
+/*
+ * Runs every coroutine that is ready, including any made ready while doing
+ * so
+ * scheduler - The scheduler to run
+ */
+static void run_ready(Scheduler* scheduler) {
+    while (1) {
+        pthread_mutex_lock(&scheduler->guard);
+        Coroutine* coroutine = scheduler->readyHead;
+        if (coroutine != NULL) {
+            scheduler->readyHead = coroutine->next;
+            if (scheduler->readyHead == NULL) {
+                scheduler->readyTail = NULL;
+            }
+        }
+        pthread_mutex_unlock(&scheduler->guard);
+        if (coroutine == NULL) {
+            return;
+        }
+        resume(coroutine);
+    }
+}
+
+/*
+ * Runs a single scheduler forever
+ * schedulerData - The scheduler to run
+ */
+static void* run_scheduler(void* schedulerData) {
+    Scheduler* scheduler = (Scheduler*) schedulerData;
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        run_ready(scheduler);
+        int ready = epoll_wait(scheduler->epollFd, events, MAX_EVENTS, -1);
+        for (int i = 0; i < ready; i++) {
+            void* source = events[i].data.ptr;
+            if (source == NULL) {
+                int clientFd;
+                while ((clientFd = accept4(scheduler->listenFd, 0, 0,
+                        SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+                    spawn(scheduler, clientFd);
+                }
+            } else if (source == (void*) scheduler) {
+                eventfd_t wakes;
+                eventfd_read(scheduler->wakeFd, &wakes);
+            } else {
+                pthread_mutex_lock(&scheduler->guard);
+                make_ready((Coroutine*) source);
+                pthread_mutex_unlock(&scheduler->guard);
+            }
+        }
+    }
+    return (void*) NULL;
+}
+
+/*
+ * Adds a file descriptor to a scheduler's epoll instance
+ * scheduler - The scheduler to watch the descriptor
+ * fd - The descriptor to watch
+ * events - The epoll events to wait on
+ * source - The pointer reported with the descriptor's events
+ * Returns 0 on success, else returns -1
+ */
+static int watch(Scheduler* scheduler, int fd, unsigned int events,
+        void* source) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = events;
+    event.data.ptr = source;
+    return epoll_ctl(scheduler->epollFd, EPOLL_CTL_ADD, fd, &event);
+}
+
+/*
+ * Serves each client as a coroutine with a small stack of its own, run by
+ * the given number of scheduler threads. Sessions keep the sequential
+ * style of the pool workers but cost a few kilobytes rather than a thread.
+ * server - The current state of the server, with its listener created
+ * numberOfSchedulers - The number of scheduler threads to run
+ * Returns only if the schedulers could not be started
+ */
+int run_coroutines(ServerState* server, int numberOfSchedulers) {
+    struct rlimit limit;
+    if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    int listenFd = server->serverInfo.socketFd;
+    fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+    Scheduler* schedulers = calloc(numberOfSchedulers, sizeof(Scheduler));
+    for (int i = 0; i < numberOfSchedulers; i++) {
+        Scheduler* scheduler = &schedulers[i];
+        scheduler->server = server;
+        scheduler->listenFd = listenFd;
+        pthread_mutex_init(&scheduler->guard, NULL);
+        scheduler->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        scheduler->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (scheduler->epollFd < 0 || scheduler->wakeFd < 0 ||
+                watch(scheduler, listenFd, EPOLLIN | EPOLLEXCLUSIVE, NULL) ||
+                watch(scheduler, scheduler->wakeFd, EPOLLIN,
+                (void*) scheduler)) {
+            return 1;
+        }
+    }
+    for (int i = 1; i < numberOfSchedulers; i++) {
+        pthread_create(&schedulers[i].threadId, NULL, run_scheduler,
+                (void*) &schedulers[i]);
+    }
+    run_scheduler((void*) &schedulers[0]);
+    return 0;
+}
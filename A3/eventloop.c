@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include "util.h"
+#include "server.h"
+#include "session.h"
+
+#define MAX_EVENTS 256
+#define READ_CHUNK 4096
+
+// Represents an event loop thread and the epoll instance it owns
+typedef struct {
+    ServerState* server;
+    int epollFd;
+    int listenFd;
+    pthread_t threadId;
+    Wave wave;
+} EventLoop;
+
+/*
+ * Changes the events the given session is waiting on
+ * session - The session to update
+ * events - The epoll events to wait on
+ */
+static void watch_session(Session* session, unsigned int events) {
+    struct epoll_event event;
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = events;
+    event.data.ptr = session;
+    epoll_ctl(((EventLoop*) session->owner)->epollFd, EPOLL_CTL_MOD,
+            session->fd, &event);
+}
+
+/*
+ * Sends a line or frame to the given session without blocking. Whatever
+ * cannot be written immediately is buffered and flushed once the socket is
+ * writable.
+ * session - The session to send to
+ * data - The line or frame to send
+ * length - The length of the data
+ */
+static void send_data(Session* session, char* data, int length) {
+    int written = 0;
+    pthread_mutex_lock(&session->outputGuard);
+    if (session->outputLength == 0) {
+        written = send(session->fd, data, length,
+                MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (written < 0) {
+            written = errno == EAGAIN ? 0 : length;
+        }
+    }
+    if (written < length) {
+        session->output = realloc(session->output,
+                session->outputLength + length - written);
+        memcpy(session->output + session->outputLength, data + written,
+                length - written);
+        session->outputLength += length - written;
+        watch_session(session, EPOLLIN | EPOLLOUT);
+    }
+    pthread_mutex_unlock(&session->outputGuard);
+}
+
+/*
+ * Writes as much of the session's buffered output as the socket accepts
+ * session - The session to flush
+ */
+static void flush_output(Session* session) {
+    pthread_mutex_lock(&session->outputGuard);
+    int written = send(session->fd, session->output, session->outputLength,
+            MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (written < 0) {
+        written = errno == EAGAIN ? 0 : session->outputLength;
+    }
+    memmove(session->output, session->output + written,
+            session->outputLength - written);
+    session->outputLength -= written;
+    if (session->outputLength == 0) {
+        watch_session(session, EPOLLIN);
+    }
+    pthread_mutex_unlock(&session->outputGuard);
+}
+
+/*
+ * Removes a closed session from its loop and frees it
+ * session - The session to close
+ */
+static void close_connection(Session* session) {
+    epoll_ctl(((EventLoop*) session->owner)->epollFd, EPOLL_CTL_DEL,
+            session->fd, NULL);
+    close(session->fd);
+    free_session(session);
+}
+
+static const SessionDriver epollDriver = {send_data, close_connection};
+
+/*
+ * Reads whatever is available from a session and passes it on to be
+ * handled
+ * session - The session to read from
+ */
+static void read_session(Session* session) {
+    char chunk[READ_CHUNK];
+    int received = recv(session->fd, chunk, READ_CHUNK, MSG_DONTWAIT);
+    if (received < 0 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (received <= 0) {
+        session_end(session);
+        return;
+    }
+    session_receive(session, chunk, received);
+}
+
+/*
+ * Accepts every pending connection on the listener and adds each one to
+ * the given loop
+ * loop - The loop that will own the accepted sessions
+ */
+static void accept_clients(EventLoop* loop) {
+    int clientFd;
+    while ((clientFd = accept4(loop->listenFd, 0, 0,
+            SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+        Session* session = new_session(loop->server, clientFd, &epollDriver,
+                (void*) loop, &loop->wave);
+        struct epoll_event event;
+        memset(&event, 0, sizeof(struct epoll_event));
+        event.events = EPOLLIN;
+        event.data.ptr = session;
+        epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, clientFd, &event);
+    }
+}
+
+/*
+ * Runs a single event loop forever. The match requests read while handling
+ * each batch of events are paired together as one wave.
+ * eventLoop - The loop to run
+ */
+static void* run_event_loop(void* eventLoop) {
+    EventLoop* loop = (EventLoop*) eventLoop;
+    struct epoll_event events[MAX_EVENTS];
+    while (1) {
+        int ready = epoll_wait(loop->epollFd, events, MAX_EVENTS, -1);
+        for (int i = 0; i < ready; i++) {
+            Session* session = (Session*) events[i].data.ptr;
+            if (session == NULL) {
+                accept_clients(loop);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                flush_output(session);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                read_session(session);
+            }
+        }
+        session_pair_wave(loop->server, &loop->wave);
+    }
+    return (void*) NULL;
+}
+
+/*
+ * Serves clients with the given number of event loop threads instead of a
+ * thread per client. Every loop waits on the shared listener, and each
+ * accepted client is owned by the loop that accepted it.
+ * server - The current state of the server, with its listener created
+ * numberOfLoops - The number of event loops to run
+ * Returns only if the loops could not be started
+ */
+int run_event_loops(ServerState* server, int numberOfLoops) {
+    struct rlimit limit;
+    if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    int listenFd = server->serverInfo.socketFd;
+    fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL) | O_NONBLOCK);
+    EventLoop* loops = calloc(numberOfLoops, sizeof(EventLoop));
+    for (int i = 0; i < numberOfLoops; i++) {
+        loops[i].server = server;
+        loops[i].listenFd = listenFd;
+        loops[i].epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (loops[i].epollFd < 0) {
+            return 1;
+        }
+        struct epoll_event event;
+        memset(&event, 0, sizeof(struct epoll_event));
+        event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        event.data.ptr = NULL;
+        if (epoll_ctl(loops[i].epollFd, EPOLL_CTL_ADD, listenFd, &event)) {
+            return 1;
+        }
+    }
+    for (int i = 1; i < numberOfLoops; i++) {
+        pthread_create(&loops[i].threadId, NULL, run_event_loop,
+                (void*) &loops[i]);
+    }
+    run_event_loop((void*) &loops[0]);
+    return 0;
+}
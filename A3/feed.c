@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "util.h"
+#include "metrics.h"
+#include "feed.h"
+
+#define TICK_MICROSECONDS 100000
+#define MAX_BACKLOG (4 << 20)
+#define DISCARD_SIZE 256
+#define INITIAL_OUTPUT 4096
+
+/*
+ * Returns the agent a queued link is embedded in
+ * link - The link of a changed agent
+ */
+static Agent* changed_agent(QueueLink* link) {
+    return (Agent*) ((char*) link - offsetof(Agent, changed));
+}
+
+/*
+ * Queues an agent whose counters have just changed, unless it is already
+ * queued. The fence pairs with the one in publish_changes, so either the
+ * agent is queued again or the feed thread reads the new counters.
+ * feed - The feed to queue the agent on
+ * agent - The agent that changed
+ */
+static void mark_changed(Feed* feed, Agent* agent) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_exchange_n(&agent->queued, 1, __ATOMIC_SEQ_CST)) {
+        mpsc_push(&feed->changes, &agent->changed);
+    }
+}
+
+/*
+ * Queues both agents of a recorded match to be sent to subscribers. Must
+ * only be called by the single writer of the counters, after the outcome
+ * has been recorded. Never waits, as the feed thread never sleeps on the
+ * queue.
+ * feed - The feed to queue the agents on
+ * registry - The registry holding the agents
+ * firstId - The id of the match's first agent
+ * secondId - The id of the match's second agent
+ * outcome - How the match ended
+ */
+void feed_record(Feed* feed, Registry* registry, int firstId, int secondId,
+        Outcome outcome) {
+    if (outcome == NO_OUTCOME) {
+        return;
+    }
+    mark_changed(feed, registry_agent(registry, firstId));
+    mark_changed(feed, registry_agent(registry, secondId));
+}
+
+/*
+ * Appends data to a subscriber's unsent output
+ * subscriber - The subscriber to send to
+ * data - The data to send
+ * length - The length of the data
+ */
+static void queue_output(Subscriber* subscriber, char* data, int length) {
+    if (subscriber->length + length > subscriber->capacity) {
+        while (subscriber->length + length > subscriber->capacity) {
+            subscriber->capacity *= 2;
+        }
+        subscriber->output = realloc(subscriber->output,
+                subscriber->capacity);
+    }
+    memcpy(subscriber->output + subscriber->length, data, length);
+    subscriber->length += length;
+}
+
+/*
+ * Sends as much of a subscriber's unsent output as its socket will take
+ * without waiting
+ * subscriber - The subscriber to send to
+ * Returns 0 if the subscriber is still connected, else returns -1
+ */
+static int flush_output(Subscriber* subscriber) {
+    int sent = 0;
+    while (sent < subscriber->length) {
+        int written = send(subscriber->fd, subscriber->output + sent,
+                subscriber->length - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (written < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                return -1;
+            }
+            break;
+        }
+        sent += written;
+    }
+    subscriber->snapshotLeft -= sent < subscriber->snapshotLeft ?
+            sent : subscriber->snapshotLeft;
+    subscriber->length -= sent;
+    memmove(subscriber->output, subscriber->output + sent,
+            subscriber->length);
+    return 0;
+}
+
+/*
+ * Disconnects a subscriber, moving the last subscriber into its place
+ * feed - The feed the subscriber belongs to
+ * index - The index of the subscriber
+ */
+static void drop_subscriber(Feed* feed, int index) {
+    Subscriber* subscriber = feed->subscribers[index];
+    close(subscriber->fd);
+    free(subscriber->output);
+    free(subscriber);
+    feed->subscribers[index] =
+            feed->subscribers[--feed->numberOfSubscribers];
+}
+
+/*
+ * Writes an agent's record as a line of the stream
+ * output - The stream to write to
+ * record - The record to write
+ */
+static void write_record(FILE* output, AgentRecord* record) {
+    fprintf(output, "%s %d %d %d\n", record->name, record->wins,
+            record->losses, record->ties);
+}
+
+/*
+ * Accepts a new subscriber and queues every agent's record for it, so
+ * that the changes which follow can be applied to a complete table. The
+ * table is exempt from the backlog limit, however large it is.
+ * feed - The feed to accept a subscriber for
+ */
+static void accept_subscriber(Feed* feed) {
+    int fd = accept(feed->listenFd, 0, 0);
+    if (fd < 0) {
+        return;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    Subscriber* subscriber = malloc(sizeof(Subscriber));
+    subscriber->fd = fd;
+    subscriber->capacity = INITIAL_OUTPUT;
+    subscriber->output = malloc(subscriber->capacity);
+    subscriber->length = 0;
+    int length;
+    AgentRecord* records = registry_snapshot(feed->registry, &length);
+    char* snapshot;
+    size_t snapshotLength;
+    FILE* output = open_memstream(&snapshot, &snapshotLength);
+    for (int i = 0; i < length; i++) {
+        write_record(output, &records[i]);
+    }
+    fprintf(output, "---\n");
+    fclose(output);
+    queue_output(subscriber, snapshot, snapshotLength);
+    subscriber->snapshotLeft = snapshotLength;
+    free(snapshot);
+    free(records);
+    if (feed->numberOfSubscribers == feed->capacity) {
+        feed->capacity *= 2;
+        feed->subscribers = realloc(feed->subscribers,
+                sizeof(Subscriber*) * feed->capacity);
+    }
+    feed->subscribers[feed->numberOfSubscribers++] = subscriber;
+}
+
+/*
+ * Sends every agent that changed since the last tick to every subscriber,
+ * as one line each followed by a line of dashes. Each agent's flag is
+ * cleared before its counters are read, so a change made meanwhile either
+ * queues it again or is included now. A subscriber left more than
+ * MAX_BACKLOG bytes behind on changes is dropped.
+ * feed - The feed to publish
+ */
+static void publish_changes(Feed* feed) {
+    char* batch;
+    size_t length;
+    FILE* output = open_memstream(&batch, &length);
+    int changes = 0;
+    QueueLink* link;
+    while ((link = mpsc_pop(&feed->changes)) != NULL) {
+        Agent* agent = changed_agent(link);
+        __atomic_store_n(&agent->queued, 0, __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        AgentRecord record;
+        record.name = agent->name;
+        record.wins = __atomic_load_n(&agent->wins, __ATOMIC_RELAXED);
+        record.losses = __atomic_load_n(&agent->losses, __ATOMIC_RELAXED);
+        record.ties = __atomic_load_n(&agent->ties, __ATOMIC_RELAXED);
+        write_record(output, &record);
+        metrics_count(METRIC_FEED_RECORDS);
+        changes++;
+    }
+    fprintf(output, "---\n");
+    fclose(output);
+    for (int i = feed->numberOfSubscribers - 1; changes && i >= 0; i--) {
+        Subscriber* subscriber = feed->subscribers[i];
+        queue_output(subscriber, batch, length);
+        if (flush_output(subscriber)) {
+            drop_subscriber(feed, i);
+        } else if (subscriber->length - subscriber->snapshotLeft >
+                MAX_BACKLOG) {
+            metrics_count(METRIC_FEED_DROPPED);
+            drop_subscriber(feed, i);
+        }
+    }
+    free(batch);
+}
+
+/*
+ * Handles the events polled on a subscriber's socket. Anything the
+ * subscriber sends is discarded, and reading tells when it disconnects.
+ * feed - The feed the subscriber belongs to
+ * index - The index of the subscriber
+ * events - The events polled
+ */
+static void serve_subscriber(Feed* feed, int index, short events) {
+    Subscriber* subscriber = feed->subscribers[index];
+    char discard[DISCARD_SIZE];
+    int closed = 0;
+    if (events & (POLLIN | POLLHUP | POLLERR)) {
+        int received = recv(subscriber->fd, discard, DISCARD_SIZE,
+                MSG_DONTWAIT);
+        closed = received == 0 ||
+                (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+    }
+    if (closed || ((events & POLLOUT) && flush_output(subscriber))) {
+        drop_subscriber(feed, index);
+    }
+}
+
+/*
+ * Runs the feed forever, accepting subscribers, sending them their
+ * backlog as their sockets drain and publishing changes every tick
+ * feedData - The feed to run
+ */
+static void* run_feed(void* feedData) {
+    Feed* feed = (Feed*) feedData;
+    int capacity = 0;
+    struct pollfd* polled = NULL;
+    unsigned long nextTick = metrics_now() + TICK_MICROSECONDS;
+    while (1) {
+        int count = feed->numberOfSubscribers;
+        if (count + 1 > capacity) {
+            capacity = count + 1;
+            polled = realloc(polled, sizeof(struct pollfd) * capacity);
+        }
+        polled[0].fd = feed->listenFd;
+        polled[0].events = POLLIN;
+        for (int i = 0; i < count; i++) {
+            polled[i + 1].fd = feed->subscribers[i]->fd;
+            polled[i + 1].events = POLLIN |
+                    (feed->subscribers[i]->length ? POLLOUT : 0);
+        }
+        unsigned long now = metrics_now();
+        int timeout = nextTick > now ?
+                (nextTick - now + 999) / 1000 : 0;
+        if (poll(polled, count + 1, timeout) > 0) {
+            for (int i = count - 1; i >= 0; i--) {
+                if (polled[i + 1].revents) {
+                    serve_subscriber(feed, i, polled[i + 1].revents);
+                }
+            }
+            if (polled[0].revents & POLLIN) {
+                accept_subscriber(feed);
+            }
+        }
+        if (metrics_now() >= nextTick) {
+            publish_changes(feed);
+            nextTick = metrics_now() + TICK_MICROSECONDS;
+        }
+    }
+    return (void*) NULL;
+}
+
+/*
+ * Starts the thread streaming changes to agents' records to subscribers
+ * on its own port, and reports the port on stderr
+ * feed - The feed to start
+ * registry - The registry whose changes are streamed
+ * port - The port to listen on, "0" for any free port, or the path of a
+ * Unix domain socket
+ * Returns 0 if the feed was started, else returns -1
+ */
+int feed_start(Feed* feed, Registry* registry, char* port) {
+    ServerInfo info;
+    if (create_port_listener(&info, port, 0)) {
+        return -1;
+    }
+    feed->registry = registry;
+    feed->listenFd = info.socketFd;
+    fcntl(feed->listenFd, F_SETFL,
+            fcntl(feed->listenFd, F_GETFL) | O_NONBLOCK);
+    mpsc_init(&feed->changes);
+    feed->numberOfSubscribers = 0;
+    feed->capacity = 8;
+    feed->subscribers = malloc(sizeof(Subscriber*) * feed->capacity);
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_feed, (void*) feed)) {
+        return -1;
+    }
+    pthread_detach(thread);
+    fprintf(stderr, "feed ");
+    write_address(stderr, &info);
+    fprintf(stderr, "\n");
+    return 0;
+}
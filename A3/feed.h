@@ -0,0 +1,38 @@
+#ifndef FEED_H
+#define FEED_H
+
+#include "registry.h"
+#include "mpsc.h"
+
+// Represents a consumer of the leaderboard stream, with the output it has
+// not yet been able to take. The part of that output still left of the
+// table sent on connecting does not count towards the backlog.
+typedef struct {
+    int fd;
+    char* output;
+    int length;
+    int capacity;
+    int snapshotLeft;
+} Subscriber;
+
+// Represents the stream of changes to agents' records pushed to every
+// subscriber. The stats thread queues each agent whose counters change,
+// at most once until the feed thread takes it, so a hot agent is sent once
+// per tick however many matches it finished. The feed thread owns
+// everything else and never holds up the stats thread: a subscriber that
+// falls too far behind is dropped rather than waited for.
+typedef struct {
+    Registry* registry;
+    int listenFd;
+    MpscQueue changes;
+
+    Subscriber** subscribers;
+    int numberOfSubscribers;
+    int capacity;
+} Feed;
+
+int feed_start(Feed* feed, Registry* registry, char* port);
+
+void feed_record(Feed* feed, Registry* registry, int firstId, int secondId,
+        Outcome outcome);
+#endif
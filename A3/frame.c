@@ -0,0 +1,287 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "frame.h"
+
+#define MAX_PAYLOAD 0xFFFF
+#define INTEGER_LENGTH 4
+
+/*
+ * Returns the length of a frame's payload from its header
+ * frame - The frame, of which at least the header is present
+ */
+static int payload_length(char* frame) {
+    return ((unsigned char) frame[2] << 8) | (unsigned char) frame[3];
+}
+
+/*
+ * Returns 1 if a frame header is one this codec understands, else 0
+ * frame - The frame, of which at least the header is present
+ */
+static int valid_header(char* frame) {
+    return (unsigned char) frame[0] == FRAME_MAGIC &&
+            frame[1] >= FRAME_MR && frame[1] <= FRAME_REFUSED;
+}
+
+/*
+ * Returns 1 if a message received from a peer is a frame rather than a
+ * line, else returns 0
+ * data - The message
+ * length - The length of the message
+ */
+int is_frame(char* data, int length) {
+    return length > 0 && (unsigned char) data[0] == FRAME_MAGIC;
+}
+
+/*
+ * Finds the end of the first message in data received from a peer, which
+ * is a frame if it starts with FRAME_MAGIC and a line otherwise
+ * data - The data received
+ * available - The number of bytes received
+ * Returns the number of bytes in the message, including a line's newline,
+ * 0 if the message has not been received in full, or -1 if it is a frame
+ * with an invalid header
+ */
+int frame_message_length(char* data, int available) {
+    if (!is_frame(data, available)) {
+        char* newline = memchr(data, '\n', available);
+        return newline != NULL ? newline - data + 1 : 0;
+    }
+    if (available < FRAME_HEADER_LENGTH) {
+        return 0;
+    }
+    if (!valid_header(data)) {
+        return -1;
+    }
+    int length = FRAME_HEADER_LENGTH + payload_length(data);
+    return available >= length ? length : 0;
+}
+
+/*
+ * Reads a whole frame from a stream whose next byte is FRAME_MAGIC
+ * stream - The stream to read from
+ * frame - Set to the frame read, which the caller must free
+ * Returns the length of the frame, or -1 if the stream ended first or the
+ * header was invalid, in which case nothing needs freeing
+ */
+int frame_read(FILE* stream, char** frame) {
+    char header[FRAME_HEADER_LENGTH];
+    if (fread(header, 1, FRAME_HEADER_LENGTH, stream) != FRAME_HEADER_LENGTH
+            || !valid_header(header)) {
+        return -1;
+    }
+    int length = FRAME_HEADER_LENGTH + payload_length(header);
+    *frame = malloc(length);
+    memcpy(*frame, header, FRAME_HEADER_LENGTH);
+    if (fread(*frame + FRAME_HEADER_LENGTH, 1,
+            length - FRAME_HEADER_LENGTH, stream) !=
+            length - FRAME_HEADER_LENGTH) {
+        free(*frame);
+        return -1;
+    }
+    return length;
+}
+
+/*
+ * Writes a 32 bit integer in big endian order
+ * buffer - Where to write the integer
+ * value - The integer to write
+ */
+static void put_integer(char* buffer, int value) {
+    uint32_t bits = (uint32_t) value;
+    for (int i = 0; i < INTEGER_LENGTH; i++) {
+        buffer[i] = (char) (bits >> (8 * (INTEGER_LENGTH - 1 - i)));
+    }
+}
+
+/*
+ * Reads a 32 bit integer written by put_integer
+ * buffer - Where to read the integer from
+ * Returns the integer
+ */
+static int get_integer(char* buffer) {
+    uint32_t bits = 0;
+    for (int i = 0; i < INTEGER_LENGTH; i++) {
+        bits = (bits << 8) | (unsigned char) buffer[i];
+    }
+    return (int) bits;
+}
+
+/*
+ * Writes a frame header
+ * buffer - Where to write the header
+ * type - The type of the frame
+ * length - The length of the frame's payload
+ */
+static void put_header(char* buffer, FrameType type, int length) {
+    buffer[0] = (char) FRAME_MAGIC;
+    buffer[1] = (char) type;
+    buffer[2] = (char) (length >> 8);
+    buffer[3] = (char) length;
+}
+
+/*
+ * Encodes a match request. As with snprintf, the buffer may be NULL to
+ * find out how long the frame would be.
+ * buffer - Where to write the frame, which must be long enough
+ * name - The name of the agent
+ * port - The port the agent listens on for its opponent
+ * Returns the length of the frame, or -1 if it would be too long
+ */
+int frame_mr(char* buffer, char* name, char* port) {
+    int nameLength = strlen(name) + 1, portLength = strlen(port) + 1;
+    int length = nameLength + portLength + 1;
+    if (FRAME_HEADER_LENGTH + length > FRAME_MAX_REQUEST) {
+        return -1;
+    }
+    if (buffer != NULL) {
+        put_header(buffer, FRAME_MR, length);
+        char* payload = buffer + FRAME_HEADER_LENGTH;
+        memcpy(payload, name, nameLength);
+        memcpy(payload + nameLength, port, portLength);
+        payload[length - 1] = '\n';
+    }
+    return FRAME_HEADER_LENGTH + length;
+}
+
+/*
+ * Encodes the announcement of a match to one of its agents. As with
+ * snprintf, the buffer may be NULL to find out how long the frame would
+ * be.
+ * buffer - Where to write the frame, which must be long enough
+ * match - The match to announce
+ * Returns the length of the frame, or -1 if it would be too long
+ */
+int frame_match(char* buffer, MatchFrame* match) {
+    int nameLength = strlen(match->opponentName) + 1;
+    int portLength = strlen(match->opponentPort) + 1;
+    int length = 3 * INTEGER_LENGTH + nameLength + portLength;
+    if (length > MAX_PAYLOAD) {
+        return -1;
+    }
+    if (buffer != NULL) {
+        put_header(buffer, FRAME_MATCH, length);
+        char* payload = buffer + FRAME_HEADER_LENGTH;
+        put_integer(payload, match->matchId);
+        put_integer(payload + INTEGER_LENGTH, match->agentId);
+        put_integer(payload + 2 * INTEGER_LENGTH, match->opponentId);
+        payload += 3 * INTEGER_LENGTH;
+        memcpy(payload, match->opponentName, nameLength);
+        memcpy(payload + nameLength, match->opponentPort, portLength);
+    }
+    return FRAME_HEADER_LENGTH + length;
+}
+
+/*
+ * Encodes the result an agent reports for a match. As with snprintf, the
+ * buffer may be NULL to find out how long the frame would be.
+ * buffer - Where to write the frame, which must be long enough
+ * matchId - The id of the match
+ * winnerId - The id of the agent that won, FRAME_TIE, or FRAME_NO_WINNER
+ * if the match ended in error
+ * Returns the length of the frame
+ */
+int frame_result(char* buffer, int matchId, int winnerId) {
+    int length = 2 * INTEGER_LENGTH;
+    if (buffer != NULL) {
+        put_header(buffer, FRAME_RESULT, length);
+        put_integer(buffer + FRAME_HEADER_LENGTH, matchId);
+        put_integer(buffer + FRAME_HEADER_LENGTH + INTEGER_LENGTH, winnerId);
+    }
+    return FRAME_HEADER_LENGTH + length;
+}
+
+/*
+ * Encodes the refusal of a match request. As with snprintf, the buffer may
+ * be NULL to find out how long the frame would be.
+ * buffer - Where to write the frame, which must be long enough
+ * Returns the length of the frame
+ */
+int frame_refused(char* buffer) {
+    if (buffer != NULL) {
+        put_header(buffer, FRAME_REFUSED, 0);
+    }
+    return FRAME_HEADER_LENGTH;
+}
+
+/*
+ * Finds the zero terminated string at the start of part of a payload
+ * field - The start of the string
+ * end - The end of the payload
+ * Returns the byte after the string's terminator, or NULL if the string
+ * runs past the end of the payload
+ */
+static char* skip_string(char* field, char* end) {
+    char* terminator = memchr(field, '\0', end - field);
+    return terminator != NULL ? terminator + 1 : NULL;
+}
+
+/*
+ * Decodes a match request in place
+ * frame - The frame
+ * length - The length of the frame
+ * name - Set to the name of the agent
+ * port - Set to the port the agent listens on
+ * Returns 0 if the frame is a valid match request, else returns -1
+ */
+int frame_read_mr(char* frame, int length, char** name, char** port) {
+    char* end = frame + length;
+    if (length < FRAME_HEADER_LENGTH || frame[1] != FRAME_MR ||
+            length > FRAME_MAX_REQUEST ||
+            end[-1] != '\n') {
+        return -1;
+    }
+    *name = frame + FRAME_HEADER_LENGTH;
+    *port = skip_string(*name, end - 1);
+    if (*port == NULL || skip_string(*port, end - 1) != end - 1 ||
+            **port == '\0') {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Decodes the announcement of a match in place
+ * frame - The frame
+ * length - The length of the frame
+ * match - Filled in with the match announced
+ * Returns 0 if the frame is a valid announcement, else returns -1
+ */
+int frame_read_match(char* frame, int length, MatchFrame* match) {
+    char* end = frame + length;
+    char* payload = frame + FRAME_HEADER_LENGTH;
+    if (length < FRAME_HEADER_LENGTH + 3 * INTEGER_LENGTH ||
+            frame[1] != FRAME_MATCH) {
+        return -1;
+    }
+    match->matchId = get_integer(payload);
+    match->agentId = get_integer(payload + INTEGER_LENGTH);
+    match->opponentId = get_integer(payload + 2 * INTEGER_LENGTH);
+    match->opponentName = payload + 3 * INTEGER_LENGTH;
+    match->opponentPort = skip_string(match->opponentName, end);
+    if (match->opponentPort == NULL ||
+            skip_string(match->opponentPort, end) != end) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Decodes the result an agent reports
+ * frame - The frame
+ * length - The length of the frame
+ * matchId - Set to the id of the match
+ * winnerId - Set to the id of the agent that won, FRAME_TIE or
+ * FRAME_NO_WINNER
+ * Returns 0 if the frame is a valid result, else returns -1
+ */
+int frame_read_result(char* frame, int length, int* matchId,
+        int* winnerId) {
+    if (length != FRAME_HEADER_LENGTH + 2 * INTEGER_LENGTH ||
+            frame[1] != FRAME_RESULT) {
+        return -1;
+    }
+    *matchId = get_integer(frame + FRAME_HEADER_LENGTH);
+    *winnerId = get_integer(frame + FRAME_HEADER_LENGTH + INTEGER_LENGTH);
+    return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <stdio.h>
+
+#define FRAME_MAGIC 0xB1
+#define FRAME_HEADER_LENGTH 4
+#define FRAME_MAX_REQUEST 4096
+#define FRAME_TIE -1
+#define FRAME_NO_WINNER -2
+
+// The messages that can be sent as binary frames. Every frame has a fixed
+// header of FRAME_MAGIC, its type and the length of its payload as a 16
+// bit big endian integer. Integers in the payload are 32 bit big endian
+// and strings are terminated by a zero byte:
+//   MR      name, port, then a newline
+//   MATCH   match id, agent id, opponent id, opponent name, opponent port
+//   RESULT  match id, winner id, FRAME_TIE or FRAME_NO_WINNER
+//   REFUSED nothing; the server will not match the request it answers
+// No text line starts with FRAME_MAGIC, so frames and lines can be told
+// apart by their first byte. An MR frame ends in a newline so that a
+// server that only speaks text reads it as one invalid line and drops the
+// connection at once. A server that speaks frames answers every MR frame
+// with a frame, REFUSED if nothing else, so only a server that does not
+// speak them closes the connection without answering, which is how a
+// client learns to fall back to text.
+typedef enum {
+    FRAME_MR = 1,
+    FRAME_MATCH = 2,
+    FRAME_RESULT = 3,
+    FRAME_REFUSED = 4
+} FrameType;
+
+// Represents a decoded MATCH frame, whose strings point into the frame
+typedef struct {
+    int matchId;
+    int agentId;
+    int opponentId;
+    char* opponentName;
+    char* opponentPort;
+} MatchFrame;
+
+int is_frame(char* data, int length);
+
+int frame_message_length(char* data, int available);
+
+int frame_read(FILE* stream, char** frame);
+
+int frame_mr(char* buffer, char* name, char* port);
+
+int frame_match(char* buffer, MatchFrame* match);
+
+int frame_result(char* buffer, int matchId, int winnerId);
+
+int frame_refused(char* buffer);
+
+int frame_read_mr(char* frame, int length, char** name, char** port);
+
+int frame_read_match(char* frame, int length, MatchFrame* match);
+
+int frame_read_result(char* frame, int length, int* matchId,
+        int* winnerId);
+#endif
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <semaphore.h>
+#include <pthread.h>
+#include "lockstats.h"
+
+#define MAX_HOLDS 8
+
+// Represents a semaphore the calling thread holds, with the site that took
+// it and when
+typedef struct {
+    sem_t* lock;
+    LockSite* site;
+    unsigned long since;
+} Hold;
+
+// Every site that has taken a semaphore, whichever semaphore it took
+static pthread_mutex_t sitesGuard = PTHREAD_MUTEX_INITIALIZER;
+static LockSite* sites = NULL;
+
+// The semaphores the calling thread holds, oldest first. A thread holding
+// more than MAX_HOLDS at once has the hold times of the rest go unrecorded.
+static __thread Hold holds[MAX_HOLDS];
+static __thread int numberOfHolds = 0;
+
+/*
+ * Returns the time in nanoseconds on a clock that only moves forwards
+ */
+static unsigned long now_nanoseconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+/*
+ * Takes a semaphore, recording how long the caller waited for it
+ * l - The pointer to the semaphore to take
+ * site - The site taking the semaphore
+ */
+void take_lock_at(sem_t* l, LockSite* site) {
+    unsigned long started = now_nanoseconds();
+    sem_wait(l);
+    unsigned long taken = now_nanoseconds();
+    if (!site->registered) {
+        pthread_mutex_lock(&sitesGuard);
+        site->registered = 1;
+        site->lock = l;
+        site->next = sites;
+        sites = site;
+        pthread_mutex_unlock(&sitesGuard);
+    }
+    site->calls++;
+    site->waited[latency_bucket(taken - started)]++;
+    if (numberOfHolds < MAX_HOLDS) {
+        holds[numberOfHolds++] = (Hold) {l, site, taken};
+    }
+}
+
+/*
+ * Releases a semaphore, recording how long the calling thread held it
+ * l - The pointer to the semaphore to release
+ */
+void release_lock_at(sem_t* l) {
+    for (int i = numberOfHolds - 1; i >= 0; i--) {
+        if (holds[i].lock == l) {
+            holds[i].site->held[latency_bucket(now_nanoseconds() -
+                    holds[i].since)]++;
+            holds[i] = holds[--numberOfHolds];
+            break;
+        }
+    }
+    sem_post(l);
+}
+
+/*
+ * Writes a line for every site that has taken a semaphore, with the median
+ * and 99th percentile of how long callers waited for it there and held it.
+ * The sites are copied while holding the semaphore and written after
+ * releasing it.
+ * l - The pointer to the semaphore whose sites to write
+ * output - The stream to write to
+ */
+void lock_stats_dump(sem_t* l, FILE* output) {
+    sem_wait(l);
+    pthread_mutex_lock(&sitesGuard);
+    int length = 0;
+    for (LockSite* site = sites; site != NULL; site = site->next) {
+        length++;
+    }
+    LockSite* copies = malloc(sizeof(LockSite) * (length + 1));
+    length = 0;
+    for (LockSite* site = sites; site != NULL; site = site->next) {
+        if (site->lock == l) {
+            copies[length++] = *site;
+        }
+    }
+    pthread_mutex_unlock(&sitesGuard);
+    sem_post(l);
+    for (int i = 0; i < length; i++) {
+        fprintf(output, "lock %s:%d calls %lu wait p50 %.3fus p99 %.3fus "
+                "hold p50 %.3fus p99 %.3fus\n", copies[i].file,
+                copies[i].line, copies[i].calls,
+                latency_percentile(copies[i].waited, 0.5) / 1000.0,
+                latency_percentile(copies[i].waited, 0.99) / 1000.0,
+                latency_percentile(copies[i].held, 0.5) / 1000.0,
+                latency_percentile(copies[i].held, 0.99) / 1000.0);
+    }
+    free(copies);
+}
@@ -0,0 +1,40 @@
+#ifndef LOCKSTATS_H
+#define LOCKSTATS_H
+
+#include <stdio.h>
+#include <semaphore.h>
+#include "metrics.h"
+
+#ifdef LOCK_STATS
+// Represents one place in the code that takes a semaphore, with latency
+// histograms in nanoseconds of how long callers waited for it there and
+// how long they then held it. The counts are only written while holding
+// the semaphore the site takes.
+typedef struct LockSite {
+    const char* file;
+    int line;
+    int registered;
+    sem_t* lock;
+    unsigned long calls;
+    unsigned long waited[LATENCY_BUCKETS];
+    unsigned long held[LATENCY_BUCKETS];
+    struct LockSite* next;
+} LockSite;
+
+void take_lock_at(sem_t* l, LockSite* site);
+
+void release_lock_at(sem_t* l);
+
+void lock_stats_dump(sem_t* l, FILE* output);
+
+// Every call to take_lock gets a site of its own
+#define take_lock(l) do { \
+    static LockSite lockSite = {__FILE__, __LINE__}; \
+    take_lock_at((l), &lockSite); \
+} while (0)
+
+#define release_lock(l) release_lock_at(l)
+#else
+#define lock_stats_dump(l, output)
+#endif
+#endif
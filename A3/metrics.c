@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "server.h"
+#include "metrics.h"
+
+#define REQUEST_SIZE 1024
+#define REQUEST_TIMEOUT 1
+
+// Represents the listener serving the metrics page, and the totals at the
+// time the page was last served, from which rates are worked out
+typedef struct {
+    ServerState* server;
+    int listenFd;
+    unsigned long lastServed;
+    unsigned long lastAccepted;
+    unsigned long lastMatches;
+} MetricsListener;
+
+// Represents the sum of every thread's metrics
+typedef struct {
+    unsigned long counters[METRICS];
+    unsigned long phases[PHASES][LATENCY_BUCKETS];
+} MetricsTotals;
+
+static const char* phaseNames[PHASES] = {
+    "mr", "pairing", "match", "play", "record"
+};
+
+static MetricsShard* shards = NULL;
+static __thread MetricsShard* localShard = NULL;
+
+/*
+ * Returns the time in microseconds on a clock that only moves forwards
+ */
+unsigned long metrics_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000UL + now.tv_nsec / 1000;
+}
+
+/*
+ * Finds the calling thread's shard, creating it and linking it into the
+ * list of every shard the first time the thread records anything
+ * Returns the calling thread's shard
+ */
+static MetricsShard* local_shard(void) {
+    if (localShard == NULL) {
+        MetricsShard* shard;
+        posix_memalign((void**) &shard, CACHE_LINE, sizeof(MetricsShard));
+        memset(shard, 0, sizeof(MetricsShard));
+        shard->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&shards, &shard->next, shard, 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+        }
+        localShard = shard;
+    }
+    return localShard;
+}
+
+/*
+ * Increments a counter in the calling thread's shard, which only that
+ * thread writes to
+ * counter - The counter to increment
+ */
+static void increment_counter(unsigned long* counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Counts one occurrence of an event
+ * metric - The counter of the event
+ */
+void metrics_count(Metric metric) {
+    increment_counter(&local_shard()->counters[metric]);
+}
+
+/*
+ * Finds the latency histogram bucket a value falls in. Values below
+ * SUB_BUCKETS have a bucket each; above that, the leading bit picks a
+ * group of SUB_BUCKETS buckets and the bits after it pick the bucket. The
+ * last bucket also holds everything too long for the histogram.
+ * value - The value to find the bucket of
+ * Returns the index of the bucket
+ */
+int latency_bucket(unsigned long value) {
+    if (value < SUB_BUCKETS) {
+        return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - SUB_BUCKET_BITS;
+    int bucket = (shift + 1) * SUB_BUCKETS +
+            ((value >> shift) & (SUB_BUCKETS - 1));
+    return bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1;
+}
+
+/*
+ * Returns the largest value held by a latency histogram bucket
+ * bucket - The index of the bucket
+ */
+static unsigned long bucket_value(int bucket) {
+    if (bucket < SUB_BUCKETS) {
+        return bucket;
+    }
+    int shift = bucket / SUB_BUCKETS - 1;
+    return ((unsigned long) (SUB_BUCKETS + bucket % SUB_BUCKETS) << shift) +
+            (1UL << shift) - 1;
+}
+
+/*
+ * Records how long one phase of a match took
+ * phase - The phase
+ * microseconds - The time the phase took
+ */
+void metrics_record_phase(Phase phase, unsigned long microseconds) {
+    increment_counter(&local_shard()->phases[phase][latency_bucket(
+            microseconds)]);
+}
+
+/*
+ * Adds up every thread's shard
+ * totals - Filled in with the sums
+ */
+static void sum_shards(MetricsTotals* totals) {
+    memset(totals, 0, sizeof(MetricsTotals));
+    for (MetricsShard* shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE);
+            shard != NULL; shard = shard->next) {
+        for (int i = 0; i < METRICS; i++) {
+            totals->counters[i] += __atomic_load_n(&shard->counters[i],
+                    __ATOMIC_RELAXED);
+        }
+        for (int phase = 0; phase < PHASES; phase++) {
+            for (int i = 0; i < LATENCY_BUCKETS; i++) {
+                totals->phases[phase][i] += __atomic_load_n(
+                        &shard->phases[phase][i], __ATOMIC_RELAXED);
+            }
+        }
+    }
+}
+
+/*
+ * Returns the number of values in a latency histogram
+ * histogram - The histogram
+ */
+static unsigned long latency_count(unsigned long* histogram) {
+    unsigned long total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        total += histogram[i];
+    }
+    return total;
+}
+
+/*
+ * Finds a percentile of a latency histogram
+ * histogram - The histogram, with LATENCY_BUCKETS buckets
+ * fraction - The percentile as a fraction, such as 0.99, or 1 for the
+ * largest value
+ * Returns the largest value in the bucket the percentile falls in, in the
+ * histogram's units, or 0 if the histogram is empty
+ */
+unsigned long latency_percentile(unsigned long* histogram, double fraction) {
+    unsigned long total = latency_count(histogram);
+    unsigned long rank = total * fraction;
+    if (rank < total * fraction || rank == 0) {
+        rank++;
+    }
+    unsigned long seen = 0;
+    for (int i = 0; total > 0 && i < LATENCY_BUCKETS; i++) {
+        seen += histogram[i];
+        if (seen >= rank) {
+            return bucket_value(i);
+        }
+    }
+    return 0;
+}
+
+/*
+ * Writes the metrics page, with rates measured since it was last served
+ * listener - The metrics listener
+ * output - The stream to write the page to
+ */
+static void write_page(MetricsListener* listener, FILE* output) {
+    ServerState* server = listener->server;
+    MetricsTotals totals;
+    sum_shards(&totals);
+    int waiting = 0;
+    for (int i = 0; i < server->numberOfShards; i++) {
+        waiting += pairing_waiting(&server->shards[i]);
+    }
+    unsigned long now = metrics_now();
+    double elapsed = (now - listener->lastServed) / 1000000.0;
+    unsigned long accepted = totals.counters[METRIC_ACCEPTED];
+    unsigned long matches = totals.counters[METRIC_MATCHES];
+    fprintf(output, "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain\r\n\r\n");
+    fprintf(output, "rps_accepted_total %lu\n", accepted);
+    fprintf(output, "rps_accepted_per_second %.1f\n",
+            (accepted - listener->lastAccepted) / elapsed);
+    fprintf(output, "rps_active_sessions %lu\n",
+            accepted - totals.counters[METRIC_CLOSED]);
+    fprintf(output, "rps_waiting_clients %d\n", waiting);
+    fprintf(output, "rps_matches_total %lu\n", matches);
+    fprintf(output, "rps_matches_per_second %.1f\n",
+            (matches - listener->lastMatches) / elapsed);
+    fprintf(output, "rps_invalid_results_total %lu\n",
+            totals.counters[METRIC_INVALID]);
+    unsigned long waves = totals.counters[METRIC_WAVES];
+    fprintf(output, "rps_waves_total %lu\n", waves);
+    fprintf(output, "rps_wave_size_mean %.2f\n", waves == 0 ? 0.0 :
+            (double) totals.counters[METRIC_WAVE_SESSIONS] / waves);
+    fprintf(output, "rps_feed_records_total %lu\n",
+            totals.counters[METRIC_FEED_RECORDS]);
+    fprintf(output, "rps_feed_dropped_total %lu\n",
+            totals.counters[METRIC_FEED_DROPPED]);
+    fprintf(output, "rps_time_to_pair_p50_ms %.3f\n",
+            latency_percentile(totals.phases[PHASE_PAIRING], 0.5) / 1000.0);
+    fprintf(output, "rps_time_to_pair_p99_ms %.3f\n",
+            latency_percentile(totals.phases[PHASE_PAIRING], 0.99) / 1000.0);
+    for (int phase = 0; phase < PHASES; phase++) {
+        unsigned long* histogram = totals.phases[phase];
+        fprintf(output, "rps_phase_%s_count %lu\n", phaseNames[phase],
+                latency_count(histogram));
+        fprintf(output, "rps_phase_%s_p50_ms %.3f\n", phaseNames[phase],
+                latency_percentile(histogram, 0.5) / 1000.0);
+        fprintf(output, "rps_phase_%s_p90_ms %.3f\n", phaseNames[phase],
+                latency_percentile(histogram, 0.9) / 1000.0);
+        fprintf(output, "rps_phase_%s_p99_ms %.3f\n", phaseNames[phase],
+                latency_percentile(histogram, 0.99) / 1000.0);
+        fprintf(output, "rps_phase_%s_max_ms %.3f\n", phaseNames[phase],
+                latency_percentile(histogram, 1) / 1000.0);
+    }
+    listener->lastServed = now;
+    listener->lastAccepted = accepted;
+    listener->lastMatches = matches;
+}
+
+/*
+ * Writes a line for every phase of a match with how many times it was
+ * timed and its median, 90th and 99th percentile and longest durations
+ * output - The stream to write to
+ */
+void metrics_dump_phases(FILE* output) {
+    MetricsTotals totals;
+    sum_shards(&totals);
+    for (int phase = 0; phase < PHASES; phase++) {
+        unsigned long* histogram = totals.phases[phase];
+        fprintf(output, "phase %s count %lu p50 %.3fms p90 %.3fms "
+                "p99 %.3fms max %.3fms\n", phaseNames[phase],
+                latency_count(histogram),
+                latency_percentile(histogram, 0.5) / 1000.0,
+                latency_percentile(histogram, 0.9) / 1000.0,
+                latency_percentile(histogram, 0.99) / 1000.0,
+                latency_percentile(histogram, 1) / 1000.0);
+    }
+}
+
+/*
+ * Serves the metrics page to every connection forever. Whatever request
+ * the client sends is read and ignored, so the page can be fetched with a
+ * web browser, curl or nc alike.
+ * listenerData - The metrics listener
+ */
+static void* serve_metrics(void* listenerData) {
+    MetricsListener* listener = (MetricsListener*) listenerData;
+    struct timeval timeout = {REQUEST_TIMEOUT, 0};
+    char request[REQUEST_SIZE];
+    int fd;
+    while (fd = accept(listener->listenFd, 0, 0), fd >= 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        read(fd, request, REQUEST_SIZE);
+        FILE* output = fdopen(fd, "w");
+        write_page(listener, output);
+        fclose(output);
+    }
+    return (void*) NULL;
+}
+
+/*
+ * Starts the thread serving the metrics page on its own port, and reports
+ * the port on stderr
+ * server - The current state of the server
+ * port - The port to listen on, "0" for any free port, or the path of a
+ * Unix domain socket
+ * Returns 0 if the listener was started, else returns -1
+ */
+int metrics_start(ServerState* server, char* port) {
+    ServerInfo info;
+    if (create_port_listener(&info, port, 0)) {
+        return -1;
+    }
+    MetricsListener* listener = malloc(sizeof(MetricsListener));
+    listener->server = server;
+    listener->listenFd = info.socketFd;
+    listener->lastServed = metrics_now();
+    listener->lastAccepted = 0;
+    listener->lastMatches = 0;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_metrics, (void*) listener)) {
+        return -1;
+    }
+    pthread_detach(thread);
+    fprintf(stderr, "metrics ");
+    write_address(stderr, &info);
+    fprintf(stderr, "\n");
+    return 0;
+}
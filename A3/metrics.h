@@ -0,0 +1,62 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+
+#define SUB_BUCKET_BITS 3
+#define SUB_BUCKETS (1 << SUB_BUCKET_BITS)
+#define LATENCY_BITS 32
+#define LATENCY_BUCKETS ((LATENCY_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+#define CACHE_LINE 64
+
+// Represents the counters kept for the metrics page
+typedef enum {
+    METRIC_ACCEPTED,
+    METRIC_CLOSED,
+    METRIC_MATCHES,
+    METRIC_INVALID,
+    METRIC_WAVES,
+    METRIC_WAVE_SESSIONS,
+    METRIC_FEED_RECORDS,
+    METRIC_FEED_DROPPED,
+    METRICS
+} Metric;
+
+// The phases of a match that are timed. The first is timed per client,
+// from being accepted to its match request being read; pairing is how long
+// the older client of each pair waited for its partner, in the pairing
+// queue or in its thread's wave; and the rest are timed per match,
+// from pairing to MATCH being written to both clients, then to both
+// results being received, then to the results being recorded.
+typedef enum {
+    PHASE_MR,
+    PHASE_PAIRING,
+    PHASE_MATCH,
+    PHASE_PLAY,
+    PHASE_RECORD,
+    PHASES
+} Phase;
+
+// Represents one thread's share of the metrics. Only its own thread writes
+// to it, so updates never contend; the metrics page sums every shard. Each
+// phase is kept as a latency histogram in microseconds. Latency histograms
+// are log-linear: every power of two is split into SUB_BUCKETS equal
+// buckets, so every value is kept to within an eighth of itself.
+typedef struct MetricsShard {
+    unsigned long counters[METRICS];
+    unsigned long phases[PHASES][LATENCY_BUCKETS];
+    struct MetricsShard* next;
+} __attribute__((aligned(CACHE_LINE))) MetricsShard;
+
+unsigned long metrics_now(void);
+
+void metrics_count(Metric metric);
+
+void metrics_record_phase(Phase phase, unsigned long microseconds);
+
+void metrics_dump_phases(FILE* output);
+
+int latency_bucket(unsigned long value);
+
+unsigned long latency_percentile(unsigned long* histogram, double fraction);
+#endif
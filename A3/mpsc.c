@@ -0,0 +1,93 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "mpsc.h"
+
+/*
+ * Initialises an empty queue
+ * queue - The queue to initialise
+ */
+void mpsc_init(MpscQueue* queue) {
+    queue->stub.next = NULL;
+    queue->head = &queue->stub;
+    queue->tail = &queue->stub;
+    queue->sleeping = 0;
+    pthread_mutex_init(&queue->guard, NULL);
+    pthread_cond_init(&queue->ready, NULL);
+}
+
+/*
+ * Links an item onto the producer end of the queue
+ * queue - The queue to push to
+ * link - The link embedded in the item
+ */
+static void link_item(MpscQueue* queue, QueueLink* link) {
+    __atomic_store_n(&link->next, NULL, __ATOMIC_RELAXED);
+    QueueLink* previous = __atomic_exchange_n(&queue->head, link,
+            __ATOMIC_SEQ_CST);
+    __atomic_store_n(&previous->next, link, __ATOMIC_RELEASE);
+}
+
+/*
+ * Pushes an item onto the queue from any thread, waking the consumer if it
+ * is asleep. Producers never wait on one another.
+ * queue - The queue to push to
+ * link - The link embedded in the item
+ */
+void mpsc_push(MpscQueue* queue, QueueLink* link) {
+    link_item(queue, link);
+    if (__atomic_load_n(&queue->sleeping, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&queue->guard);
+        pthread_cond_signal(&queue->ready);
+        pthread_mutex_unlock(&queue->guard);
+    }
+}
+
+/*
+ * Pops the oldest item from the queue. Must only be called by the
+ * consumer.
+ * queue - The queue to pop from
+ * Returns the link of the item, or NULL if the queue is empty or its next
+ * item is still being pushed
+ */
+QueueLink* mpsc_pop(MpscQueue* queue) {
+    QueueLink* tail = queue->tail;
+    QueueLink* next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (tail == &queue->stub) {
+        if (next == NULL) {
+            return NULL;
+        }
+        queue->tail = next;
+        tail = next;
+        next = __atomic_load_n(&next->next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+    if (tail != __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    link_item(queue, &queue->stub);
+    next = __atomic_load_n(&tail->next, __ATOMIC_ACQUIRE);
+    if (next != NULL) {
+        queue->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/*
+ * Puts the consumer to sleep until the queue is not empty. Must only be
+ * called by the consumer.
+ * queue - The queue to wait on
+ */
+void mpsc_wait(MpscQueue* queue) {
+    pthread_mutex_lock(&queue->guard);
+    __atomic_store_n(&queue->sleeping, 1, __ATOMIC_SEQ_CST);
+    while (queue->tail == &queue->stub && __atomic_load_n(&queue->head,
+            __ATOMIC_SEQ_CST) == &queue->stub) {
+        pthread_cond_wait(&queue->ready, &queue->guard);
+    }
+    __atomic_store_n(&queue->sleeping, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&queue->guard);
+}
@@ -0,0 +1,31 @@
+#ifndef MPSC_H
+#define MPSC_H
+
+#include <pthread.h>
+
+// Represents the link embedded in every item that can be queued
+typedef struct QueueLink {
+    struct QueueLink* next;
+} QueueLink;
+
+// Represents an unbounded queue that any number of threads push to without
+// locking and a single thread pops from. The guard and condition are only
+// used to put the consumer to sleep while the queue is empty.
+typedef struct {
+    QueueLink* head;
+    QueueLink* tail;
+    QueueLink stub;
+    int sleeping;
+
+    pthread_mutex_t guard;
+    pthread_cond_t ready;
+} MpscQueue;
+
+void mpsc_init(MpscQueue* queue);
+
+void mpsc_push(MpscQueue* queue, QueueLink* link);
+
+QueueLink* mpsc_pop(MpscQueue* queue);
+
+void mpsc_wait(MpscQueue* queue);
+#endif
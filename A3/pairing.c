@@ -0,0 +1,277 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "pairing.h"
+#include "metrics.h"
+
+/*
+ * Initialises an empty pairing queue
+ * queue - The queue to initialise
+ */
+void pairing_init(PairingQueue* queue) {
+    pthread_mutex_init(&queue->guard, NULL);
+    queue->head = NULL;
+    queue->tail = NULL;
+    queue->waiting = 0;
+}
+
+/*
+ * Initialises a ticket for a client that has not been paired yet
+ * ticket - The ticket to initialise
+ * agentId - The id of the agent the client plays as
+ * port - The port the client sent in its match request
+ */
+void init_ticket(PairingTicket* ticket, int agentId, char* port) {
+    ticket->agentId = agentId;
+    ticket->port = port;
+    ticket->binary = 0;
+    ticket->serverToClient = NULL;
+    ticket->clientToServer = NULL;
+    ticket->session = NULL;
+    ticket->coroutine = NULL;
+    ticket->match = NULL;
+    ticket->expired = 0;
+    ticket->queue = NULL;
+    ticket->next = NULL;
+    pthread_cond_init(&ticket->paired, NULL);
+}
+
+/*
+ * Releases the resources held by a ticket that is no longer queued
+ * ticket - The ticket to destroy
+ */
+void destroy_ticket(PairingTicket* ticket) {
+    pthread_cond_destroy(&ticket->paired);
+}
+
+/*
+ * Removes the longest waiting ticket from a queue whose guard is held
+ * queue - The queue to take from
+ * Returns the ticket taken, or NULL if the queue is empty
+ */
+static PairingTicket* take_ticket(PairingQueue* queue) {
+    PairingTicket* ticket = queue->head;
+    if (ticket != NULL) {
+        queue->head = ticket->next;
+        if (queue->head == NULL) {
+            queue->tail = NULL;
+        }
+        ticket->next = NULL;
+        queue->waiting--;
+    }
+    return ticket;
+}
+
+/*
+ * Removes a ticket from a queue whose guard is held
+ * queue - The queue to remove from
+ * ticket - The ticket to remove
+ * Returns 1 if the ticket was still queued, else returns 0
+ */
+static int remove_ticket(PairingQueue* queue, PairingTicket* ticket) {
+    PairingTicket* previous = NULL;
+    for (PairingTicket* current = queue->head; current != NULL;
+            current = current->next) {
+        if (current == ticket) {
+            if (previous != NULL) {
+                previous->next = current->next;
+            } else {
+                queue->head = current->next;
+            }
+            if (queue->tail == current) {
+                queue->tail = previous;
+            }
+            current->next = NULL;
+            queue->waiting--;
+            return 1;
+        }
+        previous = current;
+    }
+    return 0;
+}
+
+/*
+ * Removes the longest waiting ticket from a queue
+ * queue - The queue to take from
+ * Returns the ticket taken, or NULL if the queue is empty
+ */
+static PairingTicket* pairing_take(PairingQueue* queue) {
+    pthread_mutex_lock(&queue->guard);
+    PairingTicket* ticket = take_ticket(queue);
+    pthread_mutex_unlock(&queue->guard);
+    return ticket;
+}
+
+/*
+ * Takes the longest waiting client of the given home shard, or failing
+ * that of any other shard, without queueing anything
+ * shards - The pairing queue of every shard
+ * numberOfShards - The number of shards
+ * home - The index of the shard to try first
+ * Returns the ticket taken, or NULL if every shard looked empty
+ */
+PairingTicket* pairing_take_any(PairingQueue* shards, int numberOfShards,
+        int home) {
+    PairingTicket* partner = pairing_take(&shards[home]);
+    for (int i = 1; partner == NULL && i < numberOfShards; i++) {
+        partner = pairing_take(&shards[(home + i) % numberOfShards]);
+    }
+    if (partner != NULL) {
+        metrics_record_phase(PHASE_PAIRING,
+                metrics_now() - partner->queuedAt);
+    }
+    return partner;
+}
+
+/*
+ * Locks the guards of two different queues, in index order
+ * first - One of the queues
+ * second - The other queue, in the same array of shards
+ */
+static void lock_both(PairingQueue* first, PairingQueue* second) {
+    pthread_mutex_lock(first < second ? &first->guard : &second->guard);
+    pthread_mutex_lock(first < second ? &second->guard : &first->guard);
+}
+
+/*
+ * Unlocks the guards of two queues locked by lock_both
+ * first - One of the queues
+ * second - The other queue
+ */
+static void unlock_both(PairingQueue* first, PairingQueue* second) {
+    pthread_mutex_unlock(&first->guard);
+    pthread_mutex_unlock(&second->guard);
+}
+
+/*
+ * Pairs the given ticket with a waiting client, or queues the ticket if
+ * nobody is waiting. The ticket's home shard is tried first, then every
+ * other shard is raided in turn. If all of them look empty the ticket is
+ * queued in its home shard under that shard's guard alone, so clients of
+ * different shards never contend to queue. Two clients can then both see
+ * the other shards empty and wait in different shards at once, so once
+ * queued the ticket looks through the other shards again, locking only its
+ * own and one other at a time, and leaves its queue to pair with anyone
+ * it finds. Of two such clients the one that looks last always sees the
+ * other, so the split only lasts while both are joining. A partner
+ * returned by this function stays parked until pairing_complete is called
+ * on it.
+ * shards - The pairing queue of every shard
+ * numberOfShards - The number of shards
+ * home - The index of the shard the joining client belongs to
+ * ticket - The ticket of the joining client
+ * Returns the ticket of the partner, or NULL if the ticket was queued, in
+ * which case it may already have been taken by a partner
+ */
+PairingTicket* pairing_join(PairingQueue* shards, int numberOfShards,
+        int home, PairingTicket* ticket) {
+    PairingTicket* partner = pairing_take_any(shards, numberOfShards, home);
+    if (partner != NULL) {
+        return partner;
+    }
+    unsigned long now = metrics_now();
+    PairingQueue* queue = &shards[home];
+    pthread_mutex_lock(&queue->guard);
+    partner = take_ticket(queue);
+    int queued = partner == NULL;
+    if (queued) {
+        ticket->queue = queue;
+        ticket->queuedAt = now;
+        if (queue->tail != NULL) {
+            queue->tail->next = ticket;
+        } else {
+            queue->head = ticket;
+        }
+        queue->tail = ticket;
+        queue->waiting++;
+    }
+    pthread_mutex_unlock(&queue->guard);
+    for (int i = 1; queued && i < numberOfShards; i++) {
+        PairingQueue* other = &shards[(home + i) % numberOfShards];
+        lock_both(queue, other);
+        if (other->head != NULL) {
+            queued = 0;
+            if (remove_ticket(queue, ticket)) {
+                partner = take_ticket(other);
+            }
+        }
+        unlock_both(queue, other);
+    }
+    if (partner != NULL) {
+        metrics_record_phase(PHASE_PAIRING, now - partner->queuedAt);
+    }
+    return partner;
+}
+
+/*
+ * Parks the calling thread without using any CPU until the given queued
+ * ticket has been paired or has expired
+ * ticket - The ticket to wait on
+ * Returns the match the ticket was paired into, or NULL if it expired
+ */
+struct Match* pairing_wait(PairingTicket* ticket) {
+    PairingQueue* queue = ticket->queue;
+    pthread_mutex_lock(&queue->guard);
+    while (ticket->match == NULL && !ticket->expired) {
+        pthread_cond_wait(&ticket->paired, &queue->guard);
+    }
+    pthread_mutex_unlock(&queue->guard);
+    return ticket->match;
+}
+
+/*
+ * Hands a partner returned by pairing_join the match it was paired into and
+ * wakes it
+ * ticket - The ticket of the partner
+ * match - The match both clients now belong to
+ */
+void pairing_complete(PairingTicket* ticket, struct Match* match) {
+    PairingQueue* queue = ticket->queue;
+    pthread_mutex_lock(&queue->guard);
+    ticket->match = match;
+    pthread_cond_signal(&ticket->paired);
+    pthread_mutex_unlock(&queue->guard);
+}
+
+/*
+ * Withdraws a ticket from the queue it is waiting in
+ * ticket - The ticket to withdraw
+ * Returns 1 if the ticket was still queued, or 0 if it had already been
+ * taken by a partner
+ */
+int pairing_cancel(PairingTicket* ticket) {
+    PairingQueue* queue = ticket->queue;
+    pthread_mutex_lock(&queue->guard);
+    int removed = remove_ticket(queue, ticket);
+    pthread_mutex_unlock(&queue->guard);
+    return removed;
+}
+
+/*
+ * Withdraws a ticket whose client has waited too long for a partner and
+ * wakes the client, whose pairing_wait then returns NULL
+ * ticket - The ticket to expire
+ * Returns 1 if the ticket was still queued, or 0 if it had already been
+ * taken by a partner
+ */
+int pairing_expire(PairingTicket* ticket) {
+    PairingQueue* queue = ticket->queue;
+    pthread_mutex_lock(&queue->guard);
+    int removed = remove_ticket(queue, ticket);
+    if (removed) {
+        ticket->expired = 1;
+        pthread_cond_signal(&ticket->paired);
+    }
+    pthread_mutex_unlock(&queue->guard);
+    return removed;
+}
+
+/*
+ * Returns the number of clients currently waiting for a partner
+ * queue - The queue to inspect
+ */
+int pairing_waiting(PairingQueue* queue) {
+    pthread_mutex_lock(&queue->guard);
+    int waiting = queue->waiting;
+    pthread_mutex_unlock(&queue->guard);
+    return waiting;
+}
@@ -0,0 +1,60 @@
+#ifndef PAIRING_H
+#define PAIRING_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+struct Match;
+struct Session;
+struct Coroutine;
+
+// Represents a client that has sent a valid match request and is waiting
+// in the pairing queue for a partner
+typedef struct PairingTicket {
+    int agentId;
+    char* port;
+    int binary;
+    FILE* serverToClient;
+    FILE* clientToServer;
+    struct Session* session;
+    struct Coroutine* coroutine;
+
+    struct Match* match;
+    int expired;
+    unsigned long queuedAt;
+    pthread_cond_t paired;
+    struct PairingQueue* queue;
+    struct PairingTicket* next;
+} PairingTicket;
+
+// Represents the queue of clients waiting for a partner, in arrival order.
+// The server keeps one queue per shard.
+typedef struct PairingQueue {
+    pthread_mutex_t guard;
+    PairingTicket* head;
+    PairingTicket* tail;
+    int waiting;
+} PairingQueue;
+
+void pairing_init(PairingQueue* queue);
+
+void init_ticket(PairingTicket* ticket, int agentId, char* port);
+
+void destroy_ticket(PairingTicket* ticket);
+
+PairingTicket* pairing_take_any(PairingQueue* shards, int numberOfShards,
+        int home);
+
+PairingTicket* pairing_join(PairingQueue* shards, int numberOfShards,
+        int home, PairingTicket* ticket);
+
+struct Match* pairing_wait(PairingTicket* ticket);
+
+void pairing_complete(PairingTicket* ticket, struct Match* match);
+
+int pairing_cancel(PairingTicket* ticket);
+
+int pairing_expire(PairingTicket* ticket);
+
+int pairing_waiting(PairingQueue* queue);
+#endif
@@ -0,0 +1,219 @@
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include "pool.h"
+
+#define NANOSECONDS_PER_SECOND 1000000000ULL
+#define READY_EVENTS 64
+
+/*
+ * Returns the number of nanoseconds between two monotonic times
+ * start - The earlier time
+ * end - The later time
+ */
+static unsigned long long elapsed_nanoseconds(struct timespec* start,
+        struct timespec* end) {
+    return (end->tv_sec - start->tv_sec) * NANOSECONDS_PER_SECOND +
+            end->tv_nsec - start->tv_nsec;
+}
+
+/*
+ * Runs jobs from the pool's queue forever, sleeping while it is empty
+ * workerPool - The pool this worker belongs to
+ */
+static void* run_worker(void* workerPool) {
+    WorkerPool* pool = (WorkerPool*) workerPool;
+    struct timespec start, end;
+    pthread_mutex_lock(&pool->guard);
+    while (1) {
+        while (pool->head == NULL) {
+            pthread_cond_wait(&pool->jobReady, &pool->guard);
+        }
+        PoolJob* job = pool->head;
+        pool->head = job->next;
+        if (pool->head == NULL) {
+            pool->tail = NULL;
+        }
+        pool->queued--;
+        pool->busy++;
+        pthread_mutex_unlock(&pool->guard);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        job->run(job->data);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        free(job);
+        pthread_mutex_lock(&pool->guard);
+        pool->busy--;
+        pool->completed++;
+        pool->busyNanoseconds += elapsed_nanoseconds(&start, &end);
+    }
+    return (void*) NULL;
+}
+
+/*
+ * Allocates a job
+ * run - The function to run
+ * data - The argument passed to the function
+ * Returns the job
+ */
+static PoolJob* new_job(void (*run)(void*), void* data) {
+    PoolJob* job = malloc(sizeof(PoolJob));
+    job->run = run;
+    job->data = data;
+    job->fd = -1;
+    job->next = NULL;
+    return job;
+}
+
+/*
+ * Adds a job to the back of the queue and wakes a worker for it. Must be
+ * called while holding the pool's guard.
+ * pool - The pool to run the job on
+ * job - The job to queue
+ */
+static void queue_job(WorkerPool* pool, PoolJob* job) {
+    if (pool->tail != NULL) {
+        pool->tail->next = job;
+    } else {
+        pool->head = job;
+    }
+    pool->tail = job;
+    pool->queued++;
+    if (pool->queued > pool->maxQueued) {
+        pool->maxQueued = pool->queued;
+    }
+    pthread_cond_signal(&pool->jobReady);
+}
+
+/*
+ * Moves parked jobs to the queue forever, as their sockets become
+ * readable. Each job is removed from the epoll set before it is queued, so
+ * it can park on the same socket again once it runs.
+ * workerPool - The pool whose parked jobs to watch
+ */
+static void* watch_parked(void* workerPool) {
+    WorkerPool* pool = (WorkerPool*) workerPool;
+    struct epoll_event events[READY_EVENTS];
+    while (1) {
+        int count = epoll_wait(pool->pollFd, events, READY_EVENTS, -1);
+        for (int i = 0; i < count; i++) {
+            PoolJob* job = (PoolJob*) events[i].data.ptr;
+            epoll_ctl(pool->pollFd, EPOLL_CTL_DEL, job->fd, NULL);
+            pthread_mutex_lock(&pool->guard);
+            pool->parked--;
+            queue_job(pool, job);
+            pthread_mutex_unlock(&pool->guard);
+        }
+    }
+    return (void*) NULL;
+}
+
+/*
+ * Starts a pool with the given number of worker threads and an empty
+ * queue, along with the thread that watches its parked jobs
+ * pool - The pool to start
+ * numberOfWorkers - The number of worker threads to run
+ * Returns 0 if every thread was started, else returns -1
+ */
+int pool_start(WorkerPool* pool, int numberOfWorkers) {
+    pthread_mutex_init(&pool->guard, NULL);
+    pthread_cond_init(&pool->jobReady, NULL);
+    pool->head = NULL;
+    pool->tail = NULL;
+    pool->queued = 0;
+    pool->parked = 0;
+    pool->maxQueued = 0;
+    pool->busy = 0;
+    pool->submitted = 0;
+    pool->completed = 0;
+    pool->busyNanoseconds = 0;
+    clock_gettime(CLOCK_MONOTONIC, &pool->started);
+    pool->numberOfWorkers = numberOfWorkers;
+    pool->workers = malloc(sizeof(pthread_t) * numberOfWorkers);
+    pool->pollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (pool->pollFd < 0 || pthread_create(&pool->watcher, NULL,
+            watch_parked, (void*) pool)) {
+        return -1;
+    }
+    pthread_detach(pool->watcher);
+    pthread_attr_t attributes;
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    for (int i = 0; i < numberOfWorkers; i++) {
+        if (pthread_create(&pool->workers[i], &attributes, run_worker,
+                (void*) pool)) {
+            pthread_attr_destroy(&attributes);
+            return -1;
+        }
+    }
+    pthread_attr_destroy(&attributes);
+    return 0;
+}
+
+/*
+ * Queues a job to be run by the next free worker
+ * pool - The pool to run the job on
+ * run - The function to run
+ * data - The argument passed to the function
+ */
+void pool_submit(WorkerPool* pool, void (*run)(void*), void* data) {
+    PoolJob* job = new_job(run, data);
+    pthread_mutex_lock(&pool->guard);
+    pool->submitted++;
+    queue_job(pool, job);
+    pthread_mutex_unlock(&pool->guard);
+}
+
+/*
+ * Parks a job until the given socket has something to read, has been shut
+ * down or has failed, then queues it to be run by the next free worker. A
+ * socket that cannot be watched has its job queued at once, and the job
+ * finds out when it reads.
+ * pool - The pool to run the job on
+ * fd - The socket the job will read from
+ * run - The function to run
+ * data - The argument passed to the function
+ */
+void pool_submit_when_readable(WorkerPool* pool, int fd, void (*run)(void*),
+        void* data) {
+    PoolJob* job = new_job(run, data);
+    job->fd = fd;
+    pthread_mutex_lock(&pool->guard);
+    pool->submitted++;
+    pool->parked++;
+    pthread_mutex_unlock(&pool->guard);
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = (void*) job;
+    if (epoll_ctl(pool->pollFd, EPOLL_CTL_ADD, fd, &event)) {
+        pthread_mutex_lock(&pool->guard);
+        pool->parked--;
+        queue_job(pool, job);
+        pthread_mutex_unlock(&pool->guard);
+    }
+}
+
+/*
+ * Reads the current statistics of a pool. Utilisation is the fraction of
+ * the workers' combined time since the pool started that was spent running
+ * finished jobs.
+ * pool - The pool to read
+ * stats - Filled in with the pool's statistics
+ */
+void pool_stats(WorkerPool* pool, PoolStats* stats) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&pool->guard);
+    stats->workers = pool->numberOfWorkers;
+    stats->busy = pool->busy;
+    stats->queued = pool->queued;
+    stats->parked = pool->parked;
+    stats->maxQueued = pool->maxQueued;
+    stats->submitted = pool->submitted;
+    stats->completed = pool->completed;
+    unsigned long long available = elapsed_nanoseconds(&pool->started, &now) *
+            pool->numberOfWorkers;
+    stats->utilisation = available ?
+            (double) pool->busyNanoseconds / available : 0;
+    pthread_mutex_unlock(&pool->guard);
+}
@@ -0,0 +1,61 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <time.h>
+#include <pthread.h>
+
+// Represents a unit of work waiting in a worker pool's queue, or parked
+// until the socket it reads from is readable
+typedef struct PoolJob {
+    void (*run)(void*);
+    void* data;
+    int fd;
+    struct PoolJob* next;
+} PoolJob;
+
+// Represents a fixed number of worker threads sharing a queue of jobs. Jobs
+// that would block reading from a client are parked in an epoll set, which
+// a watcher thread moves to the queue once there is something to read, so
+// idle clients never hold a worker.
+typedef struct {
+    pthread_mutex_t guard;
+    pthread_cond_t jobReady;
+    PoolJob* head;
+    PoolJob* tail;
+
+    int numberOfWorkers;
+    pthread_t* workers;
+    int pollFd;
+    pthread_t watcher;
+
+    int queued;
+    int parked;
+    int maxQueued;
+    int busy;
+    unsigned long submitted;
+    unsigned long completed;
+    unsigned long long busyNanoseconds;
+    struct timespec started;
+} WorkerPool;
+
+// Represents the statistics of a worker pool at one point in time
+typedef struct {
+    int workers;
+    int busy;
+    int queued;
+    int parked;
+    int maxQueued;
+    unsigned long submitted;
+    unsigned long completed;
+    double utilisation;
+} PoolStats;
+
+int pool_start(WorkerPool* pool, int numberOfWorkers);
+
+void pool_submit(WorkerPool* pool, void (*run)(void*), void* data);
+
+void pool_submit_when_readable(WorkerPool* pool, int fd, void (*run)(void*),
+        void* data);
+
+void pool_stats(WorkerPool* pool, PoolStats* stats);
+#endif
@@ -0,0 +1,320 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include "util.h"
+#include "server.h"
+#include "shared.h"
+
+// Represents one worker process, which accepts clients from the listener
+// it shares with every other worker and handles them on its own pool
+typedef struct {
+    SharedState* shared;
+    int listenFd;
+    TimerWheel timers;
+    WorkerPool pool;
+} PreforkWorker;
+
+// Represents a client being handled by one of a worker process's threads
+typedef struct {
+    PreforkWorker* worker;
+    int clientFd;
+    SharedTicket* ticket;
+    Timer timer;
+} PreforkClient;
+
+/*
+ * Reclaims a client whose deadline has passed while its thread is blocked
+ * reading from it, by shutting the connection down so that the read ends
+ * timer - The timer of the client's thread
+ * Returns 1, as the client is always reclaimed
+ */
+static int expire_prefork_connection(Timer* timer) {
+    PreforkClient* client = (PreforkClient*) timer->data;
+    shutdown(client->clientFd, SHUT_RDWR);
+    shared_count_expired(client->worker->shared, timer->phase);
+    return 1;
+}
+
+/*
+ * Reclaims a client that has waited too long for a partner by withdrawing
+ * its ticket, which wakes its thread
+ * timer - The timer of the client's thread
+ * Returns 1 if the client was still waiting, else returns 0
+ */
+static int expire_prefork_ticket(Timer* timer) {
+    PreforkClient* client = (PreforkClient*) timer->data;
+    if (!shared_expire(client->worker->shared, client->ticket)) {
+        return 0;
+    }
+    shared_count_expired(client->worker->shared, timer->phase);
+    return 1;
+}
+
+/*
+ * Reads a line or frame from a client with a deadline
+ * client - The client to read from
+ * clientToServer - The stream from the client
+ * phase - The phase whose deadline applies
+ * length - Set to the length of the message
+ * endOfFile - Set to 1 if the client closed its connection
+ * Returns the message read, which the caller must free
+ */
+static char* read_before_deadline(PreforkClient* client,
+        FILE* clientToServer, TimerPhase phase, int* length,
+        int* endOfFile) {
+    TimerWheel* timers = &client->worker->timers;
+    init_timer(&client->timer, expire_prefork_connection, (void*) client);
+    timer_arm(timers, &client->timer, phase);
+    char* message = read_message(clientToServer, length, endOfFile);
+    timer_cancel(timers, &client->timer);
+    return message;
+}
+
+/*
+ * Works out the outcome a client's result line claims. Prefork workers
+ * keep no match arena, so the line is split on the heap, and the winner is
+ * resolved to an id through the shared segment.
+ * shared - The shared state holding the agents
+ * ticket - The ticket of the match the client played
+ * result - The result line sent by the client
+ * Returns the outcome claimed, or NO_OUTCOME if the result is invalid
+ */
+static Outcome prefork_claim(SharedState* shared, SharedTicket* ticket,
+        char* result) {
+    int length;
+    char** splitMessage = split_string(result, &length, ':');
+    char* winner = result_winner(splitMessage, length, ticket->matchId);
+    Outcome claim = NO_OUTCOME;
+    if (winner != NULL && !strcmp("TIE", winner)) {
+        claim = TIED;
+    } else if (winner != NULL) {
+        claim = winner_claim(shared_lookup(shared, winner),
+                ticket->agentIds[0], ticket->agentIds[1]);
+    }
+    free_split_string(splitMessage, length);
+    return claim;
+}
+
+/*
+ * Sends a paired client its MATCH, in the encoding it asked in, waits for
+ * its result and reports the outcome the result claims. A MATCH frame too
+ * long to encode drops the client, whose side is reported as invalid.
+ * client - The paired client
+ * agentNumber - The position of the client in its match
+ * binary - Whether the client sent its match request as a frame
+ * serverToClient - The stream to the client
+ * clientToServer - The stream from the client
+ */
+static void play_prefork_match(PreforkClient* client, int agentNumber,
+        int binary, FILE* serverToClient, FILE* clientToServer) {
+    SharedState* shared = client->worker->shared;
+    SharedTicket* ticket = client->ticket;
+    int opponent = 2 - agentNumber;
+    char* opponentName = shared_name(shared, ticket->agentIds[opponent]);
+    if (binary) {
+        MatchFrame match = {ticket->matchId,
+                ticket->agentIds[agentNumber - 1],
+                ticket->agentIds[opponent], opponentName,
+                ticket->ports[opponent]};
+        int frameLength = frame_match(NULL, &match);
+        if (frameLength < 0) {
+            shared_report(shared, ticket, agentNumber, NO_OUTCOME);
+            return;
+        }
+        char* frame = malloc(frameLength);
+        frame_match(frame, &match);
+        fwrite(frame, 1, frameLength, serverToClient);
+        free(frame);
+    } else {
+        fprintf(serverToClient, "MATCH:%d:%s:%s\n", ticket->matchId,
+                opponentName, ticket->ports[opponent]);
+    }
+    fflush(serverToClient);
+    int endOfFile = 0, length;
+    char* result = read_before_deadline(client, clientToServer,
+            TIMER_RESULT, &length, &endOfFile);
+    Outcome claim = is_frame(result, length) ?
+            frame_claim(result, length, ticket->matchId,
+            ticket->agentIds[0], ticket->agentIds[1]) :
+            prefork_claim(shared, ticket, result);
+    free(result);
+    shared_report(shared, ticket, agentNumber, claim);
+}
+
+/*
+ * Handles a client on one of a worker process's threads. Its match request
+ * is read, it is paired through the shared slot with a client accepted by
+ * any worker, and its side of the match is played out. Relayed matches
+ * need both connections in one process, so a client asking to be relayed
+ * is refused, as is one whose port does not fit in a shared ticket.
+ * Queries are refused too, since the shared segment keeps no leaderboard.
+ * clientData - The client to handle, which is freed once it has been
+ * handled
+ */
+static void handle_prefork_client(void* clientData) {
+    PreforkClient* client = (PreforkClient*) clientData;
+    PreforkWorker* worker = client->worker;
+    int fd2 = dup(client->clientFd);
+    FILE* serverToClient = fdopen(client->clientFd, "w");
+    FILE* clientToServer = fdopen(fd2, "r");
+    int endOfFile = 0, length;
+    char* message = read_before_deadline(client, clientToServer, TIMER_MR,
+            &length, &endOfFile);
+    MatchRequest request;
+    int agentId = NO_AGENT, agentNumber = 0;
+    if (!parse_match_request(message, length, &request) && !endOfFile &&
+            strlen(request.port) < SHARED_PORT_SIZE &&
+            strcmp(request.port, RELAY_PORT)) {
+        agentId = shared_intern(worker->shared, request.name);
+    }
+    if (agentId != NO_AGENT) {
+        client->ticket = shared_join(worker->shared, agentId,
+                request.port, &agentNumber);
+    }
+    int binary = request.binary;
+    free_match_request(&request);
+    free(message);
+    if (agentNumber == 1) {
+        init_timer(&client->timer, expire_prefork_ticket, (void*) client);
+        timer_arm(&worker->timers, &client->timer, TIMER_PAIRING);
+        if (!shared_wait(worker->shared, client->ticket)) {
+            agentNumber = 0;
+        }
+        timer_cancel(&worker->timers, &client->timer);
+    }
+    if (agentNumber != 0) {
+        play_prefork_match(client, agentNumber, binary, serverToClient,
+                clientToServer);
+    } else {
+        refuse_request(serverToClient, binary && !endOfFile);
+    }
+    fclose(serverToClient);
+    fclose(clientToServer);
+    free(client);
+}
+
+/*
+ * Runs a worker process forever, accepting clients from the shared
+ * listener and handing each one to the process's pool. The worker never
+ * flushes the stdout it inherited, so the parent's output is not repeated.
+ * shared - The shared state
+ * listenFd - The listener shared by every worker
+ * numberOfWorkers - The number of threads in the process's pool
+ * timeouts - The deadline of each phase, in seconds
+ */
+static void run_worker(SharedState* shared, int listenFd,
+        int numberOfWorkers, int timeouts[TIMER_PHASES]) {
+    PreforkWorker worker;
+    worker.shared = shared;
+    worker.listenFd = listenFd;
+    timer_wheel_start(&worker.timers, timeouts);
+    pool_start(&worker.pool, numberOfWorkers);
+    int clientFd;
+    while (clientFd = accept(listenFd, 0, 0), clientFd >= 0) {
+        PreforkClient* client = malloc(sizeof(PreforkClient));
+        client->worker = &worker;
+        client->clientFd = clientFd;
+        pool_submit(&worker.pool, handle_prefork_client, (void*) client);
+    }
+    _exit(0);
+}
+
+/*
+ * Forks a worker process, which is terminated if the parent exits
+ * shared - The shared state
+ * listenFd - The listener shared by every worker
+ * numberOfWorkers - The number of threads in the process's pool
+ * timeouts - The deadline of each phase, in seconds
+ * Returns the process id of the worker, or -1 if it could not be forked
+ */
+static pid_t fork_worker(SharedState* shared, int listenFd,
+        int numberOfWorkers, int timeouts[TIMER_PHASES]) {
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != parent) {
+            _exit(0);
+        }
+        run_worker(shared, listenFd, numberOfWorkers, timeouts);
+    }
+    return pid;
+}
+
+/*
+ * Handles sighup in the parent process by printing every worker's results
+ * from the shared state, and how many clients every worker has reclaimed
+ * sharedState - The shared state
+ */
+static void* handle_prefork_sighup(void* sharedState) {
+    SharedState* shared = (SharedState*) sharedState;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGHUP);
+    int sig;
+    while (!sigwait(&set, &sig)) {
+        int length;
+        AgentRecord* records = shared_snapshot(shared, &length);
+        for (int i = 0; i < length; i++) {
+            printf("%s %d %d %d\n", records[i].name, records[i].wins,
+                    records[i].losses, records[i].ties);
+        }
+        printf("---\n");
+        fflush(stdout);
+        free(records);
+        fprintf(stderr, "expired mr %lu pairing %lu result %lu\n",
+                __atomic_load_n(&shared->expired[TIMER_MR],
+                __ATOMIC_RELAXED),
+                __atomic_load_n(&shared->expired[TIMER_PAIRING],
+                __ATOMIC_RELAXED),
+                __atomic_load_n(&shared->expired[TIMER_RESULT],
+                __ATOMIC_RELAXED));
+    }
+    return (void*) NULL;
+}
+
+/*
+ * Runs the server as pre-forked worker processes sharing its listener,
+ * with results, names and the pairing slot kept in a shared segment. The
+ * parent only answers sighup and replaces any worker that exits, so a
+ * crash loses at most the matches that worker was handling. SIGHUP must
+ * already be blocked, so that the workers inherit it blocked and only the
+ * parent answers it.
+ * listener - The listener shared by every worker
+ * numberOfProcesses - The number of worker processes
+ * numberOfWorkers - The number of threads in each worker's pool
+ * timeouts - The deadline of each phase, in seconds
+ * Returns 1 if the shared segment or a worker could not be created
+ */
+int run_prefork(ServerInfo* listener, int numberOfProcesses,
+        int numberOfWorkers, int timeouts[TIMER_PHASES]) {
+    SharedState* shared = shared_create(numberOfProcesses * numberOfWorkers);
+    if (shared == NULL) {
+        return 1;
+    }
+    for (int i = 0; i < numberOfProcesses; i++) {
+        if (fork_worker(shared, listener->socketFd, numberOfWorkers,
+                timeouts) < 0) {
+            return 1;
+        }
+    }
+    pthread_t thread;
+    pthread_create(&thread, 0, handle_prefork_sighup, (void*) shared);
+    int status;
+    pid_t pid;
+    while ((pid = wait(&status)) > 0) {
+        fprintf(stderr, "worker %d exited, restarting\n", (int) pid);
+        shared_reclaim(shared, pid);
+        if (fork_worker(shared, listener->socketFd, numberOfWorkers,
+                timeouts) < 0) {
+            return 1;
+        }
+    }
+    return 1;
+}
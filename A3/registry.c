@@ -0,0 +1,553 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <sched.h>
+#include <pthread.h>
+#include "registry.h"
+
+#define INITIAL_CAPACITY 64
+#define MAX_LOAD_PERCENT 70
+#define SKIP_LEVEL_SHIFT 2
+#define SNAPSHOT_ATTEMPTS 16
+
+/*
+ * Hashes a name with 64 bit FNV-1a
+ * name - The name to hash
+ * Returns the hash of the name
+ */
+static uint64_t hash_name(char* name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char* next = (unsigned char*) name; *next; next++) {
+        hash ^= *next;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ * Finds the slot holding the given name, or the empty slot where it would
+ * be inserted
+ * slots - The table to search
+ * capacity - The capacity of the table, which must be a power of two
+ * name - The name to search for
+ * Returns the index of the slot
+ */
+static unsigned int find_slot(Agent** slots, unsigned int capacity,
+        char* name) {
+    unsigned int slot = hash_name(name) & (capacity - 1);
+    while (slots[slot] != NULL && strcmp(slots[slot]->name, name)) {
+        slot = (slot + 1) & (capacity - 1);
+    }
+    return slot;
+}
+
+/*
+ * Doubles the capacity of the registry's table and reinserts every agent
+ * registry - The registry to grow
+ */
+static void grow_registry(Registry* registry) {
+    unsigned int capacity = registry->capacity * 2;
+    Agent** slots = calloc(capacity, sizeof(Agent*));
+    for (unsigned int i = 0; i < registry->capacity; i++) {
+        if (registry->slots[i] != NULL) {
+            slots[find_slot(slots, capacity, registry->slots[i]->name)] =
+                    registry->slots[i];
+        }
+    }
+    free(registry->slots);
+    registry->slots = slots;
+    registry->capacity = capacity;
+}
+
+/*
+ * Picks the number of skip list levels for a new agent, with each level a
+ * quarter as likely as the one below it
+ * registry - The registry the agent is being added to
+ * Returns the number of levels, between 1 and MAX_SKIP_LEVEL
+ */
+static int random_levels(Registry* registry) {
+    registry->seed ^= registry->seed << 13;
+    registry->seed ^= registry->seed >> 17;
+    registry->seed ^= registry->seed << 5;
+    unsigned int bits = registry->seed;
+    int levels = 1;
+    while (levels < MAX_SKIP_LEVEL &&
+            !(bits & ((1 << SKIP_LEVEL_SHIFT) - 1))) {
+        bits >>= SKIP_LEVEL_SHIFT;
+        levels++;
+    }
+    return levels;
+}
+
+/*
+ * Links a new agent into the registry's skip list in name order. Each level
+ * is published with a release store once the agent's own links are set, so
+ * a snapshot walking the bottom level never sees a half linked agent.
+ * registry - The registry the agent is being added to
+ * agent - The agent to link, with its levels already chosen
+ */
+static void link_agent(Registry* registry, Agent* agent) {
+    Agent** previous = registry->first;
+    Agent** before[MAX_SKIP_LEVEL];
+    for (int level = MAX_SKIP_LEVEL - 1; level >= 0; level--) {
+        while (previous[level] != NULL &&
+                strcmp(previous[level]->name, agent->name) < 0) {
+            previous = previous[level]->next;
+        }
+        before[level] = previous;
+    }
+    for (int level = 0; level < agent->levels; level++) {
+        agent->next[level] = before[level][level];
+        __atomic_store_n(&before[level][level], agent, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * Makes an agent reachable from its id. Must be called while holding the
+ * registry's guard.
+ * registry - The registry the agent belongs to
+ * agent - The agent, with its id set
+ */
+static void publish_id(Registry* registry, Agent* agent) {
+    Agent** block = registry->byId[agent->id >> ID_BLOCK_BITS];
+    if (block == NULL) {
+        block = calloc(ID_BLOCK_SIZE, sizeof(Agent*));
+        __atomic_store_n(&registry->byId[agent->id >> ID_BLOCK_BITS], block,
+                __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&block[agent->id & (ID_BLOCK_SIZE - 1)], agent,
+            __ATOMIC_RELEASE);
+}
+
+/*
+ * Initialises an empty registry
+ * registry - The registry to initialise
+ */
+void registry_init(Registry* registry) {
+    pthread_mutex_init(&registry->guard, NULL);
+    registry->capacity = INITIAL_CAPACITY;
+    registry->slots = calloc(registry->capacity, sizeof(Agent*));
+    registry->numberOfAgents = 0;
+    memset(registry->byId, 0, sizeof(registry->byId));
+    for (int level = 0; level < MAX_SKIP_LEVEL; level++) {
+        registry->first[level] = NULL;
+    }
+    registry->seed = 2463534242U;
+    registry->topLength = 0;
+    registry->updatesStarted = 0;
+    registry->updatesFinished = 0;
+    pthread_mutex_init(&registry->snapshotGuard, NULL);
+    pthread_cond_init(&registry->snapshotsDone, NULL);
+    registry->waitingSnapshots = 0;
+}
+
+/*
+ * Finds the agent registered under the given name without taking the
+ * registry's guard, by walking the skip list. Agents are never removed and
+ * every level is published with a release store, so any agent reached is
+ * fully linked on each level below the one it was reached on.
+ * registry - The registry to search
+ * name - The name of the agent to find
+ * Returns a pointer to the agent, or NULL if no such agent exists
+ */
+Agent* registry_search(Registry* registry, char* name) {
+    Agent** previous = registry->first;
+    Agent* next = NULL;
+    for (int level = MAX_SKIP_LEVEL - 1; level >= 0; level--) {
+        while ((next = __atomic_load_n(&previous[level], __ATOMIC_ACQUIRE))
+                != NULL && strcmp(next->name, name) < 0) {
+            previous = next->next;
+        }
+    }
+    return next != NULL && !strcmp(next->name, name) ? next : NULL;
+}
+
+/*
+ * Finds the agent registered under the given name, registering a new agent
+ * with no results if there is none
+ * registry - The registry to add to
+ * name - The name of the agent, which is copied
+ * Returns a pointer to the agent, or NULL if the registry is full
+ */
+Agent* registry_add(Registry* registry, char* name) {
+    pthread_mutex_lock(&registry->guard);
+    unsigned int slot = find_slot(registry->slots, registry->capacity, name);
+    Agent* agent = registry->slots[slot];
+    if (agent == NULL &&
+            registry->numberOfAgents < MAX_ID_BLOCKS * ID_BLOCK_SIZE) {
+        int levels = random_levels(registry);
+        agent = malloc(sizeof(Agent) + sizeof(Agent*) * levels);
+        agent->name = malloc(strlen(name) + 1);
+        strcpy(agent->name, name);
+        agent->id = registry->numberOfAgents;
+        agent->wins = 0;
+        agent->losses = 0;
+        agent->ties = 0;
+        agent->rank = NOT_RANKED;
+        agent->queued = 0;
+        agent->levels = levels;
+        link_agent(registry, agent);
+        publish_id(registry, agent);
+        if ((registry->numberOfAgents + 1) * 100 >
+                registry->capacity * MAX_LOAD_PERCENT) {
+            grow_registry(registry);
+            slot = find_slot(registry->slots, registry->capacity, name);
+        }
+        registry->slots[slot] = agent;
+        registry->numberOfAgents++;
+    }
+    pthread_mutex_unlock(&registry->guard);
+    return agent;
+}
+
+/*
+ * Interns a name, registering a new agent with no results if the name has
+ * not been seen before
+ * registry - The registry to add to
+ * name - The name to intern, which is copied
+ * Returns the id of the name's agent, or NO_AGENT if the registry is full
+ */
+int registry_intern(Registry* registry, char* name) {
+    Agent* agent = registry_add(registry, name);
+    return agent != NULL ? agent->id : NO_AGENT;
+}
+
+/*
+ * Finds the id a name was interned as, without interning it or taking the
+ * registry's guard
+ * registry - The registry to search
+ * name - The name to look up
+ * Returns the id of the name's agent, or NO_AGENT if it has none
+ */
+int registry_lookup(Registry* registry, char* name) {
+    Agent* agent = registry_search(registry, name);
+    return agent != NULL ? agent->id : NO_AGENT;
+}
+
+/*
+ * Finds the agent with the given id without taking the registry's guard
+ * registry - The registry to search
+ * id - The id of an agent returned by registry_intern
+ * Returns a pointer to the agent
+ */
+Agent* registry_agent(Registry* registry, int id) {
+    Agent** block = __atomic_load_n(&registry->byId[id >> ID_BLOCK_BITS],
+            __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&block[id & (ID_BLOCK_SIZE - 1)],
+            __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Returns the name of the agent with the given id, for output
+ * registry - The registry to search
+ * id - The id of an agent returned by registry_intern
+ */
+char* registry_name(Registry* registry, int id) {
+    return registry_agent(registry, id)->name;
+}
+
+/*
+ * Increments an agent's result counter. Must only be called by the single
+ * writer of the counters.
+ * counter - The counter to increment
+ */
+static void increment_counter(int* counter) {
+    __atomic_store_n(counter, *counter + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns 1 if one agent belongs above another on the leaderboard, else 0
+ * agent - The agent to place
+ * other - The agent to compare it with
+ */
+static int ranks_above(Agent* agent, Agent* other) {
+    return agent->wins > other->wins ||
+            (agent->wins == other->wins && agent->id < other->id);
+}
+
+/*
+ * Stores an agent at a position on the leaderboard
+ * registry - The registry holding the leaderboard
+ * agent - The agent to store
+ * position - Where to store it
+ */
+static void place_agent(Registry* registry, Agent* agent, int position) {
+    agent->rank = position;
+    __atomic_store_n(&registry->top[position], agent, __ATOMIC_RELEASE);
+}
+
+/*
+ * Moves an agent whose wins have just been set or increased to its place
+ * on the leaderboard, entering it if it now beats the agent at the foot.
+ * Agents with no wins are never ranked. The length is published last, so
+ * every entry a reader can see is set. Must only be called by the single
+ * writer of the counters, and between registry_begin_update and
+ * registry_end_update once the server is running.
+ * registry - The registry holding the leaderboard
+ * agent - The agent whose wins changed
+ */
+void registry_rank(Registry* registry, Agent* agent) {
+    int position = agent->rank, length = registry->topLength;
+    if (agent->wins == 0) {
+        return;
+    }
+    if (position == NOT_RANKED) {
+        if (length < TOP_SIZE) {
+            position = length++;
+        } else if (ranks_above(agent, registry->top[length - 1])) {
+            position = length - 1;
+            registry->top[position]->rank = NOT_RANKED;
+        } else {
+            return;
+        }
+    }
+    while (position > 0 && ranks_above(agent, registry->top[position - 1])) {
+        place_agent(registry, registry->top[position - 1], position);
+        position--;
+    }
+    place_agent(registry, agent, position);
+    __atomic_store_n(&registry->topLength, length, __ATOMIC_RELEASE);
+}
+
+/*
+ * Records the outcome of a match in both agents' counters. Must only be
+ * called by the single writer of the counters, and between
+ * registry_begin_update and registry_end_update once the server is
+ * running.
+ * registry - The registry holding the agents
+ * firstId - The id of the match's first agent
+ * secondId - The id of the match's second agent
+ * outcome - How the match ended
+ */
+void registry_record(Registry* registry, int firstId, int secondId,
+        Outcome outcome) {
+    if (outcome == NO_OUTCOME) {
+        return;
+    }
+    Agent* first = registry_agent(registry, firstId);
+    Agent* second = registry_agent(registry, secondId);
+    if (outcome == TIED) {
+        increment_counter(&first->ties);
+        increment_counter(&second->ties);
+    } else if (outcome == FIRST_WON) {
+        increment_counter(&first->wins);
+        increment_counter(&second->losses);
+        registry_rank(registry, first);
+    } else {
+        increment_counter(&first->losses);
+        increment_counter(&second->wins);
+        registry_rank(registry, second);
+    }
+}
+
+/*
+ * Marks the start of an update to agents' result counters. While a
+ * snapshot is waiting for updates to stop, the update is backed out, so
+ * that it counts as finished without having changed anything, and started
+ * again once every waiting snapshot has been taken.
+ * registry - The registry holding the agents being updated
+ */
+void registry_begin_update(Registry* registry) {
+    while (1) {
+        __atomic_fetch_add(&registry->updatesStarted, 1, __ATOMIC_SEQ_CST);
+        if (!__atomic_load_n(&registry->waitingSnapshots, __ATOMIC_SEQ_CST)) {
+            return;
+        }
+        __atomic_fetch_add(&registry->updatesFinished, 1, __ATOMIC_RELEASE);
+        pthread_mutex_lock(&registry->snapshotGuard);
+        while (__atomic_load_n(&registry->waitingSnapshots,
+                __ATOMIC_SEQ_CST)) {
+            pthread_cond_wait(&registry->snapshotsDone,
+                    &registry->snapshotGuard);
+        }
+        pthread_mutex_unlock(&registry->snapshotGuard);
+    }
+}
+
+/*
+ * Marks the end of an update started with registry_begin_update
+ * registry - The registry holding the agents that were updated
+ */
+void registry_end_update(Registry* registry) {
+    __atomic_fetch_add(&registry->updatesFinished, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies one agent's counters into a record
+ * record - The record to fill in
+ * agent - The agent to copy
+ */
+static void copy_record(AgentRecord* record, Agent* agent) {
+    record->name = agent->name;
+    record->wins = __atomic_load_n(&agent->wins, __ATOMIC_RELAXED);
+    record->losses = __atomic_load_n(&agent->losses, __ATOMIC_RELAXED);
+    record->ties = __atomic_load_n(&agent->ties, __ATOMIC_RELAXED);
+}
+
+/*
+ * Copies the records of every agent into an array in name order
+ * registry - The registry to copy
+ * source - Unused
+ * length - Set to the number of records copied
+ * Returns the allocated array of records
+ */
+static AgentRecord* copy_records(Registry* registry, void* source,
+        int* length) {
+    int buffer = 64, copied = 0;
+    AgentRecord* records = malloc(sizeof(AgentRecord) * buffer);
+    for (Agent* agent = __atomic_load_n(&registry->first[0],
+            __ATOMIC_ACQUIRE); agent != NULL;
+            agent = __atomic_load_n(&agent->next[0], __ATOMIC_ACQUIRE)) {
+        if (copied == buffer) {
+            buffer *= 2;
+            records = realloc(records, sizeof(AgentRecord) * buffer);
+        }
+        copy_record(&records[copied++], agent);
+    }
+    *length = copied;
+    return records;
+}
+
+/*
+ * Copies the record of a single agent
+ * registry - The registry holding the agent
+ * source - The agent to copy
+ * length - Set to 1
+ * Returns the allocated record
+ */
+static AgentRecord* copy_agent(Registry* registry, void* source,
+        int* length) {
+    AgentRecord* record = malloc(sizeof(AgentRecord));
+    copy_record(record, (Agent*) source);
+    *length = 1;
+    return record;
+}
+
+/*
+ * Copies the records at the head of the leaderboard, best first
+ * registry - The registry holding the leaderboard
+ * source - The most records to copy
+ * length - Set to the number of records copied
+ * Returns the allocated array of records
+ */
+static AgentRecord* copy_top(Registry* registry, void* source,
+        int* length) {
+    int wanted = *(int*) source;
+    int ranked = __atomic_load_n(&registry->topLength, __ATOMIC_ACQUIRE);
+    *length = ranked < wanted ? ranked : wanted;
+    AgentRecord* records = malloc(sizeof(AgentRecord) * (*length + 1));
+    for (int i = 0; i < *length; i++) {
+        copy_record(&records[i], __atomic_load_n(&registry->top[i],
+                __ATOMIC_ACQUIRE));
+    }
+    return records;
+}
+
+/*
+ * Copies part of the registry once the writer of the counters has been
+ * held off. Waiting is announced before the update counters are read, so
+ * any update started after they are seen to be equal sees the wait and
+ * backs out, and none can be in progress while the copy is taken.
+ * registry - The registry to copy from
+ * copy - Copies the records wanted from the source given
+ * source - Passed to the copier
+ * length - Set to the number of records copied
+ * Returns the allocated array of records
+ */
+static AgentRecord* copy_exclusively(Registry* registry,
+        AgentRecord* (*copy)(Registry*, void*, int*), void* source,
+        int* length) {
+    pthread_mutex_lock(&registry->snapshotGuard);
+    __atomic_fetch_add(&registry->waitingSnapshots, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&registry->snapshotGuard);
+    while (__atomic_load_n(&registry->updatesStarted, __ATOMIC_SEQ_CST) !=
+            __atomic_load_n(&registry->updatesFinished, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+    AgentRecord* records = copy(registry, source, length);
+    pthread_mutex_lock(&registry->snapshotGuard);
+    if (__atomic_sub_fetch(&registry->waitingSnapshots, 1,
+            __ATOMIC_SEQ_CST) == 0) {
+        pthread_cond_broadcast(&registry->snapshotsDone);
+    }
+    pthread_mutex_unlock(&registry->snapshotGuard);
+    return records;
+}
+
+/*
+ * Copies part of the registry without taking any lock. The copy is
+ * retried until no result was being recorded while it was taken, so each
+ * match appears in both agents' records or in neither. If results keep
+ * arriving through SNAPSHOT_ATTEMPTS tries, the writer is held off for one
+ * last copy instead, so a torn copy is never returned.
+ * registry - The registry to copy from
+ * copy - Copies the records wanted from the source given
+ * source - Passed to the copier
+ * length - Set to the number of records copied
+ * Returns the allocated array of records, which the caller must free. The
+ * names are owned by the registry.
+ */
+static AgentRecord* copy_consistently(Registry* registry,
+        AgentRecord* (*copy)(Registry*, void*, int*), void* source,
+        int* length) {
+    for (int attempt = 0; attempt < SNAPSHOT_ATTEMPTS; attempt++) {
+        unsigned long finished = __atomic_load_n(&registry->updatesFinished,
+                __ATOMIC_ACQUIRE);
+        unsigned long started = __atomic_load_n(&registry->updatesStarted,
+                __ATOMIC_ACQUIRE);
+        if (started != finished) {
+            sched_yield();
+            continue;
+        }
+        AgentRecord* records = copy(registry, source, length);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&registry->updatesStarted,
+                __ATOMIC_RELAXED) == started) {
+            return records;
+        }
+        free(records);
+    }
+    return copy_exclusively(registry, copy, source, length);
+}
+
+/*
+ * Takes a snapshot of every agent's record in name order without taking
+ * any lock, as copy_consistently describes
+ * registry - The registry to take a snapshot of
+ * length - Set to the number of records in the snapshot
+ * Returns the allocated array of records, which the caller must free. The
+ * names are owned by the registry.
+ */
+AgentRecord* registry_snapshot(Registry* registry, int* length) {
+    return copy_consistently(registry, copy_records, NULL, length);
+}
+
+/*
+ * Copies the record of the agent with the given name without taking any
+ * lock
+ * registry - The registry to search
+ * name - The name of the agent
+ * Returns the allocated record, which the caller must free, or NULL if no
+ * such agent exists. The name is owned by the registry.
+ */
+AgentRecord* registry_stats(Registry* registry, char* name) {
+    Agent* agent = registry_search(registry, name);
+    int length;
+    return agent != NULL ?
+            copy_consistently(registry, copy_agent, (void*) agent, &length) :
+            NULL;
+}
+
+/*
+ * Copies the records of the agents with the most wins from the
+ * leaderboard without taking any lock
+ * registry - The registry holding the leaderboard
+ * k - The most records to copy, which is capped at TOP_SIZE
+ * length - Set to the number of records copied, which is less than k if
+ * fewer agents have won a match
+ * Returns the allocated array of records, best first, which the caller
+ * must free. The names are owned by the registry.
+ */
+AgentRecord* registry_top(Registry* registry, int k, int* length) {
+    return copy_consistently(registry, copy_top, (void*) &k, length);
+}
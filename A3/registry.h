@@ -0,0 +1,112 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <pthread.h>
+#include "mpsc.h"
+
+#define MAX_SKIP_LEVEL 16
+#define ID_BLOCK_BITS 10
+#define ID_BLOCK_SIZE (1 << ID_BLOCK_BITS)
+#define MAX_ID_BLOCKS 4096
+#define NO_AGENT -1
+#define NOT_RANKED -1
+#define TOP_SIZE 100
+
+// Represents the record of a single named agent, identified everywhere
+// but in output by the compact id it was given when first registered. The
+// result counters are only written by the stats thread, and are accessed
+// with atomic operations so snapshots can read them at any time. The
+// agent's position in the registry's leaderboard is likewise only used by
+// the stats thread, while the link and flag queue the agent for the feed
+// when its counters change.
+typedef struct Agent {
+    char* name;
+    int id;
+    int wins;
+    int losses;
+    int ties;
+    int rank;
+    int queued;
+    QueueLink changed;
+
+    int levels;
+    struct Agent* next[];
+} Agent;
+
+// The ways a match can be recorded as ending
+typedef enum {
+    NO_OUTCOME, FIRST_WON, SECOND_WON, TIED
+} Outcome;
+
+// Represents a copy of one agent's record taken as part of a snapshot
+typedef struct {
+    char* name;
+    int wins;
+    int losses;
+    int ties;
+} AgentRecord;
+
+// Represents every agent the server has seen, indexed by name in an open
+// addressing hash table. Agents are allocated individually so pointers to
+// them stay valid as the table grows, and are also linked into a skip list
+// ordered by name so they can be listed without sorting. The bottom level
+// of the skip list is published with release stores so snapshots can walk
+// it without taking the guard, while the update counters let a snapshot
+// tell whether any result was recorded while it was being copied. A
+// snapshot that keeps being overtaken holds the writer off instead through
+// the waiting count, which the writer checks as it starts each update. Ids are
+// handed out in order and index a directory of fixed size blocks, which
+// never move, so an agent is found from its id without taking the guard.
+// The leaderboard holds the TOP_SIZE agents with the most wins, best first
+// and ties broken by id, and is kept in order as each result is recorded so
+// that queries never sort. Wins never decrease, so an agent that leaves the
+// leaderboard can only come back by passing the agent at its foot.
+typedef struct {
+    pthread_mutex_t guard;
+    Agent** slots;
+    unsigned int capacity;
+    int numberOfAgents;
+    Agent** byId[MAX_ID_BLOCKS];
+
+    Agent* first[MAX_SKIP_LEVEL];
+    unsigned int seed;
+
+    Agent* top[TOP_SIZE];
+    int topLength;
+
+    unsigned long updatesStarted;
+    unsigned long updatesFinished;
+    pthread_mutex_t snapshotGuard;
+    pthread_cond_t snapshotsDone;
+    int waitingSnapshots;
+} Registry;
+
+void registry_init(Registry* registry);
+
+Agent* registry_search(Registry* registry, char* name);
+
+Agent* registry_add(Registry* registry, char* name);
+
+int registry_intern(Registry* registry, char* name);
+
+int registry_lookup(Registry* registry, char* name);
+
+Agent* registry_agent(Registry* registry, int id);
+
+char* registry_name(Registry* registry, int id);
+
+void registry_record(Registry* registry, int firstId, int secondId,
+        Outcome outcome);
+
+void registry_rank(Registry* registry, Agent* agent);
+
+void registry_begin_update(Registry* registry);
+
+void registry_end_update(Registry* registry);
+
+AgentRecord* registry_snapshot(Registry* registry, int* length);
+
+AgentRecord* registry_stats(Registry* registry, char* name);
+
+AgentRecord* registry_top(Registry* registry, int k, int* length);
+#endif
@@ -0,0 +1,208 @@
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "relay.h"
+
+#define MIN_GAMES 5
+#define MAX_GAMES 20
+#define NO_MOVE -1
+
+/*
+ * Initialises a relay with both sides open and no games played
+ * relay - The relay to initialise
+ */
+void relay_init(Relay* relay) {
+    pthread_mutex_init(&relay->guard, NULL);
+    pthread_cond_init(&relay->drained, NULL);
+    for (int i = 0; i < 2; i++) {
+        relay->open[i] = 1;
+        relay->sending[i] = 0;
+        relay->errorSent[i] = 0;
+        relay->moves[i] = NO_MOVE;
+        relay->wins[i] = 0;
+    }
+    relay->gamesPlayed = 0;
+    relay->failed = 0;
+}
+
+/*
+ * Releases a relay once neither side is open
+ * relay - The relay to release
+ */
+void relay_destroy(Relay* relay) {
+    pthread_mutex_destroy(&relay->guard);
+    pthread_cond_destroy(&relay->drained);
+}
+
+/*
+ * Returns 1 if a line sent during a relayed match is a move for the
+ * opponent, or 0 if it is the client's result
+ * line - The line sent by the client
+ */
+int relay_is_move(char* line) {
+    return !strncmp(line, "MOVE", strlen("MOVE"));
+}
+
+/*
+ * Converts a MOVE line into the value the clients use for the move
+ * line - The line to convert
+ * Returns the value of the move, or NO_MOVE if the line is not a valid move
+ */
+static int move_value(char* line) {
+    char* moves[] = {"MOVE:ROCK", "MOVE:PAPER", "MOVE:SCISSORS"};
+    for (int i = 0; i < 3; i++) {
+        if (!strcmp(line, moves[i])) {
+            return i;
+        }
+    }
+    return NO_MOVE;
+}
+
+/*
+ * Returns 1 if the relayed match has played every game the clients will
+ * play, by the same rule the clients follow, else returns 0. Must be
+ * called while holding the relay's guard.
+ * relay - The relay to check
+ */
+static int relay_finished(Relay* relay) {
+    return relay->gamesPlayed >= MIN_GAMES &&
+            (relay->wins[0] != relay->wins[1] ||
+            relay->gamesPlayed >= MAX_GAMES);
+}
+
+/*
+ * Starts sending a line to one side of a relay, if that side is open, by
+ * copying the line with its newline restored. Must be called while holding
+ * the relay's guard.
+ * relay - The relay of the match
+ * side - The side to send to
+ * line - The line to send, without its newline
+ * Returns the copy to send once the guard is released, or NULL if the
+ * side is closed
+ */
+static char* begin_send(Relay* relay, int side, char* line) {
+    if (!relay->open[side]) {
+        return NULL;
+    }
+    int length = strlen(line);
+    char* output = malloc(length + 2);
+    memcpy(output, line, length);
+    output[length] = '\n';
+    output[length + 1] = '\0';
+    relay->sending[side]++;
+    return output;
+}
+
+/*
+ * Sends a line started by begin_send without holding the relay's guard,
+ * then lets a side waiting to leave know once nothing is being sent to it
+ * relay - The relay of the match
+ * side - The side to send to
+ * output - The copy returned by begin_send, which is freed
+ * send - How to send to the side
+ * peer - The side's connection
+ */
+static void finish_send(Relay* relay, int side, char* output,
+        RelaySend send, void* peer) {
+    send(peer, output);
+    free(output);
+    pthread_mutex_lock(&relay->guard);
+    if (--relay->sending[side] == 0) {
+        pthread_cond_broadcast(&relay->drained);
+    }
+    pthread_mutex_unlock(&relay->guard);
+}
+
+/*
+ * Scores a move sent by one side of a relayed match and forwards it
+ * unchanged to the other side, if that side is still open. A move that is
+ * invalid, out of turn or beyond the last game fails the match: the other
+ * side is sent an error in its place, just as a client whose opponent
+ * misbehaves sees its connection end, and nothing more is forwarded.
+ * relay - The relay of the match
+ * agentNumber - The position in the match of the side that sent the move
+ * line - The line sent, without its newline
+ * send - How to send to the other side
+ * peer - The other side's connection
+ */
+void relay_forward(Relay* relay, int agentNumber, char* line,
+        RelaySend send, void* peer) {
+    int side = agentNumber - 1, other = 1 - side;
+    int value = move_value(line);
+    pthread_mutex_lock(&relay->guard);
+    if (relay->failed) {
+        pthread_mutex_unlock(&relay->guard);
+        return;
+    }
+    if (value == NO_MOVE || relay->moves[side] != NO_MOVE ||
+            relay_finished(relay)) {
+        relay->failed = 1;
+    } else {
+        relay->moves[side] = value;
+    }
+    if (relay->moves[0] != NO_MOVE && relay->moves[1] != NO_MOVE) {
+        if ((3 + relay->moves[0] - relay->moves[1]) % 3 == 1) {
+            relay->wins[0]++;
+        } else if (relay->moves[0] != relay->moves[1]) {
+            relay->wins[1]++;
+        }
+        relay->gamesPlayed++;
+        relay->moves[0] = NO_MOVE;
+        relay->moves[1] = NO_MOVE;
+    }
+    char* output = begin_send(relay, other, relay->failed ? "ERROR" : line);
+    if (output != NULL && relay->failed) {
+        relay->errorSent[other] = 1;
+    }
+    pthread_mutex_unlock(&relay->guard);
+    if (output != NULL) {
+        finish_send(relay, other, output, send, peer);
+    }
+}
+
+/*
+ * Closes one side of a relayed match once its client has finished playing.
+ * If the match is unfinished, the other side is sent an error in place of
+ * the move it is waiting for, just as a client whose opponent disconnects
+ * sees its connection end, unless it has already been sent one. Waits for
+ * any line being sent to this side, so once this returns the other side
+ * will never send to this side's connection again.
+ * relay - The relay of the match
+ * agentNumber - The position in the match of the side that finished
+ * send - How to send to the other side
+ * peer - The other side's connection
+ */
+void relay_leave(Relay* relay, int agentNumber, RelaySend send, void* peer) {
+    int side = agentNumber - 1, other = 1 - side;
+    pthread_mutex_lock(&relay->guard);
+    relay->open[side] = 0;
+    while (relay->sending[side] > 0) {
+        pthread_cond_wait(&relay->drained, &relay->guard);
+    }
+    char* output = NULL;
+    if (!relay_finished(relay) && !relay->errorSent[other]) {
+        output = begin_send(relay, other, "ERROR");
+        relay->errorSent[other] = output != NULL;
+    }
+    pthread_mutex_unlock(&relay->guard);
+    if (output != NULL) {
+        finish_send(relay, other, output, send, peer);
+    }
+}
+
+/*
+ * Works out how a relayed match ended from the moves the server relayed.
+ * Must only be called once both sides have left.
+ * relay - The relay of the match
+ * Returns the outcome, or NO_OUTCOME if the match failed or was unfinished
+ */
+Outcome relay_outcome(Relay* relay) {
+    if (relay->failed || !relay_finished(relay)) {
+        return NO_OUTCOME;
+    } else if (relay->wins[0] > relay->wins[1]) {
+        return FIRST_WON;
+    } else if (relay->wins[0] < relay->wins[1]) {
+        return SECOND_WON;
+    }
+    return TIED;
+}
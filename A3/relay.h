@@ -0,0 +1,43 @@
+#ifndef RELAY_H
+#define RELAY_H
+
+#include <pthread.h>
+#include "registry.h"
+
+#define RELAY_PORT "RELAY"
+
+// Sends a line to the client at the other end of a relayed match
+typedef void (*RelaySend)(void* peer, char* line);
+
+// Represents a match whose MOVE lines the server forwards between the two
+// clients over their server connections, scoring each game as it goes so
+// that the outcome never depends on the clients' RESULT lines. Each side
+// is open until its client has finished playing and no line is still being
+// sent to it; only then may the connection behind it be released. Lines
+// are sent without holding the guard, so a slow client only holds up the
+// thread sending to it.
+typedef struct {
+    pthread_mutex_t guard;
+    pthread_cond_t drained;
+    int open[2];
+    int sending[2];
+    int errorSent[2];
+    int moves[2];
+    int gamesPlayed;
+    int wins[2];
+    int failed;
+} Relay;
+
+void relay_init(Relay* relay);
+
+void relay_destroy(Relay* relay);
+
+int relay_is_move(char* line);
+
+void relay_forward(Relay* relay, int agentNumber, char* line,
+        RelaySend send, void* peer);
+
+void relay_leave(Relay* relay, int agentNumber, RelaySend send, void* peer);
+
+Outcome relay_outcome(Relay* relay);
+#endif
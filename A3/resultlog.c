@@ -0,0 +1,476 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "registry.h"
+#include "resultlog.h"
+
+#define SNAPSHOT_MAGIC "RPSS"
+#define LOG_MAGIC "RPSL"
+#define FORMAT_VERSION 1
+#define LOG_HEADER_SIZE 16
+#define NAME_RECORD 1
+#define RESULT_RECORD 2
+#define SNAPSHOT_INTERVAL 1000000
+#define INITIAL_BUFFER 4096
+
+// Represents a read-only mapping of a file being loaded
+typedef struct {
+    unsigned char* data;
+    size_t size;
+    size_t position;
+} MappedFile;
+
+/*
+ * Builds the path of a file in the log's directory
+ * log - The log whose directory the file is in
+ * name - The name of the file
+ * Returns the allocated path
+ */
+static char* file_path(ResultLog* log, char* name) {
+    char* path = malloc(strlen(log->directory) + strlen(name) + 2);
+    sprintf(path, "%s/%s", log->directory, name);
+    return path;
+}
+
+/*
+ * Builds the path of the log file of the given generation
+ * log - The log whose directory the file is in
+ * generation - The generation of the log file
+ * Returns the allocated path
+ */
+static char* generation_path(ResultLog* log, unsigned long generation) {
+    char name[64];
+    sprintf(name, "results.%lu.log", generation);
+    return file_path(log, name);
+}
+
+/*
+ * Maps a whole file into memory for reading
+ * path - The path of the file
+ * file - Filled in with the mapping
+ * Returns 0 if the file was mapped, else returns -1
+ */
+static int map_file(char* path, MappedFile* file) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat status;
+    if (fstat(fd, &status) || status.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    file->size = status.st_size;
+    file->position = 0;
+    file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file->data == MAP_FAILED) {
+        return -1;
+    }
+    madvise(file->data, file->size, MADV_SEQUENTIAL);
+    return 0;
+}
+
+/*
+ * Copies the next bytes of a mapped file
+ * file - The file to read from
+ * destination - Where to copy the bytes
+ * size - The number of bytes to copy
+ * Returns 0 if the bytes were there, or -1 if the file ends first
+ */
+static int read_bytes(MappedFile* file, void* destination, size_t size) {
+    if (file->size - file->position < size) {
+        return -1;
+    }
+    memcpy(destination, file->data + file->position, size);
+    file->position += size;
+    return 0;
+}
+
+/*
+ * Reads a length-prefixed name from a mapped file
+ * file - The file to read from
+ * name - Filled in with the name, which must have room for 65536 bytes
+ * Returns 0 if the whole name was there, else returns -1
+ */
+static int read_name(MappedFile* file, char* name) {
+    uint16_t length;
+    if (read_bytes(file, &length, sizeof(uint16_t)) ||
+            read_bytes(file, name, length)) {
+        return -1;
+    }
+    name[length] = '\0';
+    return 0;
+}
+
+/*
+ * Appends bytes to the log's pending batch
+ * log - The log to append to
+ * data - The bytes to append
+ * size - The number of bytes
+ */
+static void put_bytes(ResultLog* log, void* data, int size) {
+    if (log->length + size > log->bufferSize) {
+        while (log->length + size > log->bufferSize) {
+            log->bufferSize *= 2;
+        }
+        log->buffer = realloc(log->buffer, log->bufferSize);
+    }
+    memcpy(log->buffer + log->length, data, size);
+    log->length += size;
+}
+
+/*
+ * Appends a length-prefixed name to the log's pending batch
+ * log - The log to append to
+ * name - The name to append
+ */
+static void put_name(ResultLog* log, char* name) {
+    uint16_t length = strlen(name);
+    put_bytes(log, &length, sizeof(uint16_t));
+    put_bytes(log, name, length);
+}
+
+/*
+ * Writes the whole of a buffer to a file
+ * fd - The file to write to
+ * data - The bytes to write
+ * size - The number of bytes
+ * Returns 0 if everything was written, else returns -1
+ */
+static int write_all(int fd, char* data, int size) {
+    while (size > 0) {
+        int written = write(fd, data, size);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return -1;
+        }
+        data += written;
+        size -= written;
+    }
+    return 0;
+}
+
+/*
+ * Forces the directory entries of the log's directory to disk
+ * log - The log whose directory to sync
+ */
+static void sync_directory(ResultLog* log) {
+    int fd = open(log->directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+/*
+ * Loads every agent's counters from the snapshot, if there is one
+ * log - The log being opened
+ * registry - The registry to load into
+ * Returns the generation of the log that follows the snapshot
+ */
+static unsigned long load_snapshot(ResultLog* log, Registry* registry) {
+    char* path = file_path(log, "snapshot");
+    MappedFile file;
+    int mapped = map_file(path, &file);
+    free(path);
+    if (mapped) {
+        return 0;
+    }
+    char magic[4], name[UINT16_MAX + 1];
+    uint32_t version, count, counters[3];
+    uint64_t generation = 0;
+    if (read_bytes(&file, magic, 4) || memcmp(magic, SNAPSHOT_MAGIC, 4) ||
+            read_bytes(&file, &version, sizeof(uint32_t)) ||
+            version != FORMAT_VERSION ||
+            read_bytes(&file, &generation, sizeof(uint64_t)) ||
+            read_bytes(&file, &count, sizeof(uint32_t))) {
+        munmap(file.data, file.size);
+        return 0;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (read_bytes(&file, counters, sizeof(counters)) ||
+                read_name(&file, name)) {
+            break;
+        }
+        Agent* agent = registry_add(registry, name);
+        if (agent != NULL) {
+            agent->wins = counters[0];
+            agent->losses = counters[1];
+            agent->ties = counters[2];
+            registry_rank(registry, agent);
+        }
+    }
+    munmap(file.data, file.size);
+    return generation;
+}
+
+/*
+ * Replays every complete record in the log of the current generation. A
+ * record cut short by a crash ends the replay.
+ * log - The log being opened
+ * registry - The registry to replay into
+ */
+static void replay_log(ResultLog* log, Registry* registry) {
+    char* path = generation_path(log, log->generation);
+    MappedFile file;
+    int mapped = map_file(path, &file);
+    free(path);
+    if (mapped) {
+        return;
+    }
+    char magic[4], name[UINT16_MAX + 1];
+    uint32_t version, ids[2];
+    uint64_t generation;
+    if (read_bytes(&file, magic, 4) || memcmp(magic, LOG_MAGIC, 4) ||
+            read_bytes(&file, &version, sizeof(uint32_t)) ||
+            version != FORMAT_VERSION ||
+            read_bytes(&file, &generation, sizeof(uint64_t)) ||
+            generation != log->generation) {
+        munmap(file.data, file.size);
+        return;
+    }
+    int* agentIds = NULL;
+    uint32_t knownIds = 0;
+    uint8_t type, outcome;
+    while (!read_bytes(&file, &type, sizeof(uint8_t))) {
+        if (type == NAME_RECORD) {
+            if (read_bytes(&file, ids, sizeof(uint32_t)) ||
+                    read_name(&file, name)) {
+                break;
+            }
+            if (ids[0] >= knownIds) {
+                uint32_t oldIds = knownIds;
+                knownIds = ids[0] * 2 + 1;
+                agentIds = realloc(agentIds, sizeof(int) * knownIds);
+                for (uint32_t i = oldIds; i < knownIds; i++) {
+                    agentIds[i] = NO_AGENT;
+                }
+            }
+            agentIds[ids[0]] = registry_intern(registry, name);
+        } else if (type == RESULT_RECORD) {
+            if (read_bytes(&file, ids, sizeof(ids)) ||
+                    read_bytes(&file, &outcome, sizeof(uint8_t))) {
+                break;
+            }
+            if (ids[0] < knownIds && ids[1] < knownIds &&
+                    agentIds[ids[0]] != NO_AGENT &&
+                    agentIds[ids[1]] != NO_AGENT) {
+                registry_record(registry, agentIds[ids[0]],
+                        agentIds[ids[1]], (Outcome) outcome);
+            }
+        } else {
+            break;
+        }
+    }
+    free(agentIds);
+    munmap(file.data, file.size);
+}
+
+/*
+ * Starts the log of the given generation, empty but for its header
+ * log - The log to start
+ * generation - The generation of the new log file
+ * Returns 0 if the log was started, else returns -1
+ */
+static int start_generation(ResultLog* log, unsigned long generation) {
+    char* path = generation_path(log, generation);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+            0644);
+    free(path);
+    if (fd < 0) {
+        return -1;
+    }
+    char header[LOG_HEADER_SIZE];
+    uint32_t version = FORMAT_VERSION;
+    uint64_t fileGeneration = generation;
+    memcpy(header, LOG_MAGIC, 4);
+    memcpy(header + 4, &version, sizeof(uint32_t));
+    memcpy(header + 8, &fileGeneration, sizeof(uint64_t));
+    if (write_all(fd, header, LOG_HEADER_SIZE) || fdatasync(fd)) {
+        close(fd);
+        return -1;
+    }
+    if (log->fd >= 0) {
+        close(log->fd);
+    }
+    log->fd = fd;
+    log->committed = LOG_HEADER_SIZE;
+    return 0;
+}
+
+/*
+ * Writes a snapshot of every agent's counters and starts a new, empty log
+ * generation after it. The snapshot is written to a temporary file and
+ * renamed into place, so a crash leaves either the old snapshot and log or
+ * the new ones. Must be called by the single writer of the counters, with
+ * no batch pending.
+ * log - The log to compact
+ * registry - The registry to snapshot
+ * Returns 0 if the log was compacted, else returns -1
+ */
+static int compact(ResultLog* log, Registry* registry) {
+    unsigned long next = log->generation + 1;
+    int length;
+    AgentRecord* records = registry_snapshot(registry, &length);
+    uint32_t version = FORMAT_VERSION, count = length;
+    uint64_t generation = next;
+    put_bytes(log, SNAPSHOT_MAGIC, 4);
+    put_bytes(log, &version, sizeof(uint32_t));
+    put_bytes(log, &generation, sizeof(uint64_t));
+    put_bytes(log, &count, sizeof(uint32_t));
+    for (int i = 0; i < length; i++) {
+        uint32_t counters[3] = {records[i].wins, records[i].losses,
+                records[i].ties};
+        put_bytes(log, counters, sizeof(counters));
+        put_name(log, records[i].name);
+    }
+    free(records);
+    char* temporary = file_path(log, "snapshot.tmp");
+    char* snapshot = file_path(log, "snapshot");
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    int failed = fd < 0 || write_all(fd, log->buffer, log->length) ||
+            fsync(fd);
+    if (fd >= 0) {
+        close(fd);
+    }
+    log->length = 0;
+    if (!failed) {
+        failed = start_generation(log, next) || rename(temporary, snapshot);
+    }
+    free(temporary);
+    free(snapshot);
+    if (failed) {
+        return -1;
+    }
+    sync_directory(log);
+    char* old = generation_path(log, log->generation);
+    unlink(old);
+    free(old);
+    log->generation = next;
+    log->sinceSnapshot = 0;
+    log->failed = 0;
+    memset(log->logged, 0, log->loggedCapacity);
+    return 0;
+}
+
+/*
+ * Opens the results log in the given directory, creating it if needed.
+ * Every result it holds is loaded into the registry from the snapshot and
+ * the log that follows it, after which the log is compacted.
+ * log - The log to open
+ * directory - The directory holding the log
+ * registry - The empty registry to load into
+ * Returns 0 if the log was opened, else returns -1
+ */
+int results_log_open(ResultLog* log, char* directory, Registry* registry) {
+    if (mkdir(directory, 0755) && errno != EEXIST) {
+        return -1;
+    }
+    log->directory = strdup(directory);
+    log->fd = -1;
+    log->committed = 0;
+    log->failed = 0;
+    log->sinceSnapshot = 0;
+    log->loggedCapacity = 0;
+    log->logged = NULL;
+    log->bufferSize = INITIAL_BUFFER;
+    log->length = 0;
+    log->buffer = malloc(log->bufferSize);
+    log->generation = load_snapshot(log, registry);
+    replay_log(log, registry);
+    return compact(log, registry);
+}
+
+/*
+ * Adds the outcome of a match to the pending batch, preceded by the name
+ * of any agent the current log generation has not mentioned yet, so that
+ * every generation can be replayed on its own
+ * log - The log to append to
+ * registry - The registry holding the agents
+ * firstId - The id of the match's first agent
+ * secondId - The id of the match's second agent
+ * outcome - How the match ended
+ */
+void results_log_append(ResultLog* log, Registry* registry, int firstId,
+        int secondId, Outcome outcome) {
+    if (outcome == NO_OUTCOME) {
+        return;
+    }
+    uint32_t ids[2] = {firstId, secondId};
+    for (int i = 0; i < 2; i++) {
+        if ((int) ids[i] >= log->loggedCapacity) {
+            int capacity = ids[i] * 2 + 1;
+            log->logged = realloc(log->logged, capacity);
+            memset(log->logged + log->loggedCapacity, 0,
+                    capacity - log->loggedCapacity);
+            log->loggedCapacity = capacity;
+        }
+        if (!log->logged[ids[i]]) {
+            uint8_t type = NAME_RECORD;
+            put_bytes(log, &type, sizeof(uint8_t));
+            put_bytes(log, &ids[i], sizeof(uint32_t));
+            put_name(log, registry_name(registry, ids[i]));
+            log->logged[ids[i]] = 1;
+        }
+    }
+    uint8_t type = RESULT_RECORD, ending = outcome;
+    put_bytes(log, &type, sizeof(uint8_t));
+    put_bytes(log, ids, sizeof(ids));
+    put_bytes(log, &ending, sizeof(uint8_t));
+    log->sinceSnapshot++;
+}
+
+/*
+ * Drops a batch that could not be committed. The log is cut back to the
+ * end of the last committed batch, so that no torn record is left for
+ * replay to stop at or misread. The batch may have held the only record of
+ * some agents' names in this generation, so no agent counts as named any
+ * more. Its results are already in the registry, so the log is marked as
+ * failed, which forces a compaction to capture them.
+ * log - The log whose batch failed
+ */
+static void discard_batch(ResultLog* log) {
+    perror("results log");
+    if (ftruncate(log->fd, log->committed)) {
+        perror("results log truncate");
+    }
+    log->length = 0;
+    log->failed = 1;
+    memset(log->logged, 0, log->loggedCapacity);
+}
+
+/*
+ * Writes the pending batch to the log with a single write and a single
+ * flush to disk, then compacts the log if enough results have been
+ * appended since the last snapshot. Once a batch has failed, later batches
+ * are not written but left to the snapshot, and compaction is retried on
+ * every commit until it succeeds.
+ * log - The log to commit
+ * registry - The registry holding the agents
+ */
+void results_log_commit(ResultLog* log, Registry* registry) {
+    if (log->failed) {
+        log->length = 0;
+    } else if (log->length > 0) {
+        if (write_all(log->fd, log->buffer, log->length) ||
+                fdatasync(log->fd)) {
+            discard_batch(log);
+        } else {
+            log->committed += log->length;
+            log->length = 0;
+        }
+    }
+    if ((log->failed || log->sinceSnapshot >= SNAPSHOT_INTERVAL) &&
+            compact(log, registry)) {
+        perror("results snapshot");
+    }
+}
@@ -0,0 +1,36 @@
+#ifndef RESULTLOG_H
+#define RESULTLOG_H
+
+#include <sys/types.h>
+#include "registry.h"
+
+// Represents the on-disk record of every result, kept in a directory as a
+// compacted snapshot of every agent's counters plus an append-only log of
+// the results recorded since. Each snapshot names the generation of the
+// log that follows it, so a crash while compacting never replays a result
+// twice. Only the stats thread appends to the log. The log file is only
+// ever cut back to the end of its last committed batch, and a log whose
+// batch failed writes nothing more until it has been compacted.
+typedef struct {
+    char* directory;
+    int fd;
+    off_t committed;
+    int failed;
+    unsigned long generation;
+    unsigned long sinceSnapshot;
+
+    unsigned char* logged;
+    int loggedCapacity;
+
+    char* buffer;
+    int length;
+    int bufferSize;
+} ResultLog;
+
+int results_log_open(ResultLog* log, char* directory, Registry* registry);
+
+void results_log_append(ResultLog* log, Registry* registry, int firstId,
+        int secondId, Outcome outcome);
+
+void results_log_commit(ResultLog* log, Registry* registry);
+#endif
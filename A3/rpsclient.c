@@ -5,6 +5,7 @@
 #include <netdb.h>
 #include <ctype.h>
 #include "util.h"
+#include "frame.h"
 
 #define SUCCESS 0
 #define INCORRECT_ARG_NUM 1
@@ -12,6 +13,8 @@
 #define INVALID_MATCH_COUNT 3
 #define INVALID_PORT 4
 
+#define RELAY_PORT "RELAY"
+
 typedef struct {
     char* name;
     FILE* clientToServer;
@@ -20,6 +23,9 @@ typedef struct {
     int matchesDone;
     char* portLocation;
     ServerInfo serverInfo;
+    int relay;
+    int binary;
+    int negotiated;
 } GameState;
 
 typedef struct {
@@ -30,8 +36,15 @@ typedef struct {
     int gamesPlayed;
     int matchId;
     char* opponentName;
+    int relayed;
+    int agentId;
+    int opponentId;
 } MatchState;
 
+// The path of the Unix domain socket the client listens on for opponents,
+// if it has one, so that it is removed however the client exits
+static char* listenerPath = NULL;
+
 /**
  * Exits the client with the correct exit code
  * exitStatus - The exit status to return with
@@ -39,7 +52,8 @@ typedef struct {
 void exit_client(int exitStatus) {
     switch (exitStatus) {
         case INCORRECT_ARG_NUM:
-            fprintf(stderr, "%s\n", "Usage: rpsclient name matches port");
+            fprintf(stderr, "%s\n",
+                    "Usage: rpsclient name matches port [-r] [-b]");
             break;
         case INVALID_NAME:
             fprintf(stderr, "%s\n", "Invalid name");
@@ -167,11 +181,38 @@ MatchState initialise_match(int matchId, char* opponentName) {
     match.gamesLost = 0;
     match.gamesPlayed = 0;
     match.matchId = matchId;
+    match.relayed = 0;
+    match.agentId = 0;
+    match.opponentId = 0;
     match.opponentName = malloc(sizeof(char) * (strlen(opponentName) + 1));
     strcpy(match.opponentName, opponentName);
     return match;
 }
 
+/*
+ * Reports a match result to the server as a frame, naming the winner by
+ * the id the server gave it in the MATCH frame
+ * game - The client's game state
+ * match - The client's current match
+ * result - The match result
+ */
+void send_result_frame(GameState* game, MatchState* match, char* result) {
+    int winnerId = FRAME_NO_WINNER;
+    if (!strcmp(result, "WIN")) {
+        winnerId = match->agentId;
+    } else if (!strcmp(result, "LOST")) {
+        winnerId = match->opponentId;
+    } else if (!strcmp(result, "TIE")) {
+        winnerId = FRAME_TIE;
+    }
+    int length = frame_result(NULL, match->matchId, winnerId);
+    char* frame = malloc(length);
+    frame_result(frame, match->matchId, winnerId);
+    fwrite(frame, 1, length, game->clientToServer);
+    fflush(game->clientToServer);
+    free(frame);
+}
+
 /*
  * Adds a match result to the client's current state
  * game - The client's game state
@@ -187,6 +228,10 @@ void add_match_result(GameState* game, MatchState* match, char* result) {
             strlen(result));
     sprintf(game->matchResults[game->matchesDone], 
             "%d %s %s", match->matchId, match->opponentName, result);
+    if (game->binary && !match->relayed) {
+        send_result_frame(game, match, result);
+        return;
+    }
     char* serverResult;
     if (!strcmp(result, "WIN")) {
         serverResult = game->name;
@@ -201,12 +246,15 @@ void add_match_result(GameState* game, MatchState* match, char* result) {
 }
 
 /** 
- * Frees the memory allocated to the given match
+ * Frees the memory allocated to the given match. The connection of a
+ * relayed match is the server connection, which is left open.
  * match - The match to free
  */
 void free_match(MatchState* match) {
-    fclose(match->toOpponent);
-    fclose(match->fromOpponent);
+    if (!match->relayed) {
+        fclose(match->toOpponent);
+        fclose(match->fromOpponent);
+    }
 }
 
 /*
@@ -226,7 +274,120 @@ void handle_match_result(GameState* game, MatchState* match) {
 }
 
 /*
- * Plays one match 
+ * Plays the games of a match against the opponent, then reports the result
+ * game - The client's current game state
+ * match - The match, connected to the opponent directly or through the
+ * server's relay
+ * Returns 0, as every match played is reported
+ */
+int play_moves(GameState* game, MatchState* match) {
+    while ((match->gamesPlayed < 5) || (match->gamesWon == match->gamesLost
+            && match->gamesPlayed < 20)) {
+        int gameStatus = play_game(match);
+        match->gamesPlayed++;
+        if (gameStatus) {
+            add_match_result(game, match, "ERROR");
+            free_match(match);
+            return 0;
+        }   
+    }
+    handle_match_result(game, match);
+    free_match(match);
+    return 0;
+}
+
+/*
+ * Sends the client's match request, as a frame if it speaks binary frames
+ * and as a line otherwise
+ * game - The clients current game state
+ */
+void send_match_request(GameState* game) {
+    char port[12];
+    char* address = port;
+    if (game->relay) {
+        address = RELAY_PORT;
+    } else if (game->serverInfo.path != NULL) {
+        address = game->serverInfo.path;
+    } else {
+        sprintf(port, "%u", game->serverInfo.port);
+    }
+    int length = game->binary ? frame_mr(NULL, game->name, address) : -1;
+    if (length < 0) {
+        game->binary = 0;
+        fprintf(game->clientToServer, "MR:%s:%s\n", game->name, address);
+    } else {
+        char* frame = malloc(length);
+        frame_mr(frame, game->name, address);
+        fwrite(frame, 1, length, game->clientToServer);
+        free(frame);
+    }
+    fflush(game->clientToServer);
+}
+
+/*
+ * Starts a match the server has announced, connecting to the opponent
+ * directly unless the server relays the match
+ * game - The clients current game state
+ * match - The match announced
+ * opponentPort - The port of the opponent, or RELAY_PORT
+ * Returns 0, as every match started is reported
+ */
+int start_match(GameState* game, MatchState* match, char* opponentPort) {
+    if (!strcmp(opponentPort, RELAY_PORT)) {
+        match->relayed = 1;
+        match->toOpponent = game->clientToServer;
+        match->fromOpponent = game->serverToClient;
+        return play_moves(game, match);
+    }
+    int fd = connect_to_port(opponentPort);
+    if (fd == -1) {
+        add_match_result(game, match, "ERROR");
+        return 0;
+    }
+    int fromFd = accept(game->serverInfo.socketFd, 0, 0);
+    match->toOpponent = fdopen(fd, "w");
+    match->fromOpponent = fdopen(fromFd, "r");
+    return play_moves(game, match);
+}
+
+/*
+ * Plays a match the server announced in a MATCH frame. A server that
+ * refuses the request ends the client as one that closes the connection
+ * does.
+ * game - The clients current game state
+ * Returns 0 on success, 1 on match error
+ */
+int play_announced_frame(GameState* game) {
+    char* frame;
+    int length = frame_read(game->serverToClient, &frame);
+    if (length < 0) {
+        exit_client(INVALID_PORT);
+    }
+    game->negotiated = 1;
+    if (frame[1] == FRAME_REFUSED) {
+        free(frame);
+        exit_client(INVALID_PORT);
+    }
+    MatchFrame announced;
+    if (frame_read_match(frame, length, &announced)) {
+        free(frame);
+        return 1;
+    }
+    MatchState match = initialise_match(announced.matchId,
+            announced.opponentName);
+    match.agentId = announced.agentId;
+    match.opponentId = announced.opponentId;
+    int matchStatus = start_match(game, &match, announced.opponentPort);
+    free(frame);
+    return matchStatus;
+}
+
+/*
+ * Plays one match. A client that speaks binary frames falls back to text
+ * if the server drops its first match request without answering, as only
+ * a server that does not speak frames does: one that does answers every
+ * request with a frame, even one it refuses. Once the server has answered
+ * at all, the connection ending without an answer ends the client.
  * game - The clients current game state
  * Returns 0 on success, 1 on match error
  */
@@ -239,9 +400,22 @@ int play_match(GameState* game) {
         game->clientToServer = fdopen(serverfd, "w");
         game->serverToClient = fdopen(fd2, "r");
     }
-    fprintf(game->clientToServer, "MR:%s:%u\n", game->name, 
-            game->serverInfo.port);
-    fflush(game->clientToServer);
+    send_match_request(game);
+    int first = getc(game->serverToClient);
+    if (first == EOF && game->binary && !game->negotiated) {
+        fclose(game->clientToServer);
+        fclose(game->serverToClient);
+        game->binary = 0;
+        return play_match(game);
+    }
+    if (first == FRAME_MAGIC) {
+        ungetc(first, game->serverToClient);
+        return play_announced_frame(game);
+    }
+    if (first != EOF) {
+        ungetc(first, game->serverToClient);
+    }
+    game->binary = 0;
     int endOfFile = 0, length = 0;
     char* input = parse_input(game->serverToClient, &endOfFile);
     if (endOfFile) {
@@ -257,26 +431,40 @@ int play_match(GameState* game) {
     }
     MatchState match = initialise_match(atoi(splitMessage[1]), 
             splitMessage[2]);
-    int fd = connect_to_port(splitMessage[3]);
-    if (fd == -1) {
-        add_match_result(game, &match, "ERROR");
-        return 0;
+    return start_match(game, &match, splitMessage[3]);
+}
+
+/*
+ * Removes the Unix domain socket the client listens on for opponents
+ */
+void remove_listener(void) {
+    unlink(listenerPath);
+}
+
+/*
+ * Creates the listener opponents connect to. A client that reaches the
+ * server through a Unix domain socket listens on one too, named after the
+ * server's path and the client's process id, so co-located clients play
+ * each other without TCP as well.
+ * game - The clients current game state
+ * Returns 0 if the listener was created, else returns -1
+ */
+int create_opponent_listener(GameState* game) {
+    if (!is_unix_address(game->portLocation)) {
+        return create_listener(&game->serverInfo);
     }
-    int fromFd = accept(game->serverInfo.socketFd, 0, 0);
-    match.toOpponent = fdopen(fd, "w");
-    match.fromOpponent = fdopen(fromFd, "r");
-    while ((match.gamesPlayed < 5) || (match.gamesWon == match.gamesLost && 
-            match.gamesPlayed < 20)) {
-        int gameStatus = play_game(&match);
-        match.gamesPlayed++;
-        if (gameStatus) {
-            add_match_result(game, &match, "ERROR");
-            free_match(&match);
-            return 0;
-        }   
+    if (strchr(game->portLocation, ':') != NULL) {
+        return -1;
     }
-    handle_match_result(game, &match);
-    free_match(&match);
+    char* path = malloc(strlen(game->portLocation) +
+            integer_digits(getpid()) + 2);
+    sprintf(path, "%s.%d", game->portLocation, getpid());
+    if (create_port_listener(&game->serverInfo, path, 0)) {
+        free(path);
+        return -1;
+    }
+    listenerPath = path;
+    atexit(remove_listener);
     return 0;
 }
 
@@ -284,9 +472,21 @@ int main(int argc, char* argv[]) {
     GameState game;
     game.matchResults = malloc(sizeof(char*));
     game.matchesDone = 0;
-    if (argc != 4) {
+    if (argc < 4 || argc > 6) {
         exit_client(INCORRECT_ARG_NUM);
     }
+    game.relay = 0;
+    game.binary = 0;
+    game.negotiated = 0;
+    for (int i = 4; i < argc; i++) {
+        if (!strcmp(argv[i], "-r") && !game.relay) {
+            game.relay = 1;
+        } else if (!strcmp(argv[i], "-b") && !game.binary) {
+            game.binary = 1;
+        } else {
+            exit_client(INCORRECT_ARG_NUM);
+        }
+    }
     if (validate_name(argv[1]) != NULL) {
         game.name = argv[1];
     } else {
@@ -298,8 +498,7 @@ int main(int argc, char* argv[]) {
         exit_client(INVALID_MATCH_COUNT);
     }
     game.portLocation = argv[3];
-    int exitStatus = create_listener(&game.serverInfo);
-    if (exitStatus == -1) {
+    if (!game.relay && create_opponent_listener(&game) == -1) {
         exit_client(INVALID_PORT);
     }
     int seed = 0;
@@ -6,57 +6,64 @@
 #include <ctype.h>
 #include <signal.h>
 #include <pthread.h>
+#include <sys/socket.h>
 #include <semaphore.h>
 #include "util.h"
+#include "server.h"
 
 #define INCORRECT_ARG_NUM 1
+#define LOG_ERROR 2
+#define METRICS_ERROR 3
+#define LISTEN_ERROR 4
+#define FEED_ERROR 5
 
-typedef struct {
-    char* name;
-    int wins;
-    int losses;
-    int ties;
-} Agent;
-
-typedef struct {
-    int matchId;
-
-    Agent* agentOne;
-    char* agent1Port;
-    char* agent1Name;
-    char* agent1Result;
-    FILE* agent1serverToClient;
-    FILE* agent1clientToServer;
-
-    Agent* agentTwo;
-    char* agent2Port;
-    char* agent2Name;
-    char* agent2Result;
-    FILE* agent2serverToClient;
-    FILE* agent2clientToServer;
+// Threaded mode only holds a worker while a client has input to handle:
+// clients waiting for their match request or result are parked. Relayed
+// agents, the single pairing waiter and clients that have sent a query
+// but not yet a match request still keep one each, so -w caps how many
+// of those can be served at once; the rest queue for a worker.
+#define DEFAULT_WORKERS 512
+#define MIN_WORKERS 2
+#define MAX_ACCEPTORS 64
 
-    int twoPlayers;
-} Match;
-
-typedef struct {
-    Agent** agents;
-    int numberOfAgents; 
-    int matchId;
-    ServerInfo serverInfo;
-
-    Match* currentMatch;
-    sem_t* serverGuard;
-} ServerState;
+#define DEFAULT_MR_TIMEOUT 30
+#define DEFAULT_PAIRING_TIMEOUT 600
+#define DEFAULT_RESULT_TIMEOUT 300
 
 typedef struct {
     Match* match;
     ServerState* server;
     int clientFd;
     int agentNumber;
-    int twoPlayers;
+    int shard;
+    unsigned long acceptedAt;
+    Timer timer;
+} Thread;
 
+// Represents a thread accepting clients on its own listener, and the shard
+// whose pairing queue those clients join first
+typedef struct {
+    ServerState* server;
+    int shard;
+    int listenFd;
     pthread_t threadId;
-} Thread;
+} Acceptor;
+
+// Represents the options the server was started with
+typedef struct {
+    int eventLoops;
+    int uring;
+    int coroutines;
+    int workers;
+    int acceptors;
+    int processes;
+    int timeouts[TIMER_PHASES];
+    char* logDirectory;
+    char* metricsPort;
+    char* feedPort;
+    char* address;
+    int relay;
+} ServerOptions;
 
 /* 
  * Initialises a sempahore
@@ -66,6 +73,7 @@ void init_lock(sem_t* l) {
     sem_init(l, 0, 1);
 }
 
+#ifndef LOCK_STATS
 /* 
  * Takes a semaphore
  * l - The pointer to the semaphore to take
@@ -81,6 +89,7 @@ void take_lock(sem_t* l) {
 void release_lock(sem_t* l) {
     sem_post(l);
 }
+#endif
 
 /*
  * Exits the server with the correct exit code
@@ -89,7 +98,24 @@ void release_lock(sem_t* l) {
 void exit_server(int exitStatus) {
     switch (exitStatus) {
         case INCORRECT_ARG_NUM:
-            fprintf(stderr, "%s\n", "Usage: rpsserver");
+            fprintf(stderr, "%s\n",
+                    "Usage: rpsserver "
+                    "[-e loops | -u | -c schedulers | -a acceptors | "
+                    "-f processes] "
+                    "[-w workers] [-t mr:pairing:result] [-l directory] "
+                    "[-m port] [-s port] [-p address] [-r]");
+            break;
+        case LOG_ERROR:
+            fprintf(stderr, "%s\n", "Unable to open results log");
+            break;
+        case METRICS_ERROR:
+            fprintf(stderr, "%s\n", "Unable to listen for metrics");
+            break;
+        case LISTEN_ERROR:
+            fprintf(stderr, "%s\n", "Unable to listen for clients");
+            break;
+        case FEED_ERROR:
+            fprintf(stderr, "%s\n", "Unable to listen for subscribers");
             break;
     }
     exit(exitStatus);
@@ -118,190 +144,723 @@ int validate_match_request(char** input, int length) {
 }
 
 /*
- * Initialises a new agent
+ * Parses a match request sent either as a line or as a frame. The name
+ * and port of a frame point into the frame itself.
+ * message - The request, which must be zero terminated if it is a line
+ * length - The length of the request
+ * request - Filled in with the request, which must be freed with
+ * free_match_request even if it is invalid
+ * Returns 1 if invalid else returns 0
+ */
+int parse_match_request(char* message, int length, MatchRequest* request) {
+    request->binary = is_frame(message, length);
+    request->frame = NULL;
+    request->splitMessage = NULL;
+    request->length = 0;
+    if (request->binary) {
+        return frame_read_mr(message, length, &request->name,
+                &request->port) || validate_name(request->name) == NULL;
+    }
+    if (length > FRAME_MAX_REQUEST) {
+        return 1;
+    }
+    request->splitMessage = split_string(message, &request->length, ':');
+    if (validate_match_request(request->splitMessage, request->length)) {
+        return 1;
+    }
+    request->name = request->splitMessage[1];
+    request->port = request->splitMessage[2];
+    return 0;
+}
+
+/*
+ * Reads a message from a client's stream, which is a frame if its first
+ * byte is FRAME_MAGIC and a line otherwise
+ * stream - The stream to read from
+ * length - Set to the length of the message
+ * endOfFile - A pointer that is modified to 1 when EOF is reached
+ * Returns the message, which the caller must free. A line is zero
+ * terminated and trimmed, as parse_input returns it.
+ */
+char* read_message(FILE* stream, int* length, int* endOfFile) {
+    int first = getc(stream);
+    if (first != EOF) {
+        ungetc(first, stream);
+    }
+    if (first == FRAME_MAGIC) {
+        char* frame;
+        if ((*length = frame_read(stream, &frame)) >= 0) {
+            return frame;
+        }
+        *endOfFile = 1;
+        *length = 0;
+        return strdup("");
+    }
+    char* line = parse_input(stream, endOfFile);
+    *length = strlen(line);
+    return line;
+}
+
+/*
+ * Formats one agent's record as a line of a query's answer
+ * output - The stream to format the line to
+ * record - The record to format
+ */
+static void format_record(FILE* output, AgentRecord* record) {
+    fprintf(output, "STATS:%s:%d:%d:%d\n", record->name, record->wins,
+            record->losses, record->ties);
+}
+
+/*
+ * Answers a query a client sends in place of its match request, reading
+ * the registry without taking the server guard. STATS:<name> is answered
+ * with STATS:<name>:<wins>:<losses>:<ties>, or UNKNOWN:<name> if the agent
+ * has never been seen. TOP:<k> is answered with TOP:<n> and then the STATS
+ * lines of the n agents with the most wins, best first, where n is at most
+ * k and TOP_SIZE.
  * server - The current state of the server
- * name - the name of the new agent
- * Returns a pointer to the new agent
+ * message - The message, which must be zero terminated if it is a line
+ * length - The length of the message
+ * replyLength - Set to the length of the answer
+ * Returns the answer, which the caller must free, or NULL if the message
+ * is not a query
+ */
+char* answer_query(ServerState* server, char* message, int length,
+        int* replyLength) {
+    if (is_frame(message, length) || length > FRAME_MAX_REQUEST) {
+        return NULL;
+    }
+    int parts;
+    char** query = split_string(message, &parts, ':');
+    char* reply = NULL;
+    size_t size;
+    if (parts == 2) {
+        strtrim(query[0]);
+        strtrim(query[1]);
+        char* buffer;
+        int k = strtol(query[1], &buffer, 10);
+        if (!strcmp("STATS", query[0])) {
+            FILE* output = open_memstream(&reply, &size);
+            AgentRecord* record = registry_stats(&server->registry,
+                    query[1]);
+            if (record != NULL) {
+                format_record(output, record);
+            } else {
+                fprintf(output, "UNKNOWN:%s\n", query[1]);
+            }
+            free(record);
+            fclose(output);
+        } else if (!strcmp("TOP", query[0]) && *query[1] && !*buffer &&
+                k > 0) {
+            FILE* output = open_memstream(&reply, &size);
+            AgentRecord* records = registry_top(&server->registry, k,
+                    &length);
+            fprintf(output, "TOP:%d\n", length);
+            for (int i = 0; i < length; i++) {
+                format_record(output, &records[i]);
+            }
+            free(records);
+            fclose(output);
+        }
+    }
+    free_split_string(query, parts);
+    *replyLength = reply != NULL ? size : 0;
+    return reply;
+}
+
+/*
+ * Frees the storage held by a match request
+ * request - The request to free
+ */
+void free_match_request(MatchRequest* request) {
+    free(request->frame);
+    if (request->splitMessage != NULL) {
+        free_split_string(request->splitMessage, request->length);
+    }
+}
+
+/*
+ * Refuses a match request that will not be matched. A request sent as a
+ * frame is answered with a REFUSED frame, so the client knows the server
+ * speaks frames, while one sent as a line is refused by closing alone.
+ * serverToClient - The stream to the client
+ * binary - Whether the request was sent as a frame
  */
-Agent* new_agent(ServerState* server, char* name) {
-    server->numberOfAgents++;
-    server->agents = realloc(server->agents, sizeof(Agent*) * 
-            server->numberOfAgents);
-    Agent* agent = malloc(sizeof(Agent));
-    agent->name = name;
-    agent->wins = 0;
-    agent->losses = 0;
-    agent->ties = 0;
-    server->agents[server->numberOfAgents - 1] = agent;
-    return agent;
+void refuse_request(FILE* serverToClient, int binary) {
+    if (binary) {
+        char refusal[FRAME_HEADER_LENGTH];
+        fwrite(refusal, 1, frame_refused(refusal), serverToClient);
+    }
 }
 
 /*
  * Initialises a new match
  * matchId - the id of the match
- * agent1Name - the name of the first agent in the match
+ * agent1Id - the id of the first agent in the match
  * agent1Port - the port of the first agent in the match
  * Returns a pointer to the new match
  */
-Match* new_match(int matchId, char* agent1Name, char* agent1Port) {
-    Match* match = malloc(sizeof(Match));
+Match* new_match(int matchId, int agent1Id, char* agent1Port) {
+    Arena* arena = arena_create();
+    Match* match = arena_alloc(arena, sizeof(Match));
+    match->arena = arena;
     match->matchId = matchId;
-    match->agent1Name = malloc(strlen(agent1Name) + 1);
-    strcpy(match->agent1Name, agent1Name);
-    match->agent1Port = malloc(strlen(agent1Port) + 1);
-    strcpy(match->agent1Port, agent1Port);
+    match->agent1Id = agent1Id;
+    match->agent1Port = arena_strdup(arena, agent1Port);
+    match->agent2Id = NO_AGENT;
+    match->agent2Port = NULL;
     match->agent1Result = NULL;
     match->agent2Result = NULL;
+    match->agent1Claim = NO_OUTCOME;
+    match->agent2Claim = NO_OUTCOME;
+    match->agent1Binary = 0;
+    match->agent2Binary = 0;
+    match->resultsReported = 0;
+    match->agent1Session = NULL;
+    match->agent2Session = NULL;
+    match->agent1Coroutine = NULL;
+    match->agent2Coroutine = NULL;
+    match->relay = NULL;
     return match;
 }
 
-/* Validates the result messages sent by the clients
+/*
+ * Frees a match once neither of its agents refers to it, along with
+ * everything allocated during its life
+ * match - The match to free
+ */
+void free_match(Match* match) {
+    if (match->relay != NULL) {
+        relay_destroy(match->relay);
+    }
+    arena_destroy(match->arena);
+}
+
+/*
+ * Finds the winner named by a RESULT line that has been split at colons
+ * splitMessage - The parts of the line, which are trimmed
+ * length - The number of parts
+ * matchId - The id of the match the agent played
+ * Returns the winner named, which is TIE for a tie, or NULL if the line is
+ * not a valid result for the match
+ */
+char* result_winner(char** splitMessage, int length, int matchId) {
+    if (length != 3) {
+        return NULL;
+    }
+    for (int i = 0; i < length; i++) {
+        strtrim(splitMessage[i]);
+    }
+    char* buffer;
+    int claimedMatchId = strtol(splitMessage[1], &buffer, 10);
+    if (strcmp("RESULT", splitMessage[0]) || *buffer ||
+            claimedMatchId != matchId) {
+        return NULL;
+    }
+    return splitMessage[2];
+}
+
+/*
+ * Works out which side of a match the winner an agent claims is
+ * winnerId - The id of the agent claimed to have won
+ * agent1Id - The id of the match's first agent
+ * agent2Id - The id of the match's second agent
+ * Returns the outcome claimed, or NO_OUTCOME if the winner played in
+ * neither side
+ */
+Outcome winner_claim(int winnerId, int agent1Id, int agent2Id) {
+    if (winnerId == agent1Id) {
+        return FIRST_WON;
+    } else if (winnerId == agent2Id) {
+        return SECOND_WON;
+    }
+    return NO_OUTCOME;
+}
+
+/*
+ * Works out the outcome one agent's result line claims. The line is split
+ * in the match's arena and the winner it names is resolved to an id.
+ * server - The current state of the server
+ * match - The match the agent played
+ * result - The result line sent by the agent
+ * Returns the outcome claimed, or NO_OUTCOME if the result is invalid
+ */
+Outcome result_claim(ServerState* server, Match* match, char* result) {
+    int length;
+    char** splitMessage = arena_split_string(match->arena, result, &length,
+            ':');
+    char* winner = result_winner(splitMessage, length, match->matchId);
+    if (winner == NULL) {
+        return NO_OUTCOME;
+    } else if (!strcmp("TIE", winner)) {
+        return TIED;
+    }
+    return winner_claim(registry_lookup(&server->registry, winner),
+            match->agent1Id, match->agent2Id);
+}
+
+/*
+ * Works out the outcome one agent's result frame claims
+ * frame - The result frame sent by the agent
+ * length - The length of the frame
+ * matchId - The id of the match the agent played
+ * agent1Id - The id of the match's first agent
+ * agent2Id - The id of the match's second agent
+ * Returns the outcome claimed, or NO_OUTCOME if the result is invalid
+ */
+Outcome frame_claim(char* frame, int length, int matchId, int agent1Id,
+        int agent2Id) {
+    int claimedMatchId, winnerId;
+    if (frame_read_result(frame, length, &claimedMatchId, &winnerId) ||
+            claimedMatchId != matchId) {
+        return NO_OUTCOME;
+    } else if (winnerId == FRAME_TIE) {
+        return TIED;
+    }
+    return winner_claim(winnerId, agent1Id, agent2Id);
+}
+
+/*
+ * Keeps the result an agent sent for the stats thread to validate. A
+ * result frame is decoded into the outcome it claims at once, while a
+ * result line is copied into the match's arena as it was sent.
+ * match - The match the agent played
+ * agentNumber - The position of the agent in the match
+ * message - The result sent by the agent
+ * length - The length of the result
+ */
+void store_result(Match* match, int agentNumber, char* message, int length) {
+    if (is_frame(message, length)) {
+        Outcome claim = frame_claim(message, length, match->matchId,
+                match->agent1Id, match->agent2Id);
+        if (agentNumber == 1) {
+            match->agent1Claim = claim;
+        } else {
+            match->agent2Claim = claim;
+        }
+        return;
+    }
+    char* result = arena_alloc(match->arena, length + 1);
+    memcpy(result, message, length);
+    result[length] = '\0';
+    strtrim(result);
+    if (agentNumber == 1) {
+        match->agent1Result = result;
+    } else {
+        match->agent2Result = result;
+    }
+}
+
+/* Validates the results sent by the clients and works out how the match
+ * ended. An agent with no result line reported a frame, whose claim was
+ * kept instead. Only the stats thread calls this.
  * server - The current state of the server
- * agent1Result - The result message sent by the first agent
- * agent2Result - The result message sent by the second agent
+ * agent1Result - The result line sent by the first agent, or NULL
+ * agent2Result - The result line sent by the second agent, or NULL
  * match - The match participated in by the two agents
+ * Returns the outcome both clients agree on, or NO_OUTCOME if they do not
+ * agree or either result is invalid
  */
-void validate_results(ServerState* server, char* agent1Result, 
+Outcome validate_results(ServerState* server, char* agent1Result, 
         char* agent2Result, Match* match) {
-    int length1, length2;
-    char** splitMessage1 = split_string(agent1Result, &length1, ':');
-    char** splitMessage2 = split_string(agent2Result, &length2, ':');
-    if (length1 != 3 || length2 != 3) {
-        return;
+    Outcome claim1 = agent1Result == NULL ? match->agent1Claim :
+            result_claim(server, match, agent1Result);
+    Outcome claim2 = agent2Result == NULL ? match->agent2Claim :
+            result_claim(server, match, agent2Result);
+    return claim1 == claim2 ? claim1 : NO_OUTCOME;
+}
+
+/*
+ * Reclaims a client whose deadline has passed while its worker is blocked
+ * reading from it, by shutting the connection down so that the read ends
+ * timer - The timer of the client's worker
+ * Returns 1, as the client is always reclaimed
+ */
+int expire_connection(Timer* timer) {
+    shutdown(((Thread*) timer->data)->clientFd, SHUT_RDWR);
+    return 1;
+}
+
+/*
+ * Reclaims a client that has waited too long for a partner by withdrawing
+ * its ticket, which wakes its worker
+ * timer - The timer of the client's worker
+ * Returns 1 if the client was still waiting, else returns 0
+ */
+int expire_ticket(Timer* timer) {
+    return pairing_expire((PairingTicket*) timer->data);
+}
+
+/*
+ * Writes a line to a client's stream
+ * peer - The stream to the client
+ * line - The line to write
+ */
+void send_to_stream(void* peer, char* line) {
+    fputs(line, (FILE*) peer);
+    fflush((FILE*) peer);
+}
+
+/*
+ * Writes MATCH to one agent of a match, in the encoding it asked in
+ * server - The current state of the server
+ * match - The match to announce
+ * agentNumber - The position in the match of the agent to write to
+ */
+void send_match(ServerState* server, Match* match, int agentNumber) {
+    FILE* serverToClient = agentNumber == 1 ? match->agent1serverToClient :
+            match->agent2serverToClient;
+    int length;
+    char* message = format_match(server, match, agentNumber, &length);
+    fwrite(message, 1, length, serverToClient);
+    fflush(serverToClient);
+    match_sent(match, agentNumber);
+}
+
+/*
+ * Writes MATCH to both clients of a relayed match before either is
+ * released to play, so that neither can be relayed a move before its own
+ * MATCH
+ * server - The current state of the server
+ * match - The relayed match
+ */
+void send_relayed_match(ServerState* server, Match* match) {
+    send_match(server, match, 1);
+    send_match(server, match, 2);
+}
+
+/*
+ * Relays the moves of this thread's agent to its opponent until the agent
+ * sends anything else, which is taken as its result
+ * match - The relayed match
+ * agentNumber - The position of this thread's agent in the match
+ * fromClient - The stream from this thread's agent
+ * toOpponent - The stream to its opponent
+ * Returns the agent's result, allocated in the match's arena
+ */
+char* relay_moves(Match* match, int agentNumber, FILE* fromClient,
+        FILE* toOpponent) {
+    int endOfFile = 0;
+    char* line;
+    while (line = parse_input(fromClient, &endOfFile),
+            !endOfFile && relay_is_move(line)) {
+        relay_forward(match->relay, agentNumber, line, send_to_stream,
+                toOpponent);
+        free(line);
     }
-    for (int i = 0; i < length1; i++) {
-        strtrim(splitMessage1[i]);
-        strtrim(splitMessage2[i]);
+    char* result = arena_strdup(match->arena, line);
+    free(line);
+    relay_leave(match->relay, agentNumber, send_to_stream, toOpponent);
+    return result;
+}
+
+/*
+ * Finishes with a client that has been handled
+ * threaded - The struct encapsulating the information needed by the
+ * worker, which is freed
+ */
+void release_client(Thread* threaded) {
+    metrics_count(METRIC_CLOSED);
+    free(threaded);
+}
+
+/*
+ * Ends this thread's agent's part in its match, once its result has been
+ * read, and hands the match to the stats thread if the other agent has
+ * already reported
+ * threaded - The struct encapsulating the information needed by the
+ * worker, which is freed
+ */
+void finish_agent(Thread* threaded) {
+    ServerState* server = threaded->server;
+    Match* match = threaded->match;
+    timer_cancel(&server->timers, &threaded->timer);
+    release_client(threaded);
+    if (__atomic_add_fetch(&match->resultsReported, 1,
+            __ATOMIC_ACQ_REL) == 2) {
+        fclose(match->agent1serverToClient);
+        fclose(match->agent1clientToServer);
+        fclose(match->agent2serverToClient);
+        fclose(match->agent2clientToServer);
+        submit_results(server, match);
     }
-    if (strcmp("RESULT", splitMessage1[0]) || 
-            strcmp("RESULT", splitMessage2[0])) {
+}
+
+/*
+ * Reads the result of an agent whose socket has become readable, on a
+ * pool worker
+ * threadData - The struct encapsulating the information needed by the
+ * worker, which is freed
+ */
+void read_agent_result(void* threadData) {
+    Thread* threaded = (Thread*) threadData;
+    Match* match = threaded->match;
+    int endOfFile = 0, length;
+    char* result = read_message(threaded->agentNumber == 1 ?
+            match->agent1clientToServer : match->agent2clientToServer,
+            &length, &endOfFile);
+    store_result(match, threaded->agentNumber, result, length);
+    free(result);
+    finish_agent(threaded);
+}
+
+/*
+ * Sends the MATCH line to this thread's agent, unless the match is
+ * relayed and it has already been sent, then has its result read. A
+ * relayed agent keeps its worker, which forwards its moves as they come;
+ * any other agent gives its worker back and is parked until its result
+ * can be read.
+ * threaded - Pointer to the thread struct encapsulating this thread's
+ * information, which is freed once the agent has reported
+ */
+void handle_agent(Thread* threaded) {
+    ServerState* server = threaded->server;
+    Match* match = threaded->match;
+    init_timer(&threaded->timer, expire_connection, (void*) threaded);
+    timer_arm(&server->timers, &threaded->timer, TIMER_RESULT);
+    if (match->relay != NULL && threaded->agentNumber == 1) {
+        match->agent1Result = relay_moves(match, 1,
+                match->agent1clientToServer, match->agent2serverToClient);
+    } else if (match->relay != NULL) {
+        match->agent2Result = relay_moves(match, 2,
+                match->agent2clientToServer, match->agent1serverToClient);
+    } else {
+        send_match(server, match, threaded->agentNumber);
+        pool_submit_when_readable(server->pool, fileno(
+                threaded->agentNumber == 1 ? match->agent1clientToServer :
+                match->agent2clientToServer), read_agent_result,
+                (void*) threaded);
         return;
     }
-    char* buffer1;
-    char* buffer2;
-    int matchId1 = strtol(splitMessage1[1], &buffer1, 10);
-    int matchId2 = strtol(splitMessage2[1], &buffer2, 10);
-    if (matchId1 != match->matchId || matchId2 != match->matchId 
-            || *buffer1 || *buffer2) {
-        return;
+    finish_agent(threaded);
+}
+
+/*
+ * Formats the MATCH sent to one agent of a match, naming its opponent. An
+ * agent that asked in a frame is answered with a frame, which also carries
+ * both agents' ids so that it can report its result by id.
+ * server - The current state of the server
+ * match - The match to announce
+ * agentNumber - The position in the match of the agent the MATCH is for
+ * length - Set to the length of the MATCH
+ * Returns the MATCH, allocated in the match's arena
+ */
+char* format_match(ServerState* server, Match* match, int agentNumber,
+        int* length) {
+    int opponentId = agentNumber == 1 ? match->agent2Id : match->agent1Id;
+    char* opponentPort = agentNumber == 1 ? match->agent2Port :
+            match->agent1Port;
+    if (match->relay != NULL) {
+        opponentPort = RELAY_PORT;
     }
-    if (!strcmp("TIE", splitMessage1[2]) && !strcmp("TIE", splitMessage2[2])) {
-        match->agentOne->ties++;
-        match->agentTwo->ties++;
-    } else if (!strcmp(match->agentOne->name, splitMessage1[2]) && 
-            !strcmp(match->agentOne->name, splitMessage2[2])) {
-        match->agentOne->wins++;
-        match->agentTwo->losses++;
-    } else if (!strcmp(match->agentTwo->name, splitMessage1[2]) && 
-            !strcmp(match->agentTwo->name, splitMessage2[2])) {
-        match->agentOne->losses++;
-        match->agentTwo->wins++;
+    char* opponentName = registry_name(&server->registry, opponentId);
+    if (agentNumber == 1 ? match->agent1Binary : match->agent2Binary) {
+        MatchFrame frame = {match->matchId,
+                agentNumber == 1 ? match->agent1Id : match->agent2Id,
+                opponentId, opponentName, opponentPort};
+        *length = frame_match(NULL, &frame);
+        char* message = arena_alloc(match->arena, *length);
+        frame_match(message, &frame);
+        return message;
+    }
+    char* message = arena_alloc(match->arena, strlen("MATCH:::\n") +
+            integer_digits(match->matchId) + strlen(opponentName) +
+            strlen(opponentPort) + 1);
+    *length = sprintf(message, "MATCH:%d:%s:%s\n", match->matchId,
+            opponentName, opponentPort);
+    return message;
+}
+
+/*
+ * Notes the time the MATCH line was written to one of a match's agents
+ * match - The match
+ * agentNumber - The position in the match of the agent written to
+ */
+void match_sent(Match* match, int agentNumber) {
+    if (agentNumber == 1) {
+        match->agent1SentAt = metrics_now();
+    } else {
+        match->agent2SentAt = metrics_now();
     }
 }
 
 /*
- * Handles waiting for input from each agent in a thread
- * thread - Pointer to the thread struct encapsulating this thread's 
- * information
+ * Builds the match formed by pairing two waiting clients, under the next
+ * match id. The match is relayed if the server relays every match or
+ * either client asked to be relayed by sending RELAY as its port. The
+ * partner has already been taken from its queue, so no lock is needed.
+ * server - The current state of the server
+ * first - The ticket of the client that waited, which plays as agent one
+ * second - The ticket of the client that completed the pair
+ * Returns a pointer to the new match
  */
-void* handle_agent(void* thread) {
-    Thread* threaded = (Thread*) thread;
+Match* pair_tickets(ServerState* server, PairingTicket* first,
+        PairingTicket* second) {
+    return build_match(server, __atomic_add_fetch(&server->matchId, 1,
+            __ATOMIC_RELAXED), first, second);
+}
+
+/*
+ * Builds a match as pair_tickets does, under a match id the caller has
+ * already reserved, such as one of a block reserved for a whole wave
+ * server - The current state of the server
+ * matchId - The reserved id of the match
+ * first - The ticket of the client that plays as agent one
+ * second - The ticket of the client that plays as agent two
+ * Returns a pointer to the new match
+ */
+Match* build_match(ServerState* server, int matchId, PairingTicket* first,
+        PairingTicket* second) {
+    Match* match = new_match(matchId, first->agentId, first->port);
+    match->agent1serverToClient = first->serverToClient;
+    match->agent1clientToServer = first->clientToServer;
+    match->agent1Session = first->session;
+    match->agent1Coroutine = first->coroutine;
+    match->agent1Binary = first->binary;
+    match->agent2Id = second->agentId;
+    match->agent2Port = arena_strdup(match->arena, second->port);
+    match->agent2serverToClient = second->serverToClient;
+    match->agent2clientToServer = second->clientToServer;
+    match->agent2Session = second->session;
+    match->agent2Coroutine = second->coroutine;
+    match->agent2Binary = second->binary;
+    match->twoPlayers = 1;
+    match->pairedAt = metrics_now();
+    if (server->relay || !strcmp(first->port, RELAY_PORT) ||
+            !strcmp(second->port, RELAY_PORT)) {
+        match->relay = arena_alloc(match->arena, sizeof(Relay));
+        relay_init(match->relay);
+    }
+    return match;
+}
+
+/*
+ * Reads the first message from a client that is not a query, answering
+ * every query sent before it. Each message must arrive before the match
+ * request deadline, which restarts after every answer.
+ * threaded - The struct encapsulating the information needed by the
+ * worker
+ * serverToClient - The stream to answer queries on
+ * clientToServer - The stream to read from
+ * length - Set to the length of the message
+ * endOfFile - A pointer that is modified to 1 when EOF is reached
+ * Returns the message, which the caller must free
+ */
+char* read_request(Thread* threaded, FILE* serverToClient,
+        FILE* clientToServer, int* length, int* endOfFile) {
     ServerState* server = threaded->server;
-    Match* match = threaded->match;
     while (1) {
-        if (match->twoPlayers) {
-            if (threaded->agentNumber == 1) {
-                take_lock(server->serverGuard);
-                fprintf(match->agent1serverToClient, "MATCH:%d:%s:%s\n", 
-                        match->matchId, match->agent2Name, match->agent2Port);
-                fflush(match->agent1serverToClient);
-                release_lock(server->serverGuard);
-                int endOfFile = 0;
-                match->agent1Result = 
-                        parse_input(match->agent1clientToServer, 
-                        &endOfFile);
-            } else {
-                take_lock(server->serverGuard);
-                fprintf(match->agent2serverToClient, "MATCH:%d:%s:%s\n", 
-                        match->matchId, match->agent1Name, match->agent1Port);
-                fflush(match->agent2serverToClient);
-                release_lock(server->serverGuard);
-                int endOfFile = 0;
-                match->agent2Result = parse_input(match->agent2clientToServer, 
-                        &endOfFile);
-            }
-            if (match->agent1Result != NULL && match->agent2Result != NULL) {
-                take_lock(server->serverGuard);
-                validate_results(server, match->agent1Result, 
-                        match->agent2Result, match); 
-                fclose(match->agent1serverToClient);
-                fclose(match->agent1clientToServer);
-                fclose(match->agent2serverToClient);
-                fclose(match->agent2clientToServer);
-                release_lock(server->serverGuard);
-            }
-            pthread_exit((void*) NULL);
+        init_timer(&threaded->timer, expire_connection, (void*) threaded);
+        timer_arm(&server->timers, &threaded->timer, TIMER_MR);
+        char* message = read_message(clientToServer, length, endOfFile);
+        timer_cancel(&server->timers, &threaded->timer);
+        int replyLength;
+        char* reply = *endOfFile ? NULL :
+                answer_query(server, message, *length, &replyLength);
+        if (reply == NULL) {
+            return message;
         }
+        fwrite(reply, 1, replyLength, serverToClient);
+        fflush(serverToClient);
+        free(reply);
+        free(message);
     }
 }
 
 /*
- * Handles initialising a new client and creates a new thread to handle the 
- * client 
- * threadData - The struct encapsulating the information needed by the struct
+ * Reads a client's match request, then either pairs it with the longest
+ * waiting client or parks it until a partner arrives. Only one client can
+ * be parked at a time, so a pool with at least two workers always has a
+ * worker free to complete the pair.
+ * threaded - The struct encapsulating the information needed by the
+ * worker, which is freed once the client has been handled
  */
-void new_client(Thread* threadData) {
-    Thread* threaded = (Thread*) threadData;
+void handle_client(Thread* threaded) {
+    ServerState* server = threaded->server;
     int fd2 = dup(threaded->clientFd);
     FILE* serverToClient = fdopen(threaded->clientFd, "w");
     FILE* clientToServer = fdopen(fd2, "r");
-    int endOfFile = 0, length = 0, agentExists = 0;
-    char* input = parse_input(clientToServer, &endOfFile);
-    char** splitMessage = split_string(input, &length, ':');
-    int matchStatus = validate_match_request(splitMessage, length);
+    int endOfFile = 0, length;
+    MatchRequest request;
+    char* message = read_request(threaded, serverToClient, clientToServer,
+            &length, &endOfFile);
+    int matchStatus = parse_match_request(message, length, &request);
+    if (request.binary) {
+        request.frame = message;
+    } else {
+        free(message);
+    }
+    if (!endOfFile) {
+        metrics_record_phase(PHASE_MR,
+                metrics_now() - threaded->acceptedAt);
+    }
     if (matchStatus || endOfFile) {
+        refuse_request(serverToClient, request.binary && !endOfFile);
+        free_match_request(&request);
         fclose(serverToClient);
         fclose(clientToServer);
-        release_lock(threaded->server->serverGuard);
+        release_client(threaded);
         return;
     }
-    Agent* agent;
-    for (int i = 0; i < threaded->server->numberOfAgents; i++) {
-        if (!strcmp(splitMessage[1], threaded->server->agents[i]->name)) {
-            agent = threaded->server->agents[i];
-            agentExists = 1;
-        }
+    PairingTicket ticket;
+    int agentId = registry_intern(&server->registry, request.name);
+    if (agentId == NO_AGENT) {
+        refuse_request(serverToClient, request.binary);
+        free_match_request(&request);
+        fclose(serverToClient);
+        fclose(clientToServer);
+        release_client(threaded);
+        return;
+    }
+    init_ticket(&ticket, agentId, request.port);
+    ticket.binary = request.binary;
+    ticket.serverToClient = serverToClient;
+    ticket.clientToServer = clientToServer;
+    PairingTicket* partner = pairing_join(server->shards,
+            server->numberOfShards, threaded->shard, &ticket);
+    if (partner != NULL) {
+        threaded->match = pair_tickets(server, partner, &ticket);
     }
-    if (!agentExists) {
-        agent = new_agent(threaded->server, splitMessage[1]);
-    }
-    if (threaded->agentNumber == 2) {
-        threaded->match->agentTwo = agent;
-        threaded->match->agent2Name = splitMessage[1];
-        threaded->match->agent2Port = splitMessage[2];
-        threaded->match->agent2serverToClient = serverToClient;
-        threaded->match->agent2clientToServer = clientToServer;
-        threaded->server->currentMatch = NULL;
-        threaded->match->twoPlayers = 1;
+    if (partner != NULL) {
+        threaded->agentNumber = 2;
+        if (threaded->match->relay != NULL) {
+            send_relayed_match(server, threaded->match);
+        }
+        pairing_complete(partner, threaded->match);
     } else {
-        threaded->match = new_match(threaded->server->matchId,
-                splitMessage[1], splitMessage[2]);
-        threaded->match->twoPlayers = 0;
-        threaded->match->agentOne = agent;
-        threaded->match->agent1serverToClient = serverToClient;
-        threaded->match->agent1clientToServer = clientToServer;
-        threaded->server->currentMatch = malloc(sizeof(Match*));
-        threaded->server->currentMatch = threaded->match;
-    }        
-    pthread_t tid;
-    threadData->threadId = tid;
-    release_lock(threaded->server->serverGuard);
-    pthread_create(&tid, NULL, handle_agent, (void*) threadData);
+        threaded->agentNumber = 1;
+        init_timer(&threaded->timer, expire_ticket, (void*) &ticket);
+        timer_arm(&server->timers, &threaded->timer, TIMER_PAIRING);
+        threaded->match = pairing_wait(&ticket);
+        timer_cancel(&server->timers, &threaded->timer);
+    }
+    destroy_ticket(&ticket);
+    free_match_request(&request);
+    if (threaded->match == NULL) {
+        refuse_request(serverToClient, request.binary);
+        fclose(serverToClient);
+        fclose(clientToServer);
+        release_client(threaded);
+        return;
+    }
+    handle_agent(threaded);
+}
+
+/*
+ * Handles a new client on a pool worker, once it has sent something
+ * threadData - The struct encapsulating the information needed by the
+ * worker, which is freed once the client has been handled
+ */
+void new_client(void* threadData) {
+    Thread* threaded = (Thread*) threadData;
+    timer_cancel(&threaded->server->timers, &threaded->timer);
+    handle_client(threaded);
 }
 
 /** 
  * Handles sighup by printing the results of the current server and does not
- * terminate
+ * terminate. The results are printed from a snapshot, so neither new
+ * clients nor result recording wait on the dump.
  * serverThread - Pointer to the server's current state
  */
 void* handle_sighup(void* serverThread) {
@@ -311,49 +870,220 @@ void* handle_sighup(void* serverThread) {
     sigaddset(&set, SIGHUP);
     int sig;
     while (!sigwait(&set, &sig)) {
-        take_lock(server->serverGuard);
-        char** names = malloc(sizeof(char*));
-        for (int i = 0; i < server->numberOfAgents; i++) {
-            names = realloc(names, sizeof(char*) * (i + 1));
-            names[i] = server->agents[i]->name;
+        int length;
+        AgentRecord* records = registry_snapshot(&server->registry, &length);
+        char* dump;
+        size_t dumpLength;
+        FILE* output = open_memstream(&dump, &dumpLength);
+        for (int i = 0; i < length; i++) {
+            fprintf(output, "%s %d %d %d\n", records[i].name,
+                    records[i].wins, records[i].losses, records[i].ties);
         }
-        char* temp;
-        for (int i = 0; i < server->numberOfAgents; i++) {
-            for (int j = 0; j < server->numberOfAgents; j++) {
-                if (strcmp(names[i], names[j]) < 0) {
-                    temp = names[j];
-                    names[j] = names[i];
-                    names[i] = temp;
-                }
-            }
+        fprintf(output, "---\n");
+        fclose(output);
+        fwrite(dump, 1, dumpLength, stdout);
+        fflush(stdout);
+        free(dump);
+        free(records);
+        unsigned long expired[TIMER_PHASES];
+        timer_expired(&server->timers, expired);
+        fprintf(stderr, "expired mr %lu pairing %lu result %lu\n",
+                expired[TIMER_MR], expired[TIMER_PAIRING],
+                expired[TIMER_RESULT]);
+        if (server->pool != NULL) {
+            PoolStats stats;
+            pool_stats(server->pool, &stats);
+            fprintf(stderr, "pool workers %d busy %d queued %d "
+                    "parked %d maxqueued %d submitted %lu completed %lu "
+                    "utilisation %.1f%%\n", stats.workers, stats.busy,
+                    stats.queued, stats.parked, stats.maxQueued,
+                    stats.submitted, stats.completed,
+                    stats.utilisation * 100);
         }
-        for (int i = 0; i < server->numberOfAgents; i++) {
-            for (int j = 0; j < server->numberOfAgents; j++) {
-                if (!strcmp(names[i], server->agents[j]->name)) {
-                    printf("%s %d %d %d\n", server->agents[j]->name, 
-                            server->agents[j]->wins, 
-                            server->agents[j]->losses, 
-                            server->agents[j]->ties);
-                    fflush(stdout);
-                }
+        metrics_dump_phases(stderr);
+        lock_stats_dump(server->serverGuard, stderr);
+    }
+    return (void*) NULL;
+}
+
+/*
+ * Reads a positive integer option value
+ * value - The value to read
+ * minimum - The smallest value allowed
+ * Returns the value, exiting the server if it is invalid
+ */
+int read_option_value(char* value, int minimum) {
+    char* buffer;
+    int number = strtol(value, &buffer, 10);
+    if (number < minimum || *buffer) {
+        exit_server(INCORRECT_ARG_NUM);
+    }
+    return number;
+}
+
+/*
+ * Reads the deadline of each phase from an option value of the form
+ * mr:pairing:result, in seconds, where 0 means the phase has no deadline
+ * value - The value to read
+ * timeouts - Filled in with the deadline of each phase
+ */
+void read_timeouts(char* value, int timeouts[TIMER_PHASES]) {
+    int length;
+    char** splitValue = split_string(value, &length, ':');
+    if (length != TIMER_PHASES) {
+        exit_server(INCORRECT_ARG_NUM);
+    }
+    for (int i = 0; i < TIMER_PHASES; i++) {
+        timeouts[i] = read_option_value(splitValue[i], 0);
+    }
+    free_split_string(splitValue, length);
+}
+
+/*
+ * Parses the command line options given to the server
+ * argc - The number of arguments
+ * argv - The arguments
+ * options - Filled in with the options given, or their defaults
+ */
+void parse_options(int argc, char* argv[], ServerOptions* options) {
+    options->eventLoops = 0;
+    options->uring = 0;
+    options->coroutines = 0;
+    options->workers = DEFAULT_WORKERS;
+    options->acceptors = 1;
+    options->processes = 0;
+    options->timeouts[TIMER_MR] = DEFAULT_MR_TIMEOUT;
+    options->timeouts[TIMER_PAIRING] = DEFAULT_PAIRING_TIMEOUT;
+    options->timeouts[TIMER_RESULT] = DEFAULT_RESULT_TIMEOUT;
+    options->logDirectory = NULL;
+    options->metricsPort = NULL;
+    options->feedPort = NULL;
+    options->address = "0";
+    options->relay = 0;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-e") && i + 1 < argc) {
+            options->eventLoops = read_option_value(argv[++i], 1);
+        } else if (!strcmp(argv[i], "-u")) {
+            options->uring = 1;
+        } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+            options->coroutines = read_option_value(argv[++i], 1);
+        } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            options->workers = read_option_value(argv[++i], MIN_WORKERS);
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            read_timeouts(argv[++i], options->timeouts);
+        } else if (!strcmp(argv[i], "-l") && i + 1 < argc) {
+            options->logDirectory = argv[++i];
+        } else if (!strcmp(argv[i], "-r")) {
+            options->relay = 1;
+        } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+            options->metricsPort = argv[++i];
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            options->feedPort = argv[++i];
+        } else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+            options->address = argv[++i];
+        } else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+            options->processes = read_option_value(argv[++i], 1);
+        } else if (!strcmp(argv[i], "-a") && i + 1 < argc) {
+            options->acceptors = read_option_value(argv[++i], 1);
+            if (options->acceptors > MAX_ACCEPTORS) {
+                exit_server(INCORRECT_ARG_NUM);
             }
+        } else {
+            exit_server(INCORRECT_ARG_NUM);
         }
-        printf("---\n");
-        fflush(stdout);
-        release_lock(server->serverGuard);
+    }
+    if ((options->eventLoops != 0) + options->uring +
+            (options->coroutines != 0) + (options->acceptors > 1) +
+            (options->processes != 0) > 1) {
+        exit_server(INCORRECT_ARG_NUM);
+    }
+    if (options->processes && (options->logDirectory != NULL ||
+            options->metricsPort != NULL || options->feedPort != NULL ||
+            options->relay)) {
+        exit_server(INCORRECT_ARG_NUM);
+    }
+}
+
+/*
+ * Accepts clients on an acceptor's listener forever, parking each one in
+ * the worker pool, tagged with the acceptor's shard, until it sends its
+ * first message or its match request deadline passes
+ * acceptorData - The acceptor to run
+ */
+void* accept_clients(void* acceptorData) {
+    Acceptor* acceptor = (Acceptor*) acceptorData;
+    int clientFd;
+    while (clientFd = accept(acceptor->listenFd, 0, 0), clientFd >= 0) {
+        metrics_count(METRIC_ACCEPTED);
+        Thread* threaded = malloc(sizeof(Thread));
+        threaded->acceptedAt = metrics_now();
+        threaded->server = acceptor->server;
+        threaded->clientFd = clientFd;
+        threaded->shard = acceptor->shard;
+        init_timer(&threaded->timer, expire_connection, (void*) threaded);
+        timer_arm(&acceptor->server->timers, &threaded->timer, TIMER_MR);
+        pool_submit_when_readable(acceptor->server->pool, clientFd,
+                new_client, (void*) threaded);
     }
     return (void*) NULL;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc != 1) {
-        exit_server(INCORRECT_ARG_NUM);
+/*
+ * Opens a listener for every acceptor. The first binds the given address
+ * and the rest bind the same port, so the kernel spreads new connections
+ * across them without the acceptors contending on a single accept queue.
+ * A Unix domain socket cannot be bound twice, so if the address is a path
+ * every acceptor accepts from the first listener instead.
+ * server - The current state of the server, whose listener becomes the
+ * first acceptor's
+ * address - The port or path to listen on, or "0" for any free port
+ * acceptors - The acceptors to open listeners for
+ * numberOfAcceptors - The number of acceptors
+ * Returns 0 if every listener was created, else returns -1
+ */
+int create_acceptors(ServerState* server, char* address, Acceptor* acceptors,
+        int numberOfAcceptors) {
+    int reusePort = numberOfAcceptors > 1;
+    if (create_port_listener(&server->serverInfo, address, reusePort)) {
+        return -1;
     }
+    char port[6];
+    sprintf(port, "%u", server->serverInfo.port);
+    for (int i = 0; i < numberOfAcceptors; i++) {
+        ServerInfo listener = server->serverInfo;
+        if (i > 0 && listener.path == NULL &&
+                create_port_listener(&listener, port, reusePort)) {
+            return -1;
+        }
+        acceptors[i].server = server;
+        acceptors[i].shard = i;
+        acceptors[i].listenFd = listener.socketFd;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    ServerOptions options;
+    parse_options(argc, argv, &options);
     ServerState server;
-    server.numberOfAgents = 0;
-    server.agents = malloc(sizeof(Agent));
+    registry_init(&server.registry);
     server.matchId = 0;
-    server.currentMatch = NULL;
+    server.pool = NULL;
+    server.log = NULL;
+    server.feed = NULL;
+    server.relay = options.relay;
+    ResultLog log;
+    if (options.logDirectory != NULL) {
+        if (results_log_open(&log, options.logDirectory, &server.registry)) {
+            exit_server(LOG_ERROR);
+        }
+        server.log = &log;
+    }
+    server.numberOfShards = options.acceptors;
+    server.shards = calloc(options.acceptors, sizeof(PairingQueue));
+    for (int i = 0; i < options.acceptors; i++) {
+        pairing_init(&server.shards[i]);
+    }
     sem_t serverLock;
     init_lock(&serverLock);
     server.serverGuard = &serverLock;
@@ -362,24 +1092,59 @@ int main(int argc, char* argv[]) {
     sigemptyset(&set);
     sigaddset(&set, SIGHUP);
     pthread_sigmask(SIG_BLOCK, &set, 0);
+    if (options.processes) {
+        if (create_port_listener(&server.serverInfo, options.address, 0)) {
+            exit_server(LISTEN_ERROR);
+        }
+        write_address(stdout, &server.serverInfo);
+        printf("\n");
+        fflush(stdout);
+        return run_prefork(&server.serverInfo, options.processes,
+                options.workers, options.timeouts);
+    }
+    timer_wheel_start(&server.timers, options.timeouts);
+    stats_start(&server);
+    if (options.metricsPort != NULL &&
+            metrics_start(&server, options.metricsPort)) {
+        exit_server(METRICS_ERROR);
+    }
+    Feed feed;
+    if (options.feedPort != NULL) {
+        if (feed_start(&feed, &server.registry, options.feedPort)) {
+            exit_server(FEED_ERROR);
+        }
+        server.feed = &feed;
+    }
+    if (options.eventLoops || options.uring || options.coroutines) {
+        if (create_port_listener(&server.serverInfo, options.address, 0)) {
+            exit_server(LISTEN_ERROR);
+        }
+        pthread_create(&thread, 0, handle_sighup, (void*) &server);
+        write_address(stdout, &server.serverInfo);
+        printf("\n");
+        fflush(stdout);
+        if (options.coroutines) {
+            return run_coroutines(&server, options.coroutines);
+        }
+        return options.uring ? run_uring(&server) :
+                run_event_loops(&server, options.eventLoops);
+    }
+    Acceptor acceptors[MAX_ACCEPTORS];
+    if (create_acceptors(&server, options.address, acceptors,
+            options.acceptors)) {
+        exit_server(LISTEN_ERROR);
+    }
+    WorkerPool pool;
+    pool_start(&pool, options.workers);
+    server.pool = &pool;
     pthread_create(&thread, 0, handle_sighup, (void*) &server);
-    create_listener(&server.serverInfo);
-    printf("%u\n", server.serverInfo.port);
+    write_address(stdout, &server.serverInfo);
+    printf("\n");
     fflush(stdout);
-    int clientFd;
-    while (clientFd = accept(server.serverInfo.socketFd, 0, 0), 
-            clientFd >= 0) {
-        take_lock(server.serverGuard);
-        Thread* thread = malloc(sizeof(Thread));
-        thread->server = &server;
-        if (server.currentMatch != NULL) {
-            thread->match = server.currentMatch;
-            thread->agentNumber = 2;
-        } else {
-            server.matchId++;
-            thread->agentNumber = 1;
-        }
-        thread->clientFd = clientFd;
-        new_client(thread);
+    for (int i = 1; i < options.acceptors; i++) {
+        pthread_create(&acceptors[i].threadId, 0, accept_clients,
+                (void*) &acceptors[i]);
     }
+    accept_clients((void*) &acceptors[0]);
+    return 0;
 }
@@ -0,0 +1,158 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdio.h>
+#include <semaphore.h>
+#include "util.h"
+#include "pairing.h"
+#include "registry.h"
+#include "pool.h"
+#include "timer.h"
+#include "arena.h"
+#include "mpsc.h"
+#include "metrics.h"
+#include "lockstats.h"
+#include "relay.h"
+#include "resultlog.h"
+#include "frame.h"
+#include "feed.h"
+
+// Represents a connection handled by the event loop
+struct Session;
+
+// Represents a connection handled by a coroutine
+struct Coroutine;
+
+// Represents a single match between two agents. The match and everything
+// allocated during its life live in its arena. An agent that reports its
+// result as a text line has it kept as sent for the stats thread to
+// validate, while one that speaks binary frames has the outcome its frame
+// claims kept instead.
+typedef struct Match {
+    int matchId;
+    Arena* arena;
+
+    int agent1Id;
+    char* agent1Port;
+    char* agent1Result;
+    Outcome agent1Claim;
+    int agent1Binary;
+    FILE* agent1serverToClient;
+    FILE* agent1clientToServer;
+    struct Session* agent1Session;
+    struct Coroutine* agent1Coroutine;
+    unsigned long agent1SentAt;
+
+    int agent2Id;
+    char* agent2Port;
+    char* agent2Result;
+    Outcome agent2Claim;
+    int agent2Binary;
+    FILE* agent2serverToClient;
+    FILE* agent2clientToServer;
+    struct Session* agent2Session;
+    struct Coroutine* agent2Coroutine;
+    unsigned long agent2SentAt;
+
+    unsigned long pairedAt;
+    unsigned long reportedAt;
+    Relay* relay;
+    int twoPlayers;
+    int resultsReported;
+    QueueLink completed;
+} Match;
+
+// Represents a match request from a client in either encoding. The name
+// and port of a frame point into the frame, which the request owns only if
+// it read the frame itself; those of a line are owned by the request.
+typedef struct {
+    int binary;
+    char* name;
+    char* port;
+    char* frame;
+    char** splitMessage;
+    int length;
+} MatchRequest;
+
+// Represents the state shared by every connection to the server. Match ids
+// are handed out by atomically incrementing the last one used.
+typedef struct {
+    Registry registry;
+    int matchId;
+    ServerInfo serverInfo;
+
+    PairingQueue* shards;
+    int numberOfShards;
+    WorkerPool* pool;
+    TimerWheel timers;
+    MpscQueue results;
+    pthread_t statsThread;
+    ResultLog* log;
+    Feed* feed;
+    int relay;
+    sem_t* serverGuard;
+} ServerState;
+
+#ifndef LOCK_STATS
+void take_lock(sem_t* l);
+
+void release_lock(sem_t* l);
+#endif
+
+int validate_match_request(char** input, int length);
+
+int parse_match_request(char* message, int length, MatchRequest* request);
+
+char* read_message(FILE* stream, int* length, int* endOfFile);
+
+char* answer_query(ServerState* server, char* message, int length,
+        int* replyLength);
+
+void free_match_request(MatchRequest* request);
+
+void refuse_request(FILE* serverToClient, int binary);
+
+char* result_winner(char** splitMessage, int length, int matchId);
+
+Outcome winner_claim(int winnerId, int agent1Id, int agent2Id);
+
+Outcome result_claim(ServerState* server, Match* match, char* result);
+
+Outcome frame_claim(char* frame, int length, int matchId, int agent1Id,
+        int agent2Id);
+
+void store_result(Match* match, int agentNumber, char* message, int length);
+
+Match* new_match(int matchId, int agent1Id, char* agent1Port);
+
+void free_match(Match* match);
+
+Match* build_match(ServerState* server, int matchId, PairingTicket* first,
+        PairingTicket* second);
+
+Match* pair_tickets(ServerState* server, PairingTicket* first,
+        PairingTicket* second);
+
+Outcome validate_results(ServerState* server, char* agent1Result,
+        char* agent2Result, Match* match);
+
+int run_event_loops(ServerState* server, int numberOfLoops);
+
+int run_uring(ServerState* server);
+
+int run_coroutines(ServerState* server, int numberOfSchedulers);
+
+int run_prefork(ServerInfo* listener, int numberOfProcesses,
+        int numberOfWorkers, int timeouts[TIMER_PHASES]);
+
+char* format_match(ServerState* server, Match* match, int agentNumber,
+        int* length);
+
+void match_sent(Match* match, int agentNumber);
+
+int stats_start(ServerState* server);
+
+int metrics_start(ServerState* server, char* port);
+
+void submit_results(ServerState* server, Match* match);
+#endif
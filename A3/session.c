@@ -0,0 +1,437 @@
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "util.h"
+#include "server.h"
+#include "session.h"
+
+/*
+ * Reclaims a session whose deadline has passed by shutting its connection
+ * down for reading. Its backend then sees the connection end and closes
+ * the session as it would for any client that disconnects, which can
+ * still refuse a request the session is waiting on.
+ * timer - The timer of the session
+ * Returns 1, as the session is always reclaimed
+ */
+static int expire_session(Timer* timer) {
+    shutdown(((Session*) timer->data)->fd, SHUT_RD);
+    return 1;
+}
+
+/*
+ * Creates a session for a newly accepted client
+ * server - The current state of the server
+ * fd - The client's socket
+ * driver - The backend driving the session
+ * owner - The backend's own state for the session, such as its event loop
+ * wave - The wave of the thread that owns the session
+ * Returns a pointer to the new session
+ */
+Session* new_session(ServerState* server, int fd,
+        const SessionDriver* driver, void* owner, Wave* wave) {
+    Session* session = calloc(1, sizeof(Session));
+    session->fd = fd;
+    session->server = server;
+    session->driver = driver;
+    session->owner = owner;
+    session->wave = wave;
+    session->phase = AWAIT_MR;
+    pthread_mutex_init(&session->outputGuard, NULL);
+    init_timer(&session->timer, expire_session, (void*) session);
+    timer_arm(&server->timers, &session->timer, TIMER_MR);
+    metrics_count(METRIC_ACCEPTED);
+    session->acceptedAt = metrics_now();
+    return session;
+}
+
+/*
+ * Frees a session once its backend is finished with it
+ * session - The session to free
+ */
+void free_session(Session* session) {
+    pthread_mutex_destroy(&session->outputGuard);
+    free(session->input);
+    free(session->output);
+    free(session);
+    metrics_count(METRIC_CLOSED);
+}
+
+/*
+ * Sends a line to a session on behalf of its opponent in a relayed match
+ * peer - The session to send to
+ * line - The line to send
+ */
+static void send_to_session(void* peer, char* line) {
+    Session* session = (Session*) peer;
+    session->driver->send(session, line, strlen(line));
+}
+
+/*
+ * Returns the opponent of a session in its match
+ * session - The session, which must be in a match
+ */
+static Session* session_opponent(Session* session) {
+    return session->agentNumber == 1 ? session->match->agent2Session :
+            session->match->agent1Session;
+}
+
+/*
+ * Records the result reported by a session. Whichever session reports
+ * second hands the match to the stats thread, so no lock is needed. In a
+ * relayed match the session leaves the relay first, so its opponent stops
+ * sending to it before it can be freed.
+ * session - The session reporting its result
+ * result - The result line or frame reported by the session
+ * length - The length of the result
+ */
+static void record_result(Session* session, char* result, int length) {
+    Match* match = session->match;
+    if (match->relay != NULL) {
+        relay_leave(match->relay, session->agentNumber, send_to_session,
+                session_opponent(session));
+    }
+    session->match = NULL;
+    store_result(match, session->agentNumber, result, length);
+    if (__atomic_add_fetch(&match->resultsReported, 1,
+            __ATOMIC_ACQ_REL) == 2) {
+        submit_results(session->server, match);
+    }
+}
+
+/*
+ * Returns the phase of the given session. The phase of a waiting session
+ * is changed by whichever thread pairs it, so it is read under the server
+ * guard.
+ * session - The session to inspect
+ */
+static SessionPhase session_phase(Session* session) {
+    take_lock(session->server->serverGuard);
+    SessionPhase phase = session->phase;
+    release_lock(session->server->serverGuard);
+    return phase;
+}
+
+/*
+ * Refuses the match request of a session that asked in a frame, so its
+ * client knows the server speaks frames
+ * session - The session to refuse
+ * binary - Whether the session sent its match request as a frame
+ */
+static void refuse_session(Session* session, int binary) {
+    if (binary) {
+        char refusal[FRAME_HEADER_LENGTH];
+        session->driver->send(session, refusal, frame_refused(refusal));
+    }
+}
+
+/*
+ * Closes a session, withdrawing it from any match it is part of. A session
+ * waiting for a partner leaves its wave or the pairing queue and has its
+ * request refused, while one waiting to report a result is treated as
+ * having reported nothing.
+ * session - The session to close
+ */
+static void close_session(Session* session) {
+    ServerState* server = session->server;
+    take_lock(server->serverGuard);
+    SessionPhase phase = session->phase;
+    if (phase == AWAIT_PARTNER) {
+        pairing_cancel(&session->ticket);
+    }
+    release_lock(server->serverGuard);
+    timer_cancel(&server->timers, &session->timer);
+    if (phase == AWAIT_WAVE) {
+        session->wave->sessions[session->waveIndex] = NULL;
+    }
+    if (phase == AWAIT_RESULT && session->match != NULL) {
+        record_result(session, "", 0);
+    }
+    if (phase == AWAIT_WAVE || phase == AWAIT_PARTNER) {
+        refuse_session(session, session->ticket.binary);
+    }
+    if (phase != AWAIT_MR) {
+        free(session->ticket.port);
+        destroy_ticket(&session->ticket);
+    }
+    session->driver->close(session);
+}
+
+/*
+ * Starts a match between two paired sessions by writing MATCH to both. A
+ * session that waited in the pairing queue may belong to another thread,
+ * so a match including one must be started under the server guard.
+ * server - The current state of the server
+ * match - The match the sessions were paired into
+ * first - The session playing as agent one
+ * second - The session playing as agent two
+ */
+static void start_match(ServerState* server, Match* match, Session* first,
+        Session* second) {
+    first->match = match;
+    first->agentNumber = 1;
+    first->phase = AWAIT_RESULT;
+    second->match = match;
+    second->agentNumber = 2;
+    second->phase = AWAIT_RESULT;
+    timer_arm(&server->timers, &first->timer, TIMER_RESULT);
+    timer_arm(&server->timers, &second->timer, TIMER_RESULT);
+    int length;
+    char* message = format_match(server, match, 1, &length);
+    match_sent(match, 1);
+    first->driver->send(first, message, length);
+    message = format_match(server, match, 2, &length);
+    match_sent(match, 2);
+    second->driver->send(second, message, length);
+}
+
+/*
+ * Handles a match request from a session by registering its agent and
+ * adding the session to its thread's wave, to be paired once everything
+ * the thread has received so far has been handled
+ * session - The session that sent the request
+ * message - The match request, as a line or a frame
+ * length - The length of the request
+ * Returns 1 if the session was closed, else returns 0
+ */
+static int handle_match_request(Session* session, char* message,
+        int length) {
+    ServerState* server = session->server;
+    MatchRequest request;
+    if (parse_match_request(message, length, &request)) {
+        refuse_session(session, request.binary);
+        free_match_request(&request);
+        close_session(session);
+        return 1;
+    }
+    int agentId = registry_intern(&server->registry, request.name);
+    if (agentId == NO_AGENT) {
+        refuse_session(session, request.binary);
+        free_match_request(&request);
+        close_session(session);
+        return 1;
+    }
+    init_ticket(&session->ticket, agentId, strdup(request.port));
+    session->ticket.binary = request.binary;
+    session->ticket.session = session;
+    free_match_request(&request);
+    Wave* wave = session->wave;
+    if (wave->length == wave->buffer) {
+        wave->buffer = wave->buffer * 2 + 1;
+        wave->sessions = realloc(wave->sessions,
+                wave->buffer * sizeof(Session*));
+    }
+    session->waveIndex = wave->length;
+    wave->sessions[wave->length++] = session;
+    session->ticket.queuedAt = metrics_now();
+    session->phase = AWAIT_WAVE;
+    return 0;
+}
+
+/*
+ * Pairs every session in a wave. The wave adapts to load on its own: a
+ * thread pairs once per batch of events, so a lone client is paired at
+ * once, while under heavy load each batch holds many requests and the
+ * guard is taken once for all of them rather than once per client. The
+ * client left waiting by an earlier wave is paired first, under the guard,
+ * with the wave's oldest session. The guard is otherwise only held to
+ * queue any session left over, which is paired instead if a client has
+ * started waiting since the queue was first checked. The rest of the wave
+ * is known only to this thread, so its match ids are reserved in bulk with
+ * one atomic add and its matches are built and started without the guard,
+ * and backends that submit their sends in batches send all of its MATCH
+ * messages together.
+ * server - The current state of the server
+ * wave - The wave to pair, which is left empty
+ */
+void session_pair_wave(ServerState* server, Wave* wave) {
+    int length = 0;
+    for (int i = 0; i < wave->length; i++) {
+        if (wave->sessions[i] != NULL) {
+            wave->sessions[length++] = wave->sessions[i];
+            metrics_count(METRIC_WAVE_SESSIONS);
+        }
+    }
+    wave->length = 0;
+    if (length == 0) {
+        return;
+    }
+    metrics_count(METRIC_WAVES);
+    Session** sessions = wave->sessions;
+    int first = 0;
+    take_lock(server->serverGuard);
+    PairingTicket* partner = pairing_take_any(server->shards,
+            server->numberOfShards, 0);
+    if (partner != NULL) {
+        Match* match = pair_tickets(server, partner, &sessions[0]->ticket);
+        pairing_complete(partner, match);
+        start_match(server, match, partner->session, sessions[0]);
+        first = 1;
+    }
+    if ((length - first) % 2 == 1) {
+        Session* last = sessions[length - 1];
+        partner = pairing_join(server->shards, server->numberOfShards, 0,
+                &last->ticket);
+        if (partner != NULL) {
+            Match* match = pair_tickets(server, partner, &last->ticket);
+            pairing_complete(partner, match);
+            start_match(server, match, partner->session, last);
+        } else {
+            last->agentNumber = 1;
+            last->phase = AWAIT_PARTNER;
+            timer_arm(&server->timers, &last->timer, TIMER_PAIRING);
+        }
+    }
+    release_lock(server->serverGuard);
+    int matchId = __atomic_fetch_add(&server->matchId, (length - first) / 2,
+            __ATOMIC_RELAXED);
+    unsigned long now = metrics_now();
+    for (int i = first; i + 1 < length; i += 2) {
+        metrics_record_phase(PHASE_PAIRING,
+                now - sessions[i]->ticket.queuedAt);
+        Match* match = build_match(server, ++matchId, &sessions[i]->ticket,
+                &sessions[i + 1]->ticket);
+        start_match(server, match, sessions[i], sessions[i + 1]);
+    }
+}
+
+/*
+ * Relays a move sent by a session to its opponent, if the session is
+ * playing a relayed match. Only the session's own thread changes its match
+ * once it has been paired, so the server guard is only taken until the
+ * session is first seen playing.
+ * session - The session that sent the move
+ * line - The move
+ * Returns 1 if the move was relayed, or 0 if the session is not playing a
+ * relayed match
+ */
+static int relay_move(Session* session, char* line) {
+    if (!session->playing) {
+        if (session_phase(session) != AWAIT_RESULT) {
+            return 0;
+        }
+        session->playing = 1;
+    }
+    if (session->match == NULL || session->match->relay == NULL) {
+        return 0;
+    }
+    relay_forward(session->match->relay, session->agentNumber, line,
+            send_to_session, session_opponent(session));
+    return 1;
+}
+
+/*
+ * Handles the result sent by a session, after which the session has
+ * nothing further to say and is closed
+ * session - The session that sent the result
+ * result - The result line or frame
+ * length - The length of the result
+ */
+static void handle_result(Session* session, char* result, int length) {
+    if (session_phase(session) == AWAIT_RESULT) {
+        record_result(session, result, length);
+    }
+    close_session(session);
+}
+
+/*
+ * Handles one complete line received from a session
+ * session - The session the line was received from
+ * line - The line received, without its newline
+ * Returns 1 if the session was closed, else returns 0
+ */
+static int handle_line(Session* session, char* line) {
+    strtrim(line);
+    if (session->phase == AWAIT_MR) {
+        int replyLength;
+        char* reply = answer_query(session->server, line, strlen(line),
+                &replyLength);
+        if (reply != NULL) {
+            session->driver->send(session, reply, replyLength);
+            free(reply);
+            timer_arm(&session->server->timers, &session->timer, TIMER_MR);
+            return 0;
+        }
+        metrics_record_phase(PHASE_MR, metrics_now() - session->acceptedAt);
+        return handle_match_request(session, line, strlen(line));
+    }
+    if (relay_is_move(line) && relay_move(session, line)) {
+        return 0;
+    }
+    handle_result(session, line, strlen(line));
+    return 1;
+}
+
+/*
+ * Handles one complete frame received from a session. Moves are only ever
+ * relayed as lines, so a frame is either a match request or a result.
+ * session - The session the frame was received from
+ * frame - The frame received
+ * length - The length of the frame
+ * Returns 1 if the session was closed, else returns 0
+ */
+static int handle_frame(Session* session, char* frame, int length) {
+    if (session->phase == AWAIT_MR) {
+        metrics_record_phase(PHASE_MR, metrics_now() - session->acceptedAt);
+        return handle_match_request(session, frame, length);
+    }
+    handle_result(session, frame, length);
+    return 1;
+}
+
+/*
+ * Adds data received from a client to its session and handles every
+ * complete line or frame received so far
+ * session - The session the data was received on
+ * data - The data received
+ * length - The number of bytes received
+ * Returns 1 if the session was closed, else returns 0
+ */
+int session_receive(Session* session, char* data, int length) {
+    if (session->inputLength + length + 1 > session->inputBuffer) {
+        session->inputBuffer = session->inputLength + length + 1;
+        session->input = realloc(session->input, session->inputBuffer);
+    }
+    memcpy(session->input + session->inputLength, data, length);
+    session->inputLength += length;
+    int consumed;
+    while ((consumed = frame_message_length(session->input,
+            session->inputLength)) > 0) {
+        int closed;
+        if (is_frame(session->input, consumed)) {
+            closed = handle_frame(session, session->input, consumed);
+        } else {
+            session->input[consumed - 1] = '\0';
+            closed = handle_line(session, session->input);
+        }
+        if (closed) {
+            return 1;
+        }
+        session->inputLength -= consumed;
+        memmove(session->input, session->input + consumed,
+                session->inputLength);
+    }
+    if (consumed < 0 || session->inputLength > MAX_LINE_LENGTH) {
+        close_session(session);
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Handles the client closing its connection, treating any unterminated
+ * final line as a complete one, then closes the session. A partial frame
+ * is discarded.
+ * session - The session that reached end of file
+ */
+void session_end(Session* session) {
+    if (session->inputLength > 0 &&
+            !is_frame(session->input, session->inputLength)) {
+        session->input[session->inputLength] = '\0';
+        if (handle_line(session, session->input)) {
+            return;
+        }
+    }
+    close_session(session);
+}
@@ -0,0 +1,77 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <pthread.h>
+#include "server.h"
+
+#define MAX_LINE_LENGTH 4096
+
+// The phases a client connection passes through during a match
+typedef enum {
+    AWAIT_MR, AWAIT_WAVE, AWAIT_PARTNER, AWAIT_RESULT
+} SessionPhase;
+
+struct Session;
+
+// Represents the sessions a backend thread has read match requests from
+// since it last paired, in arrival order. A session withdrawn before the
+// wave is paired leaves NULL in its place. Only the owning thread touches
+// a wave.
+typedef struct {
+    struct Session** sessions;
+    int length;
+    int buffer;
+} Wave;
+
+// Represents the I/O backend a session is driven by. send queues a line or
+// frame for the client without blocking, while close releases the
+// connection once the session has been withdrawn from matchmaking.
+typedef struct {
+    void (*send)(struct Session* session, char* data, int length);
+    void (*close)(struct Session* session);
+} SessionDriver;
+
+// Represents a client connection driven by a non-blocking I/O backend. Only
+// the backend thread that owns a session feeds it input or frees it; other
+// threads may only send to it while holding the server guard.
+typedef struct Session {
+    int fd;
+    ServerState* server;
+    const SessionDriver* driver;
+    void* owner;
+    Wave* wave;
+    int waveIndex;
+
+    SessionPhase phase;
+    int playing;
+    int agentNumber;
+    Match* match;
+    PairingTicket ticket;
+    Timer timer;
+    unsigned long acceptedAt;
+
+    char* input;
+    int inputLength;
+    int inputBuffer;
+
+    pthread_mutex_t outputGuard;
+    char* output;
+    int outputLength;
+
+    // Used by backends whose operations complete asynchronously
+    int sending;
+    int pendingOperations;
+    int closed;
+} Session;
+
+Session* new_session(ServerState* server, int fd,
+        const SessionDriver* driver, void* owner, Wave* wave);
+
+void session_pair_wave(ServerState* server, Wave* wave);
+
+int session_receive(Session* session, char* data, int length);
+
+void session_end(Session* session);
+
+void free_session(Session* session);
+#endif
@@ -0,0 +1,440 @@
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "shared.h"
+
+#define SNAPSHOT_ATTEMPTS 16
+
+/*
+ * Hashes a name with 64 bit FNV-1a
+ * name - The name to hash
+ * Returns the hash of the name
+ */
+static uint64_t hash_name(char* name) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char* next = (unsigned char*) name; *next; next++) {
+        hash ^= *next;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/*
+ * Takes the shared guard. If a worker died while holding it, the guard is
+ * made consistent again and taken regardless, since every change made
+ * under it leaves the segment valid at each step. An update the worker
+ * left unfinished is counted as finished, so snapshots do not wait on it.
+ * shared - The shared state whose guard to take
+ */
+static void lock_shared(SharedState* shared) {
+    if (pthread_mutex_lock(&shared->guard) == EOWNERDEAD) {
+        shared->updatesFinished = shared->updatesStarted;
+        pthread_mutex_consistent(&shared->guard);
+    }
+}
+
+/*
+ * Maps a shared segment for workers that have not been forked yet
+ * numberOfTickets - The most clients that can be waiting or playing at
+ * once, which is one per worker thread across every process
+ * Returns the shared state, or NULL if it could not be mapped
+ */
+SharedState* shared_create(int numberOfTickets) {
+    size_t size = sizeof(SharedState) +
+            sizeof(SharedTicket) * numberOfTickets;
+    SharedState* shared = mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (shared == MAP_FAILED) {
+        return NULL;
+    }
+    pthread_mutexattr_t guardAttributes;
+    pthread_mutexattr_init(&guardAttributes);
+    pthread_mutexattr_setpshared(&guardAttributes, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&guardAttributes, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->guard, &guardAttributes);
+    pthread_mutexattr_destroy(&guardAttributes);
+    pthread_condattr_t pairedAttributes;
+    pthread_condattr_init(&pairedAttributes);
+    pthread_condattr_setpshared(&pairedAttributes, PTHREAD_PROCESS_SHARED);
+    for (int i = 0; i < numberOfTickets; i++) {
+        shared->tickets[i].state = TICKET_FREE;
+        pthread_cond_init(&shared->tickets[i].paired, &pairedAttributes);
+        shared->tickets[i].next = i + 1 < numberOfTickets ? i + 1 :
+                NO_TICKET;
+    }
+    pthread_condattr_destroy(&pairedAttributes);
+    shared->numberOfTickets = numberOfTickets;
+    shared->freeTickets = numberOfTickets > 0 ? 0 : NO_TICKET;
+    shared->waiting = NO_TICKET;
+    return shared;
+}
+
+/*
+ * Returns the name of the agent with the given id
+ * shared - The shared state holding the agent
+ * id - The id of an agent returned by shared_intern
+ */
+char* shared_name(SharedState* shared, int id) {
+    return shared->names + shared->agents[id].nameOffset;
+}
+
+/*
+ * Finds the slot holding the given name, or the empty slot where it would
+ * be inserted. The table is never more than half full, so the search
+ * always ends.
+ * shared - The shared state to search
+ * name - The name to search for
+ * Returns the index of the slot
+ */
+static unsigned int find_slot(SharedState* shared, char* name) {
+    unsigned int slot = hash_name(name) & (SHARED_SLOTS - 1);
+    int entry;
+    while ((entry = __atomic_load_n(&shared->slots[slot],
+            __ATOMIC_ACQUIRE)) != 0 &&
+            strcmp(shared_name(shared, entry - 1), name)) {
+        slot = (slot + 1) & (SHARED_SLOTS - 1);
+    }
+    return slot;
+}
+
+/*
+ * Finds the id of the agent with the given name without registering it or
+ * taking the guard
+ * shared - The shared state holding the agents
+ * name - The name of the agent
+ * Returns the id of the agent, or NO_AGENT if it is not registered
+ */
+int shared_lookup(SharedState* shared, char* name) {
+    int entry = __atomic_load_n(&shared->slots[find_slot(shared, name)],
+            __ATOMIC_ACQUIRE);
+    return entry != 0 ? entry - 1 : NO_AGENT;
+}
+
+/*
+ * Finds the id of the agent with the given name, registering the agent in
+ * every worker's view if it is new. Known names are found without taking
+ * the guard.
+ * shared - The shared state holding the agents
+ * name - The name of the agent
+ * Returns the id of the agent, or NO_AGENT if the segment is full
+ */
+int shared_intern(SharedState* shared, char* name) {
+    int entry = __atomic_load_n(&shared->slots[find_slot(shared, name)],
+            __ATOMIC_ACQUIRE);
+    if (entry != 0) {
+        return entry - 1;
+    }
+    lock_shared(shared);
+    unsigned int slot = find_slot(shared, name);
+    entry = shared->slots[slot];
+    int length = strlen(name) + 1;
+    if (entry == 0 && shared->numberOfAgents < SHARED_AGENTS &&
+            shared->nameSpaceUsed + length <= SHARED_NAME_SPACE) {
+        int id = shared->numberOfAgents;
+        shared->agents[id].nameOffset = shared->nameSpaceUsed;
+        memcpy(shared_name(shared, id), name, length);
+        shared->nameSpaceUsed += length;
+        __atomic_store_n(&shared->numberOfAgents, id + 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&shared->slots[slot], id + 1, __ATOMIC_RELEASE);
+        entry = id + 1;
+    }
+    pthread_mutex_unlock(&shared->guard);
+    return entry != 0 ? entry - 1 : NO_AGENT;
+}
+
+/*
+ * Returns a ticket to the free list. Must be called while holding the
+ * guard.
+ * shared - The shared state holding the ticket
+ * ticket - The ticket to free
+ */
+static void free_ticket(SharedState* shared, SharedTicket* ticket) {
+    ticket->state = TICKET_FREE;
+    ticket->next = shared->freeTickets;
+    shared->freeTickets = ticket - shared->tickets;
+}
+
+/*
+ * Fills in one side of a ticket for the client of the calling process
+ * ticket - The ticket to fill in
+ * side - The side of the match the client plays, from 0
+ * agentId - The id of the agent the client plays as
+ * port - The port the client sent in its match request
+ */
+static void fill_side(SharedTicket* ticket, int side, int agentId,
+        char* port) {
+    ticket->agentIds[side] = agentId;
+    strncpy(ticket->ports[side], port, SHARED_PORT_SIZE - 1);
+    ticket->ports[side][SHARED_PORT_SIZE - 1] = '\0';
+    ticket->owners[side] = getpid();
+    ticket->reported[side] = 0;
+}
+
+/*
+ * Pairs a client with the client waiting in the shared slot, whichever
+ * process accepted it, or else makes it the waiting client
+ * shared - The shared state
+ * agentId - The id of the agent the client plays as
+ * port - The port the client sent in its match request
+ * agentNumber - Set to 2 if the client was paired, or 1 if it must wait
+ * Returns the client's ticket, or NULL if no ticket was free
+ */
+SharedTicket* shared_join(SharedState* shared, int agentId, char* port,
+        int* agentNumber) {
+    lock_shared(shared);
+    SharedTicket* ticket = NULL;
+    if (shared->waiting != NO_TICKET) {
+        ticket = &shared->tickets[shared->waiting];
+        shared->waiting = NO_TICKET;
+        ticket->matchId = ++shared->matchId;
+        fill_side(ticket, 1, agentId, port);
+        ticket->state = TICKET_PAIRED;
+        pthread_cond_signal(&ticket->paired);
+        *agentNumber = 2;
+    } else if (shared->freeTickets != NO_TICKET) {
+        ticket = &shared->tickets[shared->freeTickets];
+        shared->freeTickets = ticket->next;
+        fill_side(ticket, 0, agentId, port);
+        ticket->state = TICKET_WAITING;
+        shared->waiting = ticket - shared->tickets;
+        *agentNumber = 1;
+    }
+    pthread_mutex_unlock(&shared->guard);
+    return ticket;
+}
+
+/*
+ * Waits until the client holding a ticket is paired or its wait expires.
+ * An expired ticket is freed.
+ * shared - The shared state
+ * ticket - The ticket of the waiting client
+ * Returns 1 if the client was paired, else returns 0
+ */
+int shared_wait(SharedState* shared, SharedTicket* ticket) {
+    lock_shared(shared);
+    while (ticket->state == TICKET_WAITING) {
+        if (pthread_cond_wait(&ticket->paired, &shared->guard) ==
+                EOWNERDEAD) {
+            pthread_mutex_consistent(&shared->guard);
+        }
+    }
+    int paired = ticket->state == TICKET_PAIRED;
+    if (!paired) {
+        free_ticket(shared, ticket);
+    }
+    pthread_mutex_unlock(&shared->guard);
+    return paired;
+}
+
+/*
+ * Withdraws a client that has waited too long for a partner, waking the
+ * thread waiting on its ticket
+ * shared - The shared state
+ * ticket - The ticket of the waiting client
+ * Returns 1 if the client was still waiting, else returns 0
+ */
+int shared_expire(SharedState* shared, SharedTicket* ticket) {
+    lock_shared(shared);
+    int expired = ticket->state == TICKET_WAITING;
+    if (expired) {
+        ticket->state = TICKET_EXPIRED;
+        shared->waiting = NO_TICKET;
+        pthread_cond_signal(&ticket->paired);
+    }
+    pthread_mutex_unlock(&shared->guard);
+    return expired;
+}
+
+/*
+ * Counts a client reclaimed by a worker's timer wheel, so that every
+ * worker's expiries can be reported together
+ * shared - The shared state
+ * phase - The phase the client was reclaimed in
+ */
+void shared_count_expired(SharedState* shared, TimerPhase phase) {
+    __atomic_fetch_add(&shared->expired[phase], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Notes the outcome one side of a match claims, freeing the ticket once
+ * both sides have. Must be called while holding the guard.
+ * shared - The shared state
+ * ticket - The ticket of the match
+ * side - The side reporting, from 0
+ * claim - The outcome the side claims, or NO_OUTCOME if its result was
+ * invalid
+ * Returns the outcome to record, which is NO_OUTCOME until both sides have
+ * reported, or if they disagree
+ */
+static Outcome report_side(SharedState* shared, SharedTicket* ticket,
+        int side, Outcome claim) {
+    ticket->reported[side] = 1;
+    ticket->claims[side] = claim;
+    if (!ticket->reported[1 - side]) {
+        return NO_OUTCOME;
+    }
+    Outcome outcome = ticket->claims[0] == ticket->claims[1] ? claim :
+            NO_OUTCOME;
+    free_ticket(shared, ticket);
+    return outcome;
+}
+
+/*
+ * Records the outcome of a match in both agents' counters. Any worker may
+ * record, so every counter is incremented atomically, and the update is
+ * bracketed by the update counters for snapshots. Must be called while
+ * holding the guard, so that a snapshot taken under it sees no update in
+ * progress.
+ * shared - The shared state holding the agents
+ * firstId - The id of the match's first agent
+ * secondId - The id of the match's second agent
+ * outcome - How the match ended
+ */
+static void record_outcome(SharedState* shared, int firstId, int secondId,
+        Outcome outcome) {
+    if (outcome == NO_OUTCOME) {
+        return;
+    }
+    SharedAgent* first = &shared->agents[firstId];
+    SharedAgent* second = &shared->agents[secondId];
+    __atomic_fetch_add(&shared->updatesStarted, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (outcome == TIED) {
+        __atomic_fetch_add(&first->ties, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&second->ties, 1, __ATOMIC_RELAXED);
+    } else if (outcome == FIRST_WON) {
+        __atomic_fetch_add(&first->wins, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&second->losses, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&first->losses, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&second->wins, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&shared->updatesFinished, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Reports the outcome one side of a match claims. Whichever side reports
+ * second records the match if both sides agree. The caller must not use
+ * the ticket afterwards.
+ * shared - The shared state
+ * ticket - The ticket of the match
+ * agentNumber - The position in the match of the side reporting
+ * claim - The outcome the side claims, or NO_OUTCOME if its result was
+ * invalid
+ */
+void shared_report(SharedState* shared, SharedTicket* ticket,
+        int agentNumber, Outcome claim) {
+    lock_shared(shared);
+    int firstId = ticket->agentIds[0], secondId = ticket->agentIds[1];
+    Outcome outcome = report_side(shared, ticket, agentNumber - 1, claim);
+    record_outcome(shared, firstId, secondId, outcome);
+    pthread_mutex_unlock(&shared->guard);
+}
+
+/*
+ * Releases every ticket side held by a worker process that has exited.
+ * Its waiting client is withdrawn, and each match it was playing is
+ * treated as if its side had reported an invalid result.
+ * shared - The shared state
+ * owner - The process id of the worker that exited
+ */
+void shared_reclaim(SharedState* shared, pid_t owner) {
+    lock_shared(shared);
+    for (int i = 0; i < shared->numberOfTickets; i++) {
+        SharedTicket* ticket = &shared->tickets[i];
+        if ((ticket->state == TICKET_WAITING ||
+                ticket->state == TICKET_EXPIRED) &&
+                ticket->owners[0] == owner) {
+            if (shared->waiting == i) {
+                shared->waiting = NO_TICKET;
+            }
+            free_ticket(shared, ticket);
+        }
+        for (int side = 0; side < 2; side++) {
+            if (ticket->state == TICKET_PAIRED &&
+                    ticket->owners[side] == owner &&
+                    !ticket->reported[side]) {
+                report_side(shared, ticket, side, NO_OUTCOME);
+            }
+        }
+    }
+    pthread_mutex_unlock(&shared->guard);
+}
+
+/*
+ * Orders agent records by name
+ * first - The first record
+ * second - The second record
+ * Returns a negative, zero or positive value as for strcmp
+ */
+static int compare_records(const void* first, const void* second) {
+    return strcmp(((AgentRecord*) first)->name,
+            ((AgentRecord*) second)->name);
+}
+
+/*
+ * Copies the records of every agent into an array in id order
+ * shared - The shared state to copy
+ * length - Set to the number of records copied
+ * Returns the allocated array of records
+ */
+static AgentRecord* copy_records(SharedState* shared, int* length) {
+    int copied = __atomic_load_n(&shared->numberOfAgents, __ATOMIC_ACQUIRE);
+    AgentRecord* records = malloc(sizeof(AgentRecord) * (copied + 1));
+    for (int i = 0; i < copied; i++) {
+        records[i].name = shared_name(shared, i);
+        records[i].wins = __atomic_load_n(&shared->agents[i].wins,
+                __ATOMIC_RELAXED);
+        records[i].losses = __atomic_load_n(&shared->agents[i].losses,
+                __ATOMIC_RELAXED);
+        records[i].ties = __atomic_load_n(&shared->agents[i].ties,
+                __ATOMIC_RELAXED);
+    }
+    *length = copied;
+    return records;
+}
+
+/*
+ * Takes a snapshot of every agent's record in name order without taking
+ * the guard, retrying the copy as registry_snapshot does so that each
+ * match appears in both agents' records or in neither. If results keep
+ * arriving, the last copy is taken under the guard, which holds off every
+ * update.
+ * shared - The shared state to take a snapshot of
+ * length - Set to the number of records in the snapshot
+ * Returns the allocated array of records, which the caller must free. The
+ * names are owned by the shared state.
+ */
+AgentRecord* shared_snapshot(SharedState* shared, int* length) {
+    AgentRecord* records = NULL;
+    for (int attempt = 0; attempt < SNAPSHOT_ATTEMPTS; attempt++) {
+        unsigned long finished = __atomic_load_n(&shared->updatesFinished,
+                __ATOMIC_ACQUIRE);
+        unsigned long started = __atomic_load_n(&shared->updatesStarted,
+                __ATOMIC_ACQUIRE);
+        if (started != finished) {
+            sched_yield();
+            continue;
+        }
+        records = copy_records(shared, length);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shared->updatesStarted,
+                __ATOMIC_RELAXED) == started) {
+            break;
+        }
+        free(records);
+        records = NULL;
+    }
+    if (records == NULL) {
+        lock_shared(shared);
+        records = copy_records(shared, length);
+        pthread_mutex_unlock(&shared->guard);
+    }
+    qsort(records, *length, sizeof(AgentRecord), compare_records);
+    return records;
+}
@@ -0,0 +1,94 @@
+#ifndef SHARED_H
+#define SHARED_H
+
+#include <pthread.h>
+#include <sys/types.h>
+#include "registry.h"
+#include "timer.h"
+
+#define SHARED_AGENTS (1 << 20)
+#define SHARED_SLOTS (SHARED_AGENTS * 2)
+#define SHARED_NAME_SPACE (1 << 25)
+#define SHARED_PORT_SIZE 108
+#define NO_TICKET -1
+
+// Represents the record of one agent in the shared segment, whose name is
+// kept in the segment's name space. The result counters are updated with
+// atomic operations by whichever worker records a match.
+typedef struct {
+    unsigned int nameOffset;
+    int wins;
+    int losses;
+    int ties;
+} SharedAgent;
+
+// The states a shared ticket passes through
+typedef enum {
+    TICKET_FREE, TICKET_WAITING, TICKET_PAIRED, TICKET_EXPIRED
+} TicketState;
+
+// Represents a client waiting in the shared pairing slot and, once it is
+// paired, the match it plays. Each side of the match is handled by the
+// worker process that accepted its client, which reports the outcome its
+// client claims; the match is recorded once both sides have reported.
+typedef struct {
+    TicketState state;
+    pthread_cond_t paired;
+    int matchId;
+    int agentIds[2];
+    char ports[2][SHARED_PORT_SIZE];
+    pid_t owners[2];
+    int reported[2];
+    Outcome claims[2];
+    int next;
+} SharedTicket;
+
+// Represents the state shared by every worker process, mapped before they
+// are forked. Agents are interned into a fixed open addressing table whose
+// slots hold ids plus one, published with release stores so that names
+// are found and counters read without the guard. The guard is robust, so
+// a worker that dies holding it cannot wedge the others. At most one
+// client waits for a partner at a time, as every new client pairs with
+// the one waiting, so pairing needs a single shared waiting slot.
+typedef struct {
+    pthread_mutex_t guard;
+    int matchId;
+    int waiting;
+    int freeTickets;
+    int numberOfTickets;
+    unsigned long expired[TIMER_PHASES];
+    unsigned long updatesStarted;
+    unsigned long updatesFinished;
+
+    int numberOfAgents;
+    unsigned int nameSpaceUsed;
+    int slots[SHARED_SLOTS];
+    SharedAgent agents[SHARED_AGENTS];
+    char names[SHARED_NAME_SPACE];
+    SharedTicket tickets[];
+} SharedState;
+
+SharedState* shared_create(int numberOfTickets);
+
+int shared_intern(SharedState* shared, char* name);
+
+int shared_lookup(SharedState* shared, char* name);
+
+char* shared_name(SharedState* shared, int id);
+
+SharedTicket* shared_join(SharedState* shared, int agentId, char* port,
+        int* agentNumber);
+
+int shared_wait(SharedState* shared, SharedTicket* ticket);
+
+int shared_expire(SharedState* shared, SharedTicket* ticket);
+
+void shared_count_expired(SharedState* shared, TimerPhase phase);
+
+void shared_report(SharedState* shared, SharedTicket* ticket,
+        int agentNumber, Outcome claim);
+
+void shared_reclaim(SharedState* shared, pid_t owner);
+
+AgentRecord* shared_snapshot(SharedState* shared, int* length);
+#endif
@@ -0,0 +1,121 @@
+#include <stddef.h>
+#include <pthread.h>
+#include "server.h"
+#include "mpsc.h"
+
+#define MAX_BATCH 256
+
+/*
+ * Returns the match a queued link is embedded in
+ * link - The link of a completed match
+ */
+static Match* completed_match(QueueLink* link) {
+    return (Match*) ((char*) link - offsetof(Match, completed));
+}
+
+/*
+ * Returns the time between two timestamps, or 0 if they are out of order
+ * from - The earlier timestamp
+ * to - The later timestamp
+ */
+static unsigned long elapsed(unsigned long from, unsigned long to) {
+    return to > from ? to - from : 0;
+}
+
+/*
+ * Records how long each timed phase of a match took, now that its results
+ * have been recorded
+ * match - The match
+ * recordedAt - The time its results were recorded
+ */
+static void time_match(Match* match, unsigned long recordedAt) {
+    unsigned long sentAt = match->agent1SentAt > match->agent2SentAt ?
+            match->agent1SentAt : match->agent2SentAt;
+    metrics_record_phase(PHASE_MATCH, elapsed(match->pairedAt, sentAt));
+    metrics_record_phase(PHASE_PLAY, elapsed(sentAt, match->reportedAt));
+    metrics_record_phase(PHASE_RECORD,
+            elapsed(match->reportedAt, recordedAt));
+}
+
+/*
+ * Records the results of completed matches forever. This thread is the
+ * only writer of every agent's counters. Matches are drained in batches,
+ * and each batch is bracketed by a single registry update, so snapshots
+ * only retry against whole batches. When results are persisted, each batch
+ * is also committed to the log with a single flush to disk.
+ * serverState - The current state of the server
+ */
+static void* run_stats(void* serverState) {
+    ServerState* server = (ServerState*) serverState;
+    Match* batch[MAX_BATCH];
+    while (1) {
+        mpsc_wait(&server->results);
+        int length = 0;
+        QueueLink* link;
+        while (length < MAX_BATCH &&
+                (link = mpsc_pop(&server->results)) != NULL) {
+            batch[length++] = completed_match(link);
+        }
+        if (length == 0) {
+            continue;
+        }
+        registry_begin_update(&server->registry);
+        for (int i = 0; i < length; i++) {
+            Outcome outcome = batch[i]->relay != NULL ?
+                    relay_outcome(batch[i]->relay) :
+                    validate_results(server, batch[i]->agent1Result,
+                    batch[i]->agent2Result, batch[i]);
+            registry_record(&server->registry, batch[i]->agent1Id,
+                    batch[i]->agent2Id, outcome);
+            metrics_count(METRIC_MATCHES);
+            if (outcome == NO_OUTCOME) {
+                metrics_count(METRIC_INVALID);
+            }
+            if (server->log != NULL) {
+                results_log_append(server->log, &server->registry,
+                        batch[i]->agent1Id, batch[i]->agent2Id, outcome);
+            }
+            if (server->feed != NULL) {
+                feed_record(server->feed, &server->registry,
+                        batch[i]->agent1Id, batch[i]->agent2Id, outcome);
+            }
+        }
+        registry_end_update(&server->registry);
+        if (server->log != NULL) {
+            results_log_commit(server->log, &server->registry);
+        }
+        unsigned long recordedAt = metrics_now();
+        for (int i = 0; i < length; i++) {
+            time_match(batch[i], recordedAt);
+            free_match(batch[i]);
+        }
+    }
+    return (void*) NULL;
+}
+
+/*
+ * Starts the thread that records match results
+ * server - The current state of the server
+ * Returns 0 if the thread was started, else returns -1
+ */
+int stats_start(ServerState* server) {
+    mpsc_init(&server->results);
+    if (pthread_create(&server->statsThread, NULL, run_stats,
+            (void*) server)) {
+        return -1;
+    }
+    pthread_detach(server->statsThread);
+    return 0;
+}
+
+/*
+ * Hands a match whose agents have both reported to the stats thread, which
+ * validates it, records the outcome and frees it. The caller must not use
+ * the match afterwards.
+ * server - The current state of the server
+ * match - The completed match
+ */
+void submit_results(ServerState* server, Match* match) {
+    match->reportedAt = metrics_now();
+    mpsc_push(&server->results, &match->completed);
+}
@@ -0,0 +1,221 @@
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include "timer.h"
+
+#define MILLISECONDS_PER_SECOND 1000
+#define NANOSECONDS_PER_MILLISECOND 1000000L
+#define NANOSECONDS_PER_SECOND 1000000000L
+
+/*
+ * Adds a timer to the slot its deadline falls in. A timer goes in the
+ * lowest level where its deadline is less than a full turn of that level
+ * away, so it is never filed in the slot currently being expired. Must be
+ * called while holding the wheel's guard.
+ * wheel - The wheel to add to
+ * timer - The timer to add, with its deadline set
+ */
+static void insert_timer(TimerWheel* wheel, Timer* timer) {
+    unsigned long furthest = wheel->now + ((WHEEL_SLOTS - 1UL) <<
+            ((WHEEL_LEVELS - 1) * WHEEL_SLOT_BITS));
+    if (timer->deadline > furthest) {
+        timer->deadline = furthest;
+    }
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+            (timer->deadline >> (level * WHEEL_SLOT_BITS)) -
+            (wheel->now >> (level * WHEEL_SLOT_BITS)) >= WHEEL_SLOTS) {
+        level++;
+    }
+    Timer** slot = &wheel->slots[level][(timer->deadline >>
+            (level * WHEEL_SLOT_BITS)) & (WHEEL_SLOTS - 1)];
+    timer->previous = NULL;
+    timer->next = *slot;
+    if (*slot != NULL) {
+        (*slot)->previous = timer;
+    }
+    *slot = timer;
+    timer->pending = 1;
+}
+
+/*
+ * Removes a pending timer from its slot. Must be called while holding the
+ * wheel's guard.
+ * wheel - The wheel to remove from
+ * timer - The timer to remove
+ */
+static void remove_timer(TimerWheel* wheel, Timer* timer) {
+    if (timer->previous != NULL) {
+        timer->previous->next = timer->next;
+    } else {
+        for (int level = 0; level < WHEEL_LEVELS; level++) {
+            Timer** slot = &wheel->slots[level][(timer->deadline >>
+                    (level * WHEEL_SLOT_BITS)) & (WHEEL_SLOTS - 1)];
+            if (*slot == timer) {
+                *slot = timer->next;
+                break;
+            }
+        }
+    }
+    if (timer->next != NULL) {
+        timer->next->previous = timer->previous;
+    }
+    timer->pending = 0;
+}
+
+/*
+ * Detaches every timer in a slot
+ * wheel - The wheel the slot belongs to
+ * level - The level of the slot
+ * index - The index of the slot within its level
+ * Returns the timers that were in the slot
+ */
+static Timer* take_slot(TimerWheel* wheel, int level, int index) {
+    Timer* timers = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    return timers;
+}
+
+/*
+ * Advances the wheel by one tick. Whenever a level completes a turn, the
+ * next slot of the level above is redistributed into the levels below it,
+ * then every timer due this tick is expired. Must be called while holding
+ * the wheel's guard.
+ * wheel - The wheel to advance
+ */
+static void tick(TimerWheel* wheel) {
+    wheel->now++;
+    int cascades = 0;
+    while (cascades < WHEEL_LEVELS - 1 && !(wheel->now &
+            ((1UL << ((cascades + 1) * WHEEL_SLOT_BITS)) - 1))) {
+        cascades++;
+    }
+    for (int level = cascades; level > 0; level--) {
+        Timer* timer = take_slot(wheel, level, (wheel->now >>
+                (level * WHEEL_SLOT_BITS)) & (WHEEL_SLOTS - 1));
+        while (timer != NULL) {
+            Timer* next = timer->next;
+            insert_timer(wheel, timer);
+            timer = next;
+        }
+    }
+    Timer* timer = take_slot(wheel, 0, wheel->now & (WHEEL_SLOTS - 1));
+    while (timer != NULL) {
+        Timer* next = timer->next;
+        timer->pending = 0;
+        if (timer->expire(timer)) {
+            wheel->expired[timer->phase]++;
+        }
+        timer = next;
+    }
+}
+
+/*
+ * Advances a wheel every tick forever, catching up on any ticks missed
+ * while the thread was not scheduled
+ * timerWheel - The wheel to advance
+ */
+static void* run_wheel(void* timerWheel) {
+    TimerWheel* wheel = (TimerWheel*) timerWheel;
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    unsigned long ticks = 0;
+    while (1) {
+        next.tv_nsec += TICK_MILLISECONDS * NANOSECONDS_PER_MILLISECOND;
+        if (next.tv_nsec >= NANOSECONDS_PER_SECOND) {
+            next.tv_nsec -= NANOSECONDS_PER_SECOND;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        ticks++;
+        pthread_mutex_lock(&wheel->guard);
+        while (wheel->now < ticks) {
+            tick(wheel);
+        }
+        pthread_mutex_unlock(&wheel->guard);
+    }
+    return (void*) NULL;
+}
+
+/*
+ * Starts a timer wheel and the thread that advances it
+ * wheel - The wheel to start
+ * timeouts - The number of seconds a session may spend in each phase, or
+ * 0 if the phase has no deadline
+ * Returns 0 if the wheel was started, else returns -1
+ */
+int timer_wheel_start(TimerWheel* wheel, int timeouts[TIMER_PHASES]) {
+    pthread_mutex_init(&wheel->guard, NULL);
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->now = 0;
+    for (int i = 0; i < TIMER_PHASES; i++) {
+        wheel->timeouts[i] = (unsigned long) timeouts[i] *
+                MILLISECONDS_PER_SECOND / TICK_MILLISECONDS;
+        wheel->expired[i] = 0;
+    }
+    if (pthread_create(&wheel->thread, NULL, run_wheel, (void*) wheel)) {
+        return -1;
+    }
+    pthread_detach(wheel->thread);
+    return 0;
+}
+
+/*
+ * Initialises a timer that is not armed
+ * timer - The timer to initialise
+ * expire - Called if the timer's deadline passes
+ * data - The data the timer is for
+ */
+void init_timer(Timer* timer, int (*expire)(Timer*), void* data) {
+    timer->expire = expire;
+    timer->data = data;
+    timer->pending = 0;
+    timer->next = NULL;
+    timer->previous = NULL;
+}
+
+/*
+ * Arms a timer with the deadline of the given phase, replacing any
+ * deadline it already had. A phase without a deadline leaves the timer
+ * disarmed.
+ * wheel - The wheel to arm the timer in
+ * timer - The timer to arm
+ * phase - The phase the timer's session has just entered
+ */
+void timer_arm(TimerWheel* wheel, Timer* timer, TimerPhase phase) {
+    pthread_mutex_lock(&wheel->guard);
+    if (timer->pending) {
+        remove_timer(wheel, timer);
+    }
+    timer->phase = phase;
+    if (wheel->timeouts[phase] > 0) {
+        timer->deadline = wheel->now + wheel->timeouts[phase];
+        insert_timer(wheel, timer);
+    }
+    pthread_mutex_unlock(&wheel->guard);
+}
+
+/*
+ * Disarms a timer. Once this returns the timer's expire function is not
+ * running and will not be called, so the timer's data may be freed.
+ * wheel - The wheel the timer was armed in
+ * timer - The timer to disarm
+ */
+void timer_cancel(TimerWheel* wheel, Timer* timer) {
+    pthread_mutex_lock(&wheel->guard);
+    if (timer->pending) {
+        remove_timer(wheel, timer);
+    }
+    pthread_mutex_unlock(&wheel->guard);
+}
+
+/*
+ * Reads the number of sessions reclaimed in each phase so far
+ * wheel - The wheel to read
+ * expired - Filled in with the number reclaimed in each phase
+ */
+void timer_expired(TimerWheel* wheel, unsigned long expired[TIMER_PHASES]) {
+    pthread_mutex_lock(&wheel->guard);
+    memcpy(expired, wheel->expired, sizeof(wheel->expired));
+    pthread_mutex_unlock(&wheel->guard);
+}
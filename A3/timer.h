@@ -0,0 +1,50 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <pthread.h>
+
+#define WHEEL_LEVELS 4
+#define WHEEL_SLOT_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_SLOT_BITS)
+#define TICK_MILLISECONDS 100
+
+// The phases of a session that can be given a deadline
+typedef enum {
+    TIMER_MR, TIMER_PAIRING, TIMER_RESULT, TIMER_PHASES
+} TimerPhase;
+
+// Represents a deadline for a single session. expire is called by the
+// wheel's thread, while the wheel's guard is held, and returns 1 if it
+// reclaimed the session; it must not arm or cancel any timer.
+typedef struct Timer {
+    int (*expire)(struct Timer* timer);
+    void* data;
+    TimerPhase phase;
+    unsigned long deadline;
+    int pending;
+    struct Timer* next;
+    struct Timer* previous;
+} Timer;
+
+// Represents a hierarchical timer wheel advanced by its own thread. Each
+// level has a slot per tick of the level below it, so arming, cancelling
+// and expiring a timer are all constant time.
+typedef struct {
+    pthread_mutex_t guard;
+    Timer* slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    unsigned long now;
+    unsigned long timeouts[TIMER_PHASES];
+    unsigned long expired[TIMER_PHASES];
+    pthread_t thread;
+} TimerWheel;
+
+int timer_wheel_start(TimerWheel* wheel, int timeouts[TIMER_PHASES]);
+
+void init_timer(Timer* timer, int (*expire)(Timer*), void* data);
+
+void timer_arm(TimerWheel* wheel, Timer* timer, TimerPhase phase);
+
+void timer_cancel(TimerWheel* wheel, Timer* timer);
+
+void timer_expired(TimerWheel* wheel, unsigned long expired[TIMER_PHASES]);
+#endif
@@ -0,0 +1,492 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/io_uring.h>
+#include "util.h"
+#include "server.h"
+#include "session.h"
+
+#define RING_ENTRIES 4096
+#define BUFFER_GROUP 0
+#define BUFFER_COUNT 4096
+#define BUFFER_SIZE 512
+
+// The operation a completion belongs to, kept in the low bits of its
+// user data alongside the session it is for
+#define TAG_MASK 3
+#define TAG_RECV 1
+#define TAG_SEND 2
+#define TAG_ACCEPT 3
+
+// The user data of the receive that probes for multishot support, which
+// no completion handler claims
+#define PROBE_DATA (TAG_MASK + 1)
+
+// Represents a send in flight, which owns the data being sent so that the
+// session can keep queueing output while the kernel reads it
+typedef struct {
+    Session* session;
+    char* data;
+    int length;
+} SendRequest;
+
+// Represents an io_uring instance and the shared memory used to talk to
+// the kernel through it
+typedef struct {
+    ServerState* server;
+    int ringFd;
+    int listenFd;
+
+    unsigned int* sqHead;
+    unsigned int* sqTail;
+    unsigned int sqMask;
+    unsigned int sqEntries;
+    unsigned int* sqArray;
+    struct io_uring_sqe* sqes;
+    unsigned int sqeTail;
+
+    unsigned int* cqHead;
+    unsigned int* cqTail;
+    unsigned int cqMask;
+    struct io_uring_cqe* cqes;
+
+    char* buffers;
+    int freeBuffers;
+    int multishot;
+    Session** starved;
+    int numberOfStarved;
+    int starvedCapacity;
+    Wave wave;
+} Ring;
+
+/*
+ * Submits every queued submission and optionally waits for completions
+ * ring - The ring to submit on
+ * wait - The number of completions to wait for
+ */
+static void submit_ring(Ring* ring, unsigned int wait) {
+    unsigned int toSubmit = ring->sqeTail - *ring->sqTail;
+    __atomic_store_n(ring->sqTail, ring->sqeTail, __ATOMIC_RELEASE);
+    while (syscall(__NR_io_uring_enter, ring->ringFd, toSubmit, wait,
+            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0) < 0 &&
+            errno == EINTR) {
+        toSubmit = 0;
+    }
+}
+
+/*
+ * Returns a cleared submission entry, submitting queued entries first if
+ * the submission queue is full. Entries are only handed to the kernel on
+ * the next submit, so everything queued while handling one batch of
+ * completions goes out in a single system call.
+ * ring - The ring to queue on
+ */
+static struct io_uring_sqe* next_sqe(Ring* ring) {
+    if (ring->sqeTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >=
+            ring->sqEntries) {
+        submit_ring(ring, 0);
+    }
+    unsigned int index = ring->sqeTail & ring->sqMask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    ring->sqArray[index] = index;
+    ring->sqeTail++;
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    return sqe;
+}
+
+/*
+ * Queues the given receive buffers to be handed back to the kernel
+ * ring - The ring the buffers belong to
+ * first - The id of the first buffer
+ * count - The number of consecutive buffers
+ */
+static void provide_buffers(Ring* ring, int first, int count) {
+    struct io_uring_sqe* sqe = next_sqe(ring);
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = count;
+    sqe->addr = (uintptr_t) (ring->buffers + first * BUFFER_SIZE);
+    sqe->len = BUFFER_SIZE;
+    sqe->off = first;
+    sqe->buf_group = BUFFER_GROUP;
+    ring->freeBuffers += count;
+}
+
+/*
+ * Queues an accept on the listener, which is multishot if the kernel
+ * supports it
+ * ring - The ring to accept on
+ */
+static void arm_accept(Ring* ring) {
+    struct io_uring_sqe* sqe = next_sqe(ring);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring->listenFd;
+    sqe->ioprio = ring->multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = TAG_ACCEPT;
+}
+
+/*
+ * Queues a receive on a session using the shared buffer group, so idle
+ * sessions hold no receive buffer of their own. The receive is multishot
+ * if the kernel supports it.
+ * session - The session to receive on
+ */
+static void arm_recv(Session* session) {
+    Ring* ring = (Ring*) session->owner;
+    struct io_uring_sqe* sqe = next_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = session->fd;
+    sqe->ioprio = ring->multishot ? IORING_RECV_MULTISHOT : 0;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = (uintptr_t) session | TAG_RECV;
+    session->pendingOperations++;
+}
+
+/*
+ * Queues a send of the session's buffered output, handing the buffer over
+ * to the send
+ * session - The session to send on
+ */
+static void arm_send(Session* session) {
+    SendRequest* request = malloc(sizeof(SendRequest));
+    request->session = session;
+    request->data = session->output;
+    request->length = session->outputLength;
+    session->output = NULL;
+    session->outputLength = 0;
+    struct io_uring_sqe* sqe = next_sqe((Ring*) session->owner);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = session->fd;
+    sqe->addr = (uintptr_t) request->data;
+    sqe->len = request->length;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uintptr_t) request | TAG_SEND;
+    session->sending = 1;
+    session->pendingOperations++;
+}
+
+/*
+ * Queues a line or frame to be sent to a session. Only one send is in
+ * flight per session, so data queued while one is outstanding waits in its
+ * buffer.
+ * session - The session to send to
+ * data - The line or frame to send
+ * length - The length of the data
+ */
+static void queue_data(Session* session, char* data, int length) {
+    session->output = realloc(session->output,
+            session->outputLength + length);
+    memcpy(session->output + session->outputLength, data, length);
+    session->outputLength += length;
+    if (!session->sending) {
+        arm_send(session);
+    }
+}
+
+/*
+ * Frees a closed session once the kernel holds no operations on it
+ * session - The session to check
+ */
+static void release_if_done(Session* session) {
+    if (session->closed && session->pendingOperations == 0) {
+        close(session->fd);
+        free_session(session);
+    }
+}
+
+/*
+ * Closes a session. Shutting the socket down completes its outstanding
+ * receive, after which the session is freed. A send still in flight, such
+ * as a refusal, is left to complete first, closing the socket once done.
+ * session - The session to close
+ */
+static void close_connection(Session* session) {
+    session->closed = 1;
+    shutdown(session->fd, session->sending ? SHUT_RD : SHUT_RDWR);
+    release_if_done(session);
+}
+
+static const SessionDriver uringDriver = {queue_data, close_connection};
+
+/*
+ * Parks a session whose receive ended because the buffer pool ran dry,
+ * until buffers have been returned to the kernel. Re-arming at once would
+ * only fail again, spinning the loop. A parked session counts as having a
+ * pending operation, so it is not freed while parked.
+ * ring - The ring the session belongs to
+ * session - The session to park
+ */
+static void starve_recv(Ring* ring, Session* session) {
+    if (ring->numberOfStarved == ring->starvedCapacity) {
+        ring->starvedCapacity = ring->starvedCapacity ?
+                ring->starvedCapacity * 2 : 16;
+        ring->starved = realloc(ring->starved,
+                sizeof(Session*) * ring->starvedCapacity);
+    }
+    ring->starved[ring->numberOfStarved++] = session;
+    session->pendingOperations++;
+}
+
+/*
+ * Re-arms the receives of parked sessions once the kernel holds buffers
+ * again. The buffer returns are queued ahead of the receives, so they reach
+ * the kernel first in the same submission.
+ * ring - The ring to re-arm on
+ */
+static void rearm_starved(Ring* ring) {
+    while (ring->numberOfStarved > 0 && ring->freeBuffers > 0) {
+        Session* session = ring->starved[--ring->numberOfStarved];
+        session->pendingOperations--;
+        if (session->closed) {
+            release_if_done(session);
+        } else {
+            arm_recv(session);
+        }
+    }
+}
+
+/*
+ * Handles the completion of a receive on a session. The receive counts as
+ * pending until its completion has been handled, so closing the session
+ * from here never frees it early. A receive that ends without an error is
+ * armed again, which is every completion if receives are single-shot.
+ * ring - The ring the receive completed on
+ * session - The session received on
+ * cqe - The completion
+ */
+static void complete_recv(Ring* ring, Session* session,
+        struct io_uring_cqe* cqe) {
+    int ended = !(cqe->flags & IORING_CQE_F_MORE);
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        int buffer = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        ring->freeBuffers--;
+        if (cqe->res > 0 && !session->closed) {
+            session_receive(session, ring->buffers + buffer * BUFFER_SIZE,
+                    cqe->res);
+        }
+        provide_buffers(ring, buffer, 1);
+    }
+    if (ended && !session->closed) {
+        if (cqe->res == -ENOBUFS) {
+            starve_recv(ring, session);
+        } else if (cqe->res > 0) {
+            arm_recv(session);
+        } else {
+            session_end(session);
+        }
+    }
+    if (ended) {
+        session->pendingOperations--;
+    }
+    release_if_done(session);
+}
+
+/*
+ * Handles the completion of a send, putting back whatever the kernel did
+ * not take ahead of anything queued since, and sending again if needed
+ * request - The send that completed
+ * cqe - The completion
+ */
+static void complete_send(SendRequest* request, struct io_uring_cqe* cqe) {
+    Session* session = request->session;
+    session->pendingOperations--;
+    session->sending = 0;
+    int written = cqe->res < 0 ? request->length : cqe->res;
+    if (written < request->length) {
+        int unsent = request->length - written;
+        char* output = malloc(unsent + session->outputLength);
+        memcpy(output, request->data + written, unsent);
+        memcpy(output + unsent, session->output, session->outputLength);
+        free(session->output);
+        session->output = output;
+        session->outputLength += unsent;
+    }
+    free(request->data);
+    free(request);
+    if (session->outputLength > 0 && !session->closed) {
+        arm_send(session);
+    }
+    release_if_done(session);
+}
+
+/*
+ * Handles the completion of an accept, arming another once the accept has
+ * ended, which is every completion if accepts are single-shot
+ * ring - The ring accepted on
+ * cqe - The completion
+ */
+static void complete_accept(Ring* ring, struct io_uring_cqe* cqe) {
+    if (cqe->res >= 0) {
+        arm_recv(new_session(ring->server, cqe->res, &uringDriver,
+                (void*) ring, &ring->wave));
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        arm_accept(ring);
+    }
+}
+
+/*
+ * Handles every completion currently in the completion queue
+ * ring - The ring to reap
+ */
+static void reap_completions(Ring* ring) {
+    unsigned int head = *ring->cqHead;
+    unsigned int tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & ring->cqMask];
+        void* target = (void*) (uintptr_t) (cqe->user_data &
+                ~(uint64_t) TAG_MASK);
+        switch (cqe->user_data & TAG_MASK) {
+            case TAG_RECV:
+                complete_recv(ring, (Session*) target, cqe);
+                break;
+            case TAG_SEND:
+                complete_send((SendRequest*) target, cqe);
+                break;
+            case TAG_ACCEPT:
+                complete_accept(ring, cqe);
+                break;
+        }
+        head++;
+        if (head == tail) {
+            __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+            tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE);
+        }
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Creates an io_uring instance and maps its queues
+ * ring - The ring to set up
+ * Returns 0 on success, else returns -1
+ */
+static int setup_ring(Ring* ring) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(struct io_uring_params));
+    ring->ringFd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+    if (ring->ringFd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        return -1;
+    }
+    size_t sqSize = params.sq_off.array +
+            params.sq_entries * sizeof(unsigned int);
+    size_t cqSize = params.cq_off.cqes +
+            params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t ringSize = sqSize > cqSize ? sqSize : cqSize;
+    char* queues = mmap(NULL, ringSize, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->ringFd, IORING_OFF_SQ_RING);
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFd,
+            IORING_OFF_SQES);
+    if (queues == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        return -1;
+    }
+    ring->sqHead = (unsigned int*) (queues + params.sq_off.head);
+    ring->sqTail = (unsigned int*) (queues + params.sq_off.tail);
+    ring->sqMask = *(unsigned int*) (queues + params.sq_off.ring_mask);
+    ring->sqEntries = params.sq_entries;
+    ring->sqArray = (unsigned int*) (queues + params.sq_off.array);
+    ring->sqeTail = *ring->sqTail;
+    ring->cqHead = (unsigned int*) (queues + params.cq_off.head);
+    ring->cqTail = (unsigned int*) (queues + params.cq_off.tail);
+    ring->cqMask = *(unsigned int*) (queues + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (queues + params.cq_off.cqes);
+    return 0;
+}
+
+/*
+ * Finds out whether the kernel supports multishot accepts and receives, by
+ * arming a multishot receive on one end of a socket pair whose other end
+ * has sent a byte and closed. A kernel that predates it rejects the receive
+ * as invalid; otherwise the receive ends once it reads the end of the
+ * stream. Multishot receives came after multishot accepts, so the one
+ * probe decides both. Must be called once the buffers have been provided.
+ * ring - The ring to probe
+ * Returns 1 if multishot operations are supported, else returns 0
+ */
+static int probe_multishot(Ring* ring) {
+    int pair[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair)) {
+        return 0;
+    }
+    send(pair[1], "", 1, MSG_NOSIGNAL);
+    close(pair[1]);
+    struct io_uring_sqe* sqe = next_sqe(ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = pair[0];
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUFFER_GROUP;
+    sqe->user_data = PROBE_DATA;
+    int supported = 1, ended = 0;
+    while (!ended) {
+        submit_ring(ring, 1);
+        unsigned int head = *ring->cqHead;
+        while (head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &ring->cqes[head++ & ring->cqMask];
+            if (cqe->user_data != PROBE_DATA) {
+                continue;
+            }
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                ring->freeBuffers--;
+                provide_buffers(ring, cqe->flags >> IORING_CQE_BUFFER_SHIFT,
+                        1);
+            }
+            supported &= cqe->res != -EINVAL;
+            ended |= !(cqe->flags & IORING_CQE_F_MORE);
+        }
+        __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+    }
+    close(pair[0]);
+    return supported;
+}
+
+/*
+ * Serves clients from a single io_uring instead of a thread per client.
+ * Accepts use one multishot accept, every session has one multishot
+ * receive drawing from a shared pool of buffers, and all receives, sends
+ * and buffer returns queued while handling a batch of completions are
+ * submitted together. The match requests received in a batch are paired as
+ * one wave, so the MATCH messages of the whole wave share a submission.
+ * Kernels without multishot operations get single-shot ones instead.
+ * server - The current state of the server, with its listener created
+ * Returns only if the ring could not be set up
+ */
+int run_uring(ServerState* server) {
+    struct rlimit limit;
+    if (!getrlimit(RLIMIT_NOFILE, &limit)) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    Ring ring;
+    ring.server = server;
+    ring.listenFd = server->serverInfo.socketFd;
+    memset(&ring.wave, 0, sizeof(Wave));
+    if (setup_ring(&ring)) {
+        return 1;
+    }
+    ring.buffers = malloc(BUFFER_COUNT * BUFFER_SIZE);
+    ring.freeBuffers = 0;
+    ring.starved = NULL;
+    ring.numberOfStarved = 0;
+    ring.starvedCapacity = 0;
+    provide_buffers(&ring, 0, BUFFER_COUNT);
+    ring.multishot = probe_multishot(&ring);
+    arm_accept(&ring);
+    while (1) {
+        submit_ring(&ring, 1);
+        reap_completions(&ring);
+        session_pair_wave(server, &ring.wave);
+        rearm_starved(&ring);
+    }
+    return 0;
+}
@@ -6,6 +6,8 @@
 #include <netdb.h>
 #include <ctype.h>
 #include <errno.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include "util.h"
 
 #include "util.h"
@@ -101,7 +103,7 @@ char** split_string(char* line, int* length, char delimiter) {
     char** parsedLine = malloc(sizeof(char*));
     int linePosition = 0, position = 0, next = 0, segmentBuffer = 1;
     char* lineSegment = malloc(sizeof(char));
-    int endOfLine = 0, afterText;
+    int endOfLine = 0, afterText = 0;
     while (endOfLine != 1) {
         next = line[linePosition];
 	if ((next == delimiter && afterText) || next == '\0') {
@@ -135,11 +137,72 @@ char** split_string(char* line, int* length, char delimiter) {
 }
 
 /*
- * Connects to the given port 
+ * Frees an array of substrings returned by split_string
+ * splitString - The array of substrings to free
+ * length - The length of the array as reported by split_string
+ */
+void free_split_string(char** splitString, int length) {
+    for (int i = 0; i < length; i++) {
+        free(splitString[i]);
+    }
+    free(splitString);
+}
+
+/*
+ * Returns 1 if the given address is the path of a Unix domain socket,
+ * which is any address containing a '/', else returns 0 for a port on
+ * localhost
+ * address - The address to check
+ */
+int is_unix_address(char* address) {
+    return strchr(address, '/') != NULL;
+}
+
+/*
+ * Fills in the socket address of a Unix domain socket
+ * path - The path of the socket
+ * address - Filled in with the socket address
+ * Returns 0 if the path fits in a socket address, else returns -1
+ */
+static int unix_socket_address(char* path, struct sockaddr_un* address) {
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        return -1;
+    }
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+/*
+ * Connects to the given Unix domain socket
+ * path - The path of the socket to connect to
+ * Returns -1 if connection failed else returns the fd of the socket
+ */
+static int connect_to_path(char* path) {
+    struct sockaddr_un address;
+    if (unix_socket_address(path, &address)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*) &address,
+            sizeof(struct sockaddr_un))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * Connects to the given port, or to the given Unix domain socket if the
+ * port is a path
  * port - The port to connect to
  * Returns -1 if connection failed else returns the fd of the port
  */
 int connect_to_port(char* port) {
+    if (is_unix_address(port)) {
+        return connect_to_path(port);
+    }
     struct addrinfo* ai = 0;
     struct addrinfo hints;
     memset(&hints, 0, sizeof(struct addrinfo));
@@ -174,7 +237,77 @@ int integer_digits(int integer) {
  * Returns 0 if socket was created, else returns -1
  */
 int create_listener(ServerInfo* server) {
-    char* port = "0";
+    return create_port_listener(server, "0", 0);
+}
+
+/*
+ * Checks whether the socket at a path was left by a listener that has
+ * since gone, by trying to connect to it
+ * @param address - the address of the socket
+ * Returns 1 if the connection was refused, so the socket is stale, else
+ * returns 0, including when something still listens on it
+ */
+static int stale_socket(struct sockaddr_un* address) {
+    int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe == -1) {
+        return 0;
+    }
+    int refused = connect(probe, (struct sockaddr*) address,
+            sizeof(struct sockaddr_un)) == -1 && errno == ECONNREFUSED;
+    close(probe);
+    return refused;
+}
+
+/*
+ * Creates a listening Unix domain socket at the given path, replacing any
+ * socket left there by a listener that has gone. A socket something still
+ * listens on, or anything at the path that is not a socket, is left alone
+ * and the listener is not created.
+ * @param server - the server containing the socket
+ * @param path - the path to listen on
+ * Returns 0 if socket was created, else returns -1
+ */
+static int create_path_listener(ServerInfo* server, char* path) {
+    struct sockaddr_un address;
+    if (unix_socket_address(path, &address)) {
+        return -1;
+    }
+    struct stat existing;
+    if (!stat(path, &existing)) {
+        if (!S_ISSOCK(existing.st_mode) || !stale_socket(&address)) {
+            return -1;
+        }
+        unlink(path);
+    }
+    int serv = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (bind(serv, (struct sockaddr*) &address,
+            sizeof(struct sockaddr_un))) {
+        close(serv);
+        return -1;
+    }
+    if (listen(serv, 50000)) {
+        return -1;
+    }
+    server->port = 0;
+    server->path = path;
+    server->socketFd = serv;
+    return 0;
+}
+
+/*
+ * Creates a listening socket on the given port, or a listening Unix domain
+ * socket if the port is a path.
+ * @param server - the server containing the socket
+ * @param port - the port to listen on, or "0" for any free port
+ * @param reusePort - whether other sockets may listen on the same port,
+ * with the kernel spreading new connections across them. Unix domain
+ * sockets cannot share a path, so this is ignored for them.
+ * Returns 0 if socket was created, else returns -1
+ */
+int create_port_listener(ServerInfo* server, char* port, int reusePort) {
+    if (is_unix_address(port)) {
+        return create_path_listener(server, port);
+    }
     struct addrinfo* ai = 0;
     struct addrinfo hints;
     memset(&hints, 0, sizeof(struct addrinfo));
@@ -187,6 +320,10 @@ int create_listener(ServerInfo* server) {
         return -1;
     }
     int serv = socket(AF_INET, SOCK_STREAM, 0);
+    if (reusePort && setsockopt(serv, SOL_SOCKET, SO_REUSEPORT, &reusePort,
+            sizeof(int))) {
+        return -1;
+    }
     if (bind(serv, (struct sockaddr*)ai->ai_addr, sizeof(struct sockaddr))) {
         return -1;
     }
@@ -200,7 +337,33 @@ int create_listener(ServerInfo* server) {
         return -1;
     }
     server->port = ntohs(ad.sin_port);
+    server->path = NULL;
     server->socketFd = serv;
     return 0;
 }
 
+/*
+ * Writes the address a listener can be reached at, which is its path if it
+ * is a Unix domain socket, else its port
+ * output - The stream to write to
+ * server - The listener
+ */
+void write_address(FILE* output, ServerInfo* server) {
+    if (server->path != NULL) {
+        fprintf(output, "%s", server->path);
+    } else {
+        fprintf(output, "%u", server->port);
+    }
+}
+
+/*
+ * Closes a listener, removing its path if it is a Unix domain socket
+ * server - The listener to close
+ */
+void close_listener(ServerInfo* server) {
+    close(server->socketFd);
+    if (server->path != NULL) {
+        unlink(server->path);
+    }
+}
+
@@ -4,9 +4,12 @@
 #include <stdio.h>
 #include <stdbool.h>
 
+// Represents a listener, which is either a TCP port on localhost or, if
+// path is not NULL, a Unix domain socket at that path
 typedef struct {
     unsigned int port;
     int socketFd;
+    char* path;
 } ServerInfo;
 
 char* parse_input(FILE* inputSource, int* endOfFile);
@@ -17,9 +20,19 @@ char* validate_name(char* name);
 
 char** split_string(char* line, int* length, char delimiter);
 
+void free_split_string(char** splitString, int length);
+
+int is_unix_address(char* address);
+
 int connect_to_port(char* port);
 
 int integer_digits(int integer);
 
 int create_listener(ServerInfo* server);
+
+int create_port_listener(ServerInfo* server, char* port, int reusePort);
+
+void write_address(FILE* output, ServerInfo* server);
+
+void close_listener(ServerInfo* server);
 #endif